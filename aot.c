@@ -0,0 +1,412 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "opcodes.h"
+#include "aot.h"
+
+static int32_t *code;
+static int code_size;
+static bool *start;     // instruction boundaries
+static bool *is_unit;   // CALL targets, and 0: each gets a C function
+static bool *reached;   // the current unit's instructions
+static bool *label;     // ...and which of them get jumped to
+static FILE *out;
+
+static int32_t insn_length(int32_t opcode) {
+  return ((uint32_t) opcode < OPCODE_COUNT) ? 1 + args[opcode] : 1;
+}
+
+static bool complete(int32_t at) {
+  return (uint32_t) code[at] < OPCODE_COUNT && at + args[code[at]] < code_size;
+}
+
+static bool valid_target(int32_t target) {
+  return target >= 0 && target <= code_size && start[target];
+}
+
+// the bytecode address this instruction jumps to, -1 if it doesn't, -2 if it's bad
+static int32_t jump_target(int32_t at) {
+  int32_t opcode = code[at];
+  int32_t target;
+  if (!jump_arg[opcode]) {
+    return -1;
+  }
+  target = at + insn_length(opcode) + code[at + jump_arg[opcode]];
+  return valid_target(target) ? target : -2;
+}
+
+static bool falls_through(int32_t opcode) {
+  return opcode != I_JMP && opcode != I_RETURN && opcode != I_STOP && opcode != I_TAILCALL;
+}
+
+// mark what's reachable from entry without going through a CALL
+static void find_unit(int32_t entry) {
+  int32_t *work = (int32_t*) malloc((code_size + 1) * sizeof(int32_t));
+  int work_count = 0;
+  memset(reached, 0, (code_size + 1) * sizeof(bool));
+  memset(label, 0, (code_size + 1) * sizeof(bool));
+  work[work_count++] = entry;
+  reached[entry] = true;
+  while (work_count > 0) {
+    int32_t at = work[--work_count];
+    int32_t target;
+    if (at == code_size || !complete(at)) {
+      continue;
+    }
+    target = jump_target(at);
+    if (target == -2) {
+      continue;
+    }
+    if (code[at] == I_TAILCALL && code[at + 1] == entry) {
+      label[entry] = true;
+    }
+    if (target >= 0) {
+      label[target] = true;
+      if (!reached[target]) {
+        reached[target] = true;
+        work[work_count++] = target;
+      }
+    }
+    if (falls_through(code[at]) && !reached[at + insn_length(code[at])]) {
+      reached[at + insn_length(code[at])] = true;
+      work[work_count++] = at + insn_length(code[at]);
+    }
+  }
+  free(work);
+}
+
+// the locals a unit's code uses, so it only declares those
+#define USES_S 1
+#define USES_D 2
+#define USES_X 4
+#define USES_Y 8
+#define USES_F 16
+
+static int uses(int32_t at) {
+  int32_t opcode = code[at];
+  bool callable = args[opcode] >= 1 && valid_target(code[at + 1]) && code[at + 1] < code_size;
+  if (jump_target(at) == -2) {
+    return 0;
+  }
+  switch (opcode) {
+    case I_PUSH: case I_ADD: case I_SUB: case I_MUL: case I_DIV: case I_MOD:
+    case I_INC: case I_DEC: case I_NEG: case I_FRPUSH: case I_FRPOP:
+    case I_JZ: case I_JNZ: case I_FRPUSH_FRPUSH_ADD: case I_ADD_FRPOP:
+    case I_DEC_JNZ: case I_PUSH_ADD: case I_FRPUSH_JZ: case I_FRPUSH_JNZ:
+      return USES_S;
+    case I_LOADPUSH: case I_POPSTORE: case I_STORE:
+      return USES_S | USES_D;
+    case I_CALL:
+      return callable ? USES_Y | USES_F : 0;
+    case I_TAILCALL:
+      return callable ? USES_S | USES_X | USES_F : 0;
+    case I_RETURN:
+      return USES_S | USES_F;
+  }
+  return 0;
+}
+
+static void underflow_check(int32_t at, int depth) {
+  fprintf(out, "  if (sp < %d) EXIT(%d);\n", depth, at);
+}
+
+static void emit_push(char *value) {
+  fprintf(out, "  s[sp + 1] = %s;\n  sp++;\n", value);
+}
+
+static void emit_push_slot(int32_t slot) {
+  char value[32];
+  sprintf(value, "s[fp %c %u]", slot < 0 ? '-' : '+', slot < 0 ? 0u - slot : (uint32_t) slot);
+  emit_push(value);
+}
+
+static void emit_binary(int32_t opcode) {
+  fputs("  sp--;\n", out);
+  switch (opcode) {
+    case I_ADD: fputs("  s[sp] = WRAP(s[sp], +, s[sp + 1]);\n", out); break;
+    case I_SUB: fputs("  s[sp] = WRAP(s[sp], -, s[sp + 1]);\n", out); break;
+    case I_MUL: fputs("  s[sp] = WRAP(s[sp], *, s[sp + 1]);\n", out); break;
+    case I_DIV: fputs("  s[sp] = s[sp] / s[sp + 1];\n", out); break;
+    case I_MOD: fputs("  s[sp] = s[sp] % s[sp + 1];\n", out); break;
+  }
+}
+
+static void emit_pop_slot(int32_t slot) {
+  fprintf(out, "  s[fp %c %u] = s[sp];\n  sp--;\n", slot < 0 ? '-' : '+', slot < 0 ? 0u - slot : (uint32_t) slot);
+}
+
+static void emit_branch(bool if_zero, int32_t target) {
+  fprintf(out, "  if (%ss[sp]) goto L_%04x;\n", if_zero ? "!" : "", target);
+}
+
+/*
+ * The same frame as I_CALL. A unit only ever returns to the unit that
+ * called it, so anything else coming back is a unit that exited. Calls
+ * nest on the C stack, so past NATIVE_DEPTH the rest is left to execute().
+ */
+static void emit_call(int32_t at, int32_t target, int32_t arg_count) {
+  fprintf(out, "  if (vm->csp == NATIVE_DEPTH) EXIT(%d);\n", at);
+  fprintf(out, "  f = &vm->control[vm->csp++];\n  f->ip = %d;\n  f->fp = fp;\n  f->sp = sp - %d;\n", at + 3, arg_count);
+  fprintf(out, "  y = unit_%04x(vm, sp, sp + 1);\n", target);
+  fprintf(out, "  if (y != %d) {\n", at + 3);
+  fputs("    return EXITED;\n", out);
+  fputs("  }\n", out);
+  fputs("  sp = vm->sp;\n  fp = vm->fp;\n", out);
+}
+
+static void emit_return(int32_t at) {
+  fprintf(out, "  if (vm->csp == 0) EXIT(%d);\n", at);
+  fputs("  f = &vm->control[--vm->csp];\n", out);
+  fputs("  s[f->sp + 1] = s[sp];\n", out);
+  fputs("  vm->sp = f->sp + 1;\n", out);
+  fputs("  vm->fp = f->fp;\n", out);
+  fputs("  return f->ip;\n", out);
+}
+
+/*
+ * Move the arguments down over the current frame's, then go to the target:
+ * a goto if it's this unit, or a call in tail position otherwise, which the
+ * C compiler turns into a jump.
+ */
+static void emit_tailcall(int32_t at, int32_t target, int32_t arg_count, int32_t entry) {
+  fprintf(out, "  if (vm->csp == 0) EXIT(%d);\n", at);
+  fputs("  f = &vm->control[vm->csp - 1];\n", out);
+  fprintf(out, "  for (x = 0; x < %d; x++) s[f->sp + 1 + x] = s[sp - %d + x];\n", arg_count, arg_count - 1);
+  fprintf(out, "  sp = f->sp + %d;\n  fp = sp + 1;\n", arg_count);
+  if (target == entry) {
+    fprintf(out, "  goto L_%04x;\n", target);
+  } else {
+    fprintf(out, "  return unit_%04x(vm, sp, fp);\n", target);
+  }
+}
+
+static void emit_insn(int32_t at, int32_t entry) {
+  int32_t opcode = code[at];
+  int32_t a = (args[opcode] >= 1) ? code[at + 1] : 0;
+  int32_t b = (args[opcode] >= 2) ? code[at + 2] : 0;
+  int32_t target = jump_target(at);
+  char value[32];
+
+  if (target == -2) {
+    fprintf(out, "  EXIT(%d);\n", at);
+    return;
+  }
+  switch (opcode) {
+    case I_POPSTORE: case I_STORE: case I_FRPOP: case I_PUSH_ADD:
+      underflow_check(at, 0);
+      break;
+    case I_ADD: case I_SUB: case I_MUL: case I_DIV: case I_MOD:
+    case I_ADD_FRPOP:
+      underflow_check(at, 1);
+      break;
+  }
+  switch (opcode) {
+    case I_NOP:
+      break;
+    case I_PUSH:
+      sprintf(value, "%d", a);
+      emit_push(value);
+      break;
+    case I_POP:
+      fputs("  sp--;\n", out);
+      break;
+    case I_ADD: case I_SUB: case I_MUL: case I_DIV: case I_MOD:
+      emit_binary(opcode);
+      break;
+    case I_INC:
+      fputs("  s[sp] = WRAP(s[sp], +, 1);\n", out);
+      break;
+    case I_DEC:
+      fputs("  s[sp] = WRAP(s[sp], -, 1);\n", out);
+      break;
+    case I_NEG:
+      fputs("  s[sp] = WRAP(0, -, s[sp]);\n", out);
+      break;
+    case I_LOADPUSH:
+      sprintf(value, "d[%d]", a);
+      emit_push(value);
+      break;
+    case I_POPSTORE:
+      fprintf(out, "  d[%d] = s[sp];\n  sp--;\n", a);
+      break;
+    case I_STORE:
+      fprintf(out, "  d[%d] = s[sp];\n", a);
+      break;
+    case I_FRPUSH:
+      emit_push_slot(a);
+      break;
+    case I_FRPOP:
+      emit_pop_slot(a);
+      break;
+    case I_JZ:
+      emit_branch(true, target);
+      break;
+    case I_JNZ:
+      emit_branch(false, target);
+      break;
+    case I_JMP:
+      fprintf(out, "  goto L_%04x;\n", target);
+      break;
+    case I_CALL:
+      if (valid_target(a) && a < code_size) {
+        emit_call(at, a, b);
+      } else {
+        fprintf(out, "  EXIT(%d);\n", at);
+      }
+      break;
+    case I_TAILCALL:
+      if (valid_target(a) && a < code_size) {
+        emit_tailcall(at, a, b, entry);
+      } else {
+        fprintf(out, "  EXIT(%d);\n", at);
+      }
+      break;
+    case I_RETURN:
+      emit_return(at);
+      break;
+    case I_FRPUSH_FRPUSH_ADD:
+      emit_push_slot(a);
+      emit_push_slot(b);
+      emit_binary(I_ADD);
+      break;
+    case I_ADD_FRPOP:
+      emit_binary(I_ADD);
+      emit_pop_slot(a);
+      break;
+    case I_DEC_JNZ:
+      fputs("  s[sp] = WRAP(s[sp], -, 1);\n", out);
+      emit_branch(false, target);
+      break;
+    case I_PUSH_ADD:
+      fprintf(out, "  s[sp] = WRAP(s[sp], +, %d);\n", a);
+      break;
+    case I_FRPUSH_JZ:
+      emit_push_slot(a);
+      emit_branch(true, target);
+      break;
+    case I_FRPUSH_JNZ:
+      emit_push_slot(a);
+      emit_branch(false, target);
+      break;
+    default:
+      // STOP, and the typed value, bulk array and NATIVE instructions,
+      // which execute() does for us
+      fprintf(out, "  EXIT(%d);\n", at);
+      break;
+  }
+}
+
+static void emit_unit(int32_t entry) {
+  int32_t at;
+  bool first = true;
+  int used = 0;
+  find_unit(entry);
+  for (at = 0; at < code_size; at += insn_length(code[at])) {
+    if (reached[at] && complete(at)) {
+      used |= uses(at);
+    }
+  }
+  fprintf(out, "\nstatic int32_t unit_%04x(VM *vm, int32_t sp, int32_t fp) {\n", entry);
+  if (used & USES_S) fputs("  int32_t *s = vm->stack;\n", out);
+  if (used & USES_D) fputs("  int32_t *d = vm->data;\n", out);
+  if (used & USES_X) fputs("  int32_t x;\n", out);
+  if (used & USES_Y) fputs("  int32_t y;\n", out);
+  if (used & USES_F) fputs("  Frame *f;\n", out);
+  for (at = 0; at <= code_size; at += (at < code_size) ? insn_length(code[at]) : 1) {
+    if (!reached[at]) {
+      continue;
+    }
+    if (first && at != entry) {
+      fprintf(out, "  goto L_%04x;\n", entry);
+      label[entry] = true;
+    }
+    first = false;
+    if (label[at]) {
+      fprintf(out, "L_%04x:\n", at);
+    }
+    if (at == code_size || !complete(at)) {
+      fprintf(out, "  EXIT(%d);\n", at);
+      continue;
+    }
+    fprintf(out, "  // %s", instructions[code[at]]);
+    if (args[code[at]] >= 1) fprintf(out, " %d", code[at + 1]);
+    if (args[code[at]] >= 2) fprintf(out, ", %d", code[at + 2]);
+    fputs("\n", out);
+    emit_insn(at, entry);
+  }
+  fputs("}\n", out);
+}
+
+static void emit_array(char *name, char *size, int32_t *values, int count) {
+  int i;
+  // leave off the trailing zeros
+  while (count > 0 && values[count - 1] == 0) {
+    count--;
+  }
+  fprintf(out, "static int32_t %s[%s] = {", name, size);
+  for (i = 0; i < count; i++) {
+    fprintf(out, "%s%d", (i % 16) ? ", " : (i ? ",\n  " : "\n  "), values[i]);
+  }
+  fputs(count ? "\n};\n" : " 0 };\n", out);
+}
+
+void aot_compile(FILE *output, int32_t *program, int program_size, int32_t *data, int data_size) {
+  int32_t at;
+  out = output;
+  code = program;
+  code_size = program_size;
+  start = (bool*) calloc(code_size + 1, sizeof(bool));
+  is_unit = (bool*) calloc(code_size + 1, sizeof(bool));
+  reached = (bool*) calloc(code_size + 1, sizeof(bool));
+  label = (bool*) calloc(code_size + 1, sizeof(bool));
+
+  for (at = 0; at < code_size; at += insn_length(code[at])) {
+    start[at] = true;
+  }
+  start[code_size] = true;
+  is_unit[0] = true;
+  for (at = 0; at < code_size; at += insn_length(code[at])) {
+    if (IS_CALL(code[at]) && complete(at) && valid_target(code[at + 1]) && code[at + 1] < code_size) {
+      is_unit[code[at + 1]] = true;
+    }
+  }
+
+  fputs("// Generated from VM bytecode by aot_compile(); see aot.h.\n\n", out);
+  fputs("#include <stdint.h>\n\n#include \"vm.h\"\n\n", out);
+  fprintf(out, "#define CODE_SIZE %d\n#define DATA_SIZE %d\n\n", code_size, data_size);
+  fputs("// returned by a unit that has left the rest of the run to execute()\n", out);
+  fputs("#define EXITED INT32_MIN\n", out);
+  fputs("#define EXIT(at) do { vm->ip = (at); vm->sp = sp; vm->fp = fp; return EXITED; } while (0)\n", out);
+  fputs("#define WRAP(a, op, b) ((int32_t) ((uint32_t) (a) op (uint32_t) (b)))\n\n", out);
+  emit_array("code", "CODE_SIZE", code, code_size);
+  emit_array("data", "DATA_SIZE", data, data_size);
+  fputs("\n", out);
+  for (at = 0; at < code_size; at++) {
+    if (is_unit[at]) {
+      fprintf(out, "static int32_t unit_%04x(VM *vm, int32_t sp, int32_t fp);\n", at);
+    }
+  }
+  for (at = 0; at < code_size; at++) {
+    if (is_unit[at]) {
+      emit_unit(at);
+    }
+  }
+
+  // the units work on the VM's stacks, so they need the guard up too
+  fputs("\nstatic void run_units(VM *vm) {\n  unit_0000(vm, vm->sp, vm->fp);\n}\n", out);
+  fputs("\nvoid aot_execute(VM *vm) {\n", out);
+  fputs("  if (vm->ip == 0 && !run_guarded(vm, run_units)) {\n    return;\n  }\n", out);
+  fputs("  execute(vm);\n}\n", out);
+  fputs("\nint main() {\n", out);
+  fputs("  static VM vm;\n", out);
+  fputs("  init(&vm, load_program(code, CODE_SIZE), data, DATA_SIZE);\n", out);
+  fputs("  aot_execute(&vm);\n  state_dump(&vm);\n  return 0;\n}\n", out);
+
+  free(start);
+  free(is_unit);
+  free(reached);
+  free(label);
+}
@@ -0,0 +1,27 @@
+#ifndef AOT_H_INCLUDED
+#define AOT_H_INCLUDED
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Write out a C translation unit that runs the given program: basic blocks
+ * become straight-line C, jumps become gotos, and every CALL target becomes
+ * a C function called with a real C call. It is built against vm.h and
+ * linked with vm.o:
+ *
+ *   c99 -O2 -o prog prog.c vm.o opcodes.o jit.o
+ *
+ * The generated code works on the VM's own stack and data, building the
+ * same call frames as execute(), so it ends in exactly the same state.
+ * A TAILCALL becomes a C call in tail position, which the C compiler makes
+ * a jump. Anything it doesn't do itself (STOP, errors) it hands over to
+ * execute() at that instruction.
+ *
+ * The generated file defines aot_execute(VM*), a drop-in for execute(vm)
+ * on an untraced VM set up with this program, and a main() that runs it
+ * once and calls state_dump().
+ */
+extern void aot_compile(FILE *out, int32_t *code, int code_size, int32_t *data, int data_size);
+
+#endif
@@ -0,0 +1,65 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "arena.h"
+
+static ArenaBlock *new_block(size_t size, ArenaBlock *next) {
+  ArenaBlock *block = (ArenaBlock*) malloc(ARENA_HEADER_SIZE + size);
+  if (!block) {
+    fprintf(stderr, "Out of memory for an arena of %zu bytes\n", size);
+    exit(1);
+  }
+  block->next = next;
+  block->size = size;
+  block->used = 0;
+  return block;
+}
+
+void *arena_grow(Arena *arena, size_t size) {
+  ArenaBlock *block = arena->block;
+  // at least double the last block, so there are few of them
+  size_t block_size = block ? 2 * block->size : arena->block_size;
+  while (block_size < size) {
+    block_size *= 2;
+  }
+  block = arena->block = new_block(block_size, block);
+  block->used = size;
+  return (char*) block + ARENA_HEADER_SIZE;
+}
+
+char *arena_strdup(Arena *arena, const char *string) {
+  size_t size = strlen(string) + 1;
+  return (char*) memcpy(arena_alloc(arena, size), string, size);
+}
+
+void arena_reset(Arena *arena) {
+  ArenaBlock *block = arena->block;
+  size_t total = 0;
+  if (!block) {
+    return;
+  }
+  if (!block->next) {
+    block->used = 0;
+    return;
+  }
+  // next time it all fits in one
+  while (block) {
+    ArenaBlock *next = block->next;
+    total += block->size;
+    free(block);
+    block = next;
+  }
+  arena->block = new_block(total, NULL);
+}
+
+void arena_free(Arena *arena) {
+  ArenaBlock *block = arena->block;
+  while (block) {
+    ArenaBlock *next = block->next;
+    free(block);
+    block = next;
+  }
+  arena->block = NULL;
+}
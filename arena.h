@@ -0,0 +1,50 @@
+#ifndef ARENA_H_INCLUDED
+#define ARENA_H_INCLUDED
+
+#include <stddef.h>
+
+/*
+ * A bump allocator: arena_alloc() hands out the next bytes of the current
+ * block, getting a bigger block from malloc only when that one's full, and
+ * nothing is freed on its own. arena_reset() frees everything at once; if
+ * it took more than one block, they're swapped for one block big enough
+ * for the lot, so an arena reset after every use soon stops calling malloc
+ * at all.
+ */
+typedef struct _ArenaBlock {
+  struct _ArenaBlock *next;  // the one filled before it
+  size_t size;
+  size_t used;
+} ArenaBlock;
+
+typedef struct _Arena {
+  ArenaBlock *block;         // the one being filled, or NULL
+  size_t block_size;         // the least a block is
+} Arena;
+
+#define ARENA_INIT(block_size) { NULL, (block_size) }
+
+// everything handed out is aligned for any pointer or integer
+#define ARENA_ALIGN 8
+// the header rounded up the same way, so the first allocation is aligned too
+#define ARENA_HEADER_SIZE ((sizeof(ArenaBlock) + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1))
+
+// the slow path, for when the current block is full
+extern void *arena_grow(Arena *arena, size_t size);
+
+static inline void *arena_alloc(Arena *arena, size_t size) {
+  ArenaBlock *block = arena->block;
+  size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+  if (block && block->size - block->used >= size) {
+    void *bytes = (char*) block + ARENA_HEADER_SIZE + block->used;
+    block->used += size;
+    return bytes;
+  }
+  return arena_grow(arena, size);
+}
+
+extern char *arena_strdup(Arena *arena, const char *string);
+extern void arena_reset(Arena *arena);
+extern void arena_free(Arena *arena);
+
+#endif
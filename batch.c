@@ -0,0 +1,106 @@
+// for sysconf() and clock_gettime()
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vm.h"
+#include "batch.h"
+
+// runs handed to a worker at a time, so they aren't queueing on the lock
+#define CHUNK 64
+
+typedef struct _Batch {
+  Program *program;
+  int32_t *data;
+  int data_size;
+  int runs;
+  int32_t *results;
+  pthread_mutex_t lock;
+  int next;           // the first run nobody has taken yet
+} Batch;
+
+static int take(Batch *batch) {
+  int first;
+  pthread_mutex_lock(&batch->lock);
+  first = batch->next;
+  batch->next += CHUNK;
+  pthread_mutex_unlock(&batch->lock);
+  return first;
+}
+
+static void *worker(void *arg) {
+  Batch *batch = (Batch*) arg;
+  // zeroed, so the first init() maps its stacks and the rest reuse them
+  VM *vm = (VM*) calloc(1, sizeof(VM));
+  int first;
+  int run;
+  while ((first = take(batch)) < batch->runs) {
+    for (run = first; run < first + CHUNK && run < batch->runs; run++) {
+      init(vm, batch->program, batch->data + (size_t) run * batch->data_size, batch->data_size);
+      vm->jit = false;
+      execute(vm);
+      if (batch->results) {
+        batch->results[run] = (vm->sp >= 0) ? vm->stack[vm->sp] : 0;
+      }
+    }
+  }
+  free_stacks(vm);
+  free(vm);
+  return NULL;
+}
+
+static double now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+BatchStats run_batch(Program *program, int32_t *data, int data_size, int runs,
+    int32_t *results, int threads) {
+  Batch batch = { .program = program, .data = data, .data_size = data_size,
+    .runs = runs, .results = results };
+  BatchStats stats;
+  pthread_t *pool;
+  double start;
+  int i;
+
+  if (threads <= 0) {
+    threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0) {
+      threads = 1;
+    }
+  }
+  pthread_mutex_init(&batch.lock, NULL);
+  batch.next = 0;
+  pool = (pthread_t*) malloc(threads * sizeof(pthread_t));
+
+  start = now();
+  for (i = 0; i < threads; i++) {
+    if (pthread_create(&pool[i], NULL, worker, &batch) != 0) {
+      // carry on with the ones we've got, or do it all here
+      threads = i;
+      break;
+    }
+  }
+  if (threads == 0) {
+    worker(&batch);
+    threads = 1;
+  } else {
+    for (i = 0; i < threads; i++) {
+      pthread_join(pool[i], NULL);
+    }
+  }
+  stats.seconds = now() - start;
+
+  free(pool);
+  pthread_mutex_destroy(&batch.lock);
+  stats.runs = runs;
+  stats.threads = threads;
+  stats.runs_per_second = (stats.seconds > 0) ? runs / stats.seconds : 0;
+  return stats;
+}
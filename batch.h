@@ -0,0 +1,29 @@
+#ifndef BATCH_H_INCLUDED
+#define BATCH_H_INCLUDED
+
+#include <stdint.h>
+
+#include "vm.h"
+
+/*
+ * How a batch went. runs_per_second is over the wall clock time of the
+ * whole batch, thread start up and all.
+ */
+typedef struct _BatchStats {
+  int runs;
+  int threads;
+  double seconds;
+  double runs_per_second;
+} BatchStats;
+
+/*
+ * Run program runs times, spread over a pool of threads (0 means one per
+ * online CPU), each thread with a VM of its own. Run i gets its own data
+ * segment, data + i * data_size, and changes it in place; the top of its
+ * stack at the end (0 if it's empty) goes in results[i] unless results is
+ * NULL. Runs don't trace or use the JIT.
+ */
+extern BatchStats run_batch(Program *program, int32_t *data, int data_size, int runs,
+    int32_t *results, int threads);
+
+#endif
@@ -0,0 +1,839 @@
+// for clock_gettime() and dprintf()
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "opcodes.h"
+#include "vm.h"
+#include "regvm.h"
+#include "jit.h"
+#include "compiler.h"
+#include "layout.h"
+#include "value.h"
+#include "bulk.h"
+#include "native.h"
+#include "snapshot.h"
+
+/*
+ * The benchmark suite behind "make bench". Each workload is a bytecode
+ * program that loops over a kernel and leaves its last result in data[0].
+ * Each tier it runs on gets WARMUP untimed runs and then reps timed ones,
+ * and the best and median times are reported per bytecode instruction
+ * executed, counted once up front. The compiler is timed per token, from
+ * scan_input() through write_instructions(), and the lexer per byte of a
+ * multi-megabyte script read by scan_file(). The bulk array instructions
+ * are timed per element, once with each set of kernels in bulk.c this CPU
+ * can run and once against the same work unrolled into ordinary
+ * instructions, as there are none that index data. Printing is timed per
+ * integer written to /dev/null by NATIVE print_int, buffered, and by a
+ * native that does a dprintf() each. Startup is timed per request served,
+ * by a VM that runs its prelude first and by one cloned from a snapshot
+ * taken after it.
+ *
+ * Output is one tab separated line per workload and tier, so runs from two
+ * commits can be compared: -c FILE adds how much slower (+) or faster (-)
+ * each median is than in FILE, a previous run's output.
+ */
+
+#define WARMUP 2
+#define REPS 7
+#define BENCH_CODE_SIZE 4096
+#define BENCH_DATA_SIZE 16
+
+typedef struct _Workload {
+  char *name;
+  int32_t *code;
+  int code_size;
+  int32_t expected;   // in data[0] after a run
+} Workload;
+
+// driver: run fact(12) 20000 times
+int32_t fact_code[] = {
+  I_PUSH, 20000,
+  I_PUSH, 12,
+  I_CALL, 13, 1,
+  I_POPSTORE, 0,
+  I_DEC,
+  I_JNZ, -10,
+  I_STOP,
+// @13: fact(n), as in demo.c
+  I_FRPUSH, -1,
+  I_JNZ, 4,
+  I_POP,
+  I_PUSH, 1,
+  I_RETURN,
+  I_DEC,
+  I_JNZ, 4,
+  I_POP,
+  I_PUSH, 1,
+  I_RETURN,
+  I_CALL, 13, 1,
+  I_FRPUSH, -1,
+  I_MUL,
+  I_RETURN,
+};
+
+// driver: run fib(24) 4 times
+int32_t fib_code[] = {
+  I_PUSH, 4,
+  I_PUSH, 24,
+  I_CALL, 13, 1,
+  I_POPSTORE, 0,
+  I_DEC,
+  I_JNZ, -10,
+  I_STOP,
+// @13: fib(n)
+  I_FRPUSH, -1,
+  I_JNZ, 1,
+  I_RETURN,      // fib(0) = 0
+  I_DEC,
+  I_JNZ, 3,
+  I_PUSH, 1,
+  I_RETURN,      // fib(1) = 1
+  I_CALL, 13, 1, // fib(n - 1)
+  I_FRPUSH, -1,
+  I_DEC,
+  I_DEC,
+  I_CALL, 13, 1, // fib(n - 2)
+  I_ADD,
+  I_RETURN,
+};
+
+// driver: run multiply(1000, 3) 300 times
+int32_t multiply_code[] = {
+  I_PUSH, 300,
+  I_PUSH, 1000,
+  I_PUSH, 3,
+  I_CALL, 15, 2,
+  I_POPSTORE, 0,
+  I_DEC,
+  I_JNZ, -12,
+  I_STOP,
+// @15: multiply(x, y), as in demo.c
+  I_PUSH,    0,
+  I_FRPUSH, -2,
+  I_JZ, +12,
+  I_DEC,
+  I_FRPOP, -2,
+  I_FRPUSH, 0,
+  I_FRPUSH, -1,
+  I_ADD,
+  I_FRPOP, 0,
+  I_JMP, -16,
+  I_POP,
+  I_RETURN,
+};
+
+// driver: run down(1000) 500 times, 1000 calls deep
+int32_t calls_code[] = {
+  I_PUSH, 500,
+  I_PUSH, 1000,
+  I_CALL, 13, 1,
+  I_POPSTORE, 0,
+  I_DEC,
+  I_JNZ, -10,
+  I_STOP,
+// @13: down(n), which is n the long way
+  I_FRPUSH, -1,
+  I_JNZ, 1,
+  I_RETURN,
+  I_DEC,
+  I_CALL, 13, 1,
+  I_INC,
+  I_RETURN,
+};
+
+// driver: run count(10000, 0) 100 times, in one frame however far it counts
+int32_t tailcalls_code[] = {
+  I_PUSH, 100,
+  I_PUSH, 10000,
+  I_PUSH, 0,
+  I_CALL, 15, 2,
+  I_POPSTORE, 0,
+  I_DEC,
+  I_JNZ, -12,
+  I_STOP,
+// @15: count(n, total), which is total + n the long way
+  I_FRPUSH, -2,
+  I_JZ, 7,
+  I_DEC,
+  I_FRPUSH, -1,
+  I_INC,
+  I_TAILCALL, 15, 2, // count(n - 1, total + 1)
+  I_FRPUSH, -1,
+  I_RETURN,
+};
+
+// straight line arithmetic, filled in by arithmetic()
+#define ARITHMETIC_ROUNDS 64
+int32_t arithmetic_code[BENCH_CODE_SIZE];
+
+// x = ((x + 7) * 3 % 1000 - 5) * 5 / 3, which never overflows
+int32_t arithmetic_ops[][2] = {
+  { 7, I_ADD }, { 3, I_MUL }, { 1000, I_MOD }, { 5, I_SUB }, { 5, I_MUL }, { 3, I_DIV }
+};
+
+static int arithmetic(int32_t *expected) {
+  int32_t x = 7;
+  int at = 0;
+  int round;
+  int i;
+  arithmetic_code[at++] = I_PUSH;
+  arithmetic_code[at++] = 4000;
+  arithmetic_code[at++] = I_LOADPUSH;
+  arithmetic_code[at++] = 1;
+  for (round = 0; round < ARITHMETIC_ROUNDS; round++) {
+    for (i = 0; i < 6; i++) {
+      arithmetic_code[at++] = I_PUSH;
+      arithmetic_code[at++] = arithmetic_ops[i][0];
+      arithmetic_code[at++] = arithmetic_ops[i][1];
+      switch (arithmetic_ops[i][1]) {
+        case I_ADD: x += arithmetic_ops[i][0]; break;
+        case I_MUL: x *= arithmetic_ops[i][0]; break;
+        case I_MOD: x %= arithmetic_ops[i][0]; break;
+        case I_SUB: x -= arithmetic_ops[i][0]; break;
+        case I_DIV: x /= arithmetic_ops[i][0]; break;
+      }
+    }
+  }
+  arithmetic_code[at++] = I_POPSTORE;
+  arithmetic_code[at++] = 0;
+  arithmetic_code[at++] = I_DEC;
+  arithmetic_code[at++] = I_JNZ;
+  arithmetic_code[at] = 2 - (at + 1);
+  at++;
+  arithmetic_code[at++] = I_STOP;
+  *expected = x;
+  return at;
+}
+
+// x = x * a + b over typed values of each type, filled in by values()
+#define VALUES_LOOPS 100000
+int32_t values_code[TAG_COUNT][BENCH_CODE_SIZE];
+
+static void push_value(int32_t *code, int *at, int32_t *value) {
+  int i;
+  for (i = 0; i < VALUE_WORDS; i++) {
+    code[(*at)++] = I_PUSH;
+    code[(*at)++] = value[i];
+  }
+}
+
+/*
+ * x is in the top level frame's first three slots with the loop count on
+ * top, and what's left in data[0] is the sum of x's two payload words.
+ */
+static int values(int tag, int32_t *expected) {
+  int32_t *code = values_code[tag];
+  int32_t x[VALUE_WORDS] = { 1, 0, tag };
+  int32_t a[VALUE_WORDS] = { 3, 0, tag };
+  int32_t b[VALUE_WORDS] = { 7, 0, tag };
+  int at = 0;
+  int loop;
+  int i;
+  if (tag == TAG_INT64) {
+    value_set_int64(x, (int64_t) 1 << 40);
+  } else if (tag == TAG_DOUBLE) {
+    value_set_double(x, 1.0);
+    value_set_double(a, 1.0000001);
+    value_set_double(b, 0.5);
+  }
+  push_value(code, &at, x);
+  code[at++] = I_PUSH;
+  code[at++] = VALUES_LOOPS;
+  loop = at;
+  for (i = 0; i < VALUE_WORDS; i++) {
+    code[at++] = I_FRPUSH;
+    code[at++] = i;
+  }
+  push_value(code, &at, a);
+  code[at++] = I_VMUL;
+  push_value(code, &at, b);
+  code[at++] = I_VADD;
+  for (i = VALUE_WORDS - 1; i >= 0; i--) {
+    code[at++] = I_FRPOP;
+    code[at++] = i;
+  }
+  code[at++] = I_DEC;
+  code[at++] = I_JNZ;
+  code[at] = loop - (at + 1);
+  at++;
+  code[at++] = I_POP;
+  code[at++] = I_POP;
+  code[at++] = I_ADD;
+  code[at++] = I_POPSTORE;
+  code[at++] = 0;
+  code[at++] = I_STOP;
+
+  for (i = 0; i < VALUES_LOOPS; i++) {
+    switch (tag) {
+      case TAG_INT32:
+        x[VALUE_LOW] = (int32_t) ((uint32_t) x[VALUE_LOW] * (uint32_t) a[VALUE_LOW] + (uint32_t) b[VALUE_LOW]);
+        break;
+      case TAG_INT64:
+        value_set_bits(x, value_bits(x) * value_bits(a) + value_bits(b));
+        break;
+      case TAG_DOUBLE:
+        value_set_double(x, value_double(x) * value_double(a) + value_double(b));
+        break;
+    }
+  }
+  *expected = (int32_t) ((uint32_t) x[VALUE_LOW] + (uint32_t) x[VALUE_HIGH]);
+  return at;
+}
+
+Workload workloads[] = {
+  { "fact", fact_code, sizeof(fact_code) / sizeof(int32_t), 479001600 },
+  { "fib", fib_code, sizeof(fib_code) / sizeof(int32_t), 46368 },
+  { "multiply", multiply_code, sizeof(multiply_code) / sizeof(int32_t), 3000 },
+  { "calls", calls_code, sizeof(calls_code) / sizeof(int32_t), 1000 },
+  { "tailcalls", tailcalls_code, sizeof(tailcalls_code) / sizeof(int32_t), 10000 },
+  { "values_int32", values_code[TAG_INT32], 0, 0 },
+  { "values_int64", values_code[TAG_INT64], 0, 0 },
+  { "values_double", values_code[TAG_DOUBLE], 0, 0 },
+  { "arithmetic", arithmetic_code, 0, 0 },
+};
+#define WORKLOAD_COUNT ((int) (sizeof(workloads) / sizeof(Workload)))
+// the generated ones, which main() fills in
+#define VALUES_WORKLOAD (WORKLOAD_COUNT - 1 - TAG_COUNT)
+#define ARITHMETIC_WORKLOAD (WORKLOAD_COUNT - 1)
+
+#define TIER_STACK     0
+#define TIER_VERIFIED  1
+#define TIER_REGISTERS 2
+#define TIER_JIT       3
+#define TIER_LAYOUT    4
+#define TIER_COUNT     5
+char *tiers[] = { "stack", "verified", "registers", "jit", "layout" };
+
+// a previous run, for -c
+typedef struct _Baseline {
+  char name[32];
+  char tier[32];
+  double median;
+} Baseline;
+
+Baseline *baseline = NULL;
+int baseline_count = 0;
+int reps = REPS;
+
+static double now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static int by_time(const void *a, const void *b) {
+  double x = *(const double*) a;
+  double y = *(const double*) b;
+  return (x > y) - (x < y);
+}
+
+static void load_baseline(char *path) {
+  char line[256];
+  FILE *in = fopen(path, "r");
+  int capacity = 16;
+  if (!in) {
+    perror(path);
+    exit(1);
+  }
+  baseline = (Baseline*) malloc(capacity * sizeof(Baseline));
+  while (fgets(line, sizeof(line), in)) {
+    Baseline *b;
+    if (line[0] == '#') {
+      continue;
+    }
+    if (baseline_count == capacity) {
+      capacity *= 2;
+      baseline = (Baseline*) realloc(baseline, capacity * sizeof(Baseline));
+    }
+    b = &baseline[baseline_count];
+    if (sscanf(line, "%31s %31s %*s %*s %*f %lf", b->name, b->tier, &b->median) == 3) {
+      baseline_count++;
+    }
+  }
+  fclose(in);
+}
+
+/*
+ * Print a result line. times holds reps seconds per run, each over count
+ * units of work, and gets sorted.
+ */
+static void report(char *name, char *tier, char *unit, uint64_t count, double *times) {
+  double best;
+  double median;
+  int i;
+  qsort(times, reps, sizeof(double), by_time);
+  best = times[0] * 1e9 / count;
+  median = times[reps / 2] * 1e9 / count;
+  printf("%s\t%s\t%s\t%llu\t%.3f\t%.3f\t%.0f", name, tier, unit,
+      (unsigned long long) count, best, median, count / times[0]);
+  for (i = 0; i < baseline_count; i++) {
+    if (strcmp(baseline[i].name, name) == 0 && strcmp(baseline[i].tier, tier) == 0) {
+      printf("\t%+.1f%%", 100.0 * (median - baseline[i].median) / baseline[i].median);
+      break;
+    }
+  }
+  printf("\n");
+  fflush(stdout);
+}
+
+// how many instructions a run of program executes
+static uint64_t count_instructions(Program *program, int32_t *data) {
+  static VM vm;
+  uint64_t *counts = (uint64_t*) calloc(program->code_size + 1, sizeof(uint64_t));
+  uint64_t total = 0;
+  int i;
+  init(&vm, program, data, BENCH_DATA_SIZE);
+  vm.jit = false;
+  profile_ips(&vm, counts);
+  execute(&vm);
+  for (i = 0; i < program->code_size; i++) {
+    total += counts[i];
+  }
+  free(counts);
+  return total;
+}
+
+/*
+ * A copy of the workload laid out along the hot paths of a training run,
+ * with room for the JMPs that may add. The caller frees it.
+ */
+static int32_t *laid_out(Workload *workload, int *code_size) {
+  static VM vm;
+  int32_t data[BENCH_DATA_SIZE];
+  int capacity = 2 * workload->code_size;
+  int32_t *code = (int32_t*) calloc(capacity, sizeof(int32_t));
+  uint64_t *counts = (uint64_t*) calloc(capacity + 1, sizeof(uint64_t));
+  Program *program = load_program(workload->code, workload->code_size);
+  memset(data, 0, sizeof(data));
+  data[1] = 7;
+  init(&vm, program, data, BENCH_DATA_SIZE);
+  vm.jit = false;
+  profile_ips(&vm, counts);
+  execute(&vm);
+  free_program(program);
+  memcpy(code, workload->code, workload->code_size * sizeof(int32_t));
+  *code_size = layout(code, workload->code_size, capacity, counts);
+  free(counts);
+  return code;
+}
+
+static void run_workload(Workload *workload, int tier) {
+  static VM vm;
+  int32_t data[BENCH_DATA_SIZE];
+  int32_t *code = NULL;
+  int code_size;
+  double *times = (double*) malloc(reps * sizeof(double));
+  Verification verification;
+  Program *program;
+  uint64_t count;
+  bool wrong = false;
+  int run;
+
+  jit_set_threshold(tier == TIER_JIT ? 2 : 0);
+  if (tier == TIER_VERIFIED) {
+    program = load_verified(workload->code, workload->code_size, &verification);
+    if (!program) {
+      fprintf(stderr, "%s: rejected: %s at ip=%d\n", workload->name, verification.error, verification.ip);
+      free(times);
+      return;
+    }
+  } else if (tier == TIER_LAYOUT) {
+    code = laid_out(workload, &code_size);
+    program = load_program(code, code_size);
+  } else {
+    program = load_program(workload->code, workload->code_size);
+  }
+  memset(data, 0, sizeof(data));
+  data[1] = 7;
+  count = count_instructions(program, data);
+  init(&vm, program, data, BENCH_DATA_SIZE);
+  if (tier == TIER_REGISTERS && !reg_translate(&vm)) {
+    fprintf(stderr, "%s: not translated to registers\n", workload->name);
+    free_program(program);
+    free(times);
+    return;
+  }
+
+  for (run = -WARMUP; run < reps; run++) {
+    double start;
+    memset(data, 0, sizeof(data));
+    data[1] = 7;
+    init(&vm, program, data, BENCH_DATA_SIZE);
+    start = now();
+    if (tier == TIER_REGISTERS) {
+      reg_execute(&vm);
+    } else {
+      execute(&vm);
+    }
+    if (run >= 0) {
+      times[run] = now() - start;
+    }
+    wrong |= data[0] != workload->expected;
+  }
+  if (wrong) {
+    fprintf(stderr, "%s: wrong result %d on %s, expected %d\n", workload->name, data[0],
+        tiers[tier], workload->expected);
+  }
+  report(workload->name, tiers[tier], "insn", count, times);
+  free_program(program);
+  free(code);
+  free(times);
+  jit_set_threshold(0);
+}
+
+/*
+ * c = a + b and a . b, elementwise, over arrays of ARRAY_LENGTH words laid
+ * out one after another in data, ARRAY_LOOPS times a run. The dot product
+ * goes after them.
+ */
+#define ARRAY_LENGTH 2048
+#define ARRAY_LOOPS 500
+#define ARRAY_A 0
+#define ARRAY_B ARRAY_LENGTH
+#define ARRAY_C (2 * ARRAY_LENGTH)
+#define ARRAY_DOT (3 * ARRAY_LENGTH)
+#define ARRAY_DATA_SIZE (3 * ARRAY_LENGTH + 1)
+
+static int array_code(int32_t *code, int32_t op, bool bulk) {
+  int at = 0;
+  int loop;
+  int i;
+  code[at++] = I_PUSH;
+  code[at++] = ARRAY_LOOPS;
+  loop = at;
+  if (bulk) {
+    if (op == I_VECADD) {
+      code[at++] = I_PUSH;
+      code[at++] = ARRAY_C;
+    }
+    code[at++] = I_PUSH;
+    code[at++] = ARRAY_A;
+    code[at++] = I_PUSH;
+    code[at++] = ARRAY_B;
+    code[at++] = I_PUSH;
+    code[at++] = ARRAY_LENGTH;
+    code[at++] = op;
+  } else {
+    if (op == I_VECDOT) {
+      code[at++] = I_PUSH;
+      code[at++] = 0;
+    }
+    for (i = 0; i < ARRAY_LENGTH; i++) {
+      code[at++] = I_LOADPUSH;
+      code[at++] = ARRAY_A + i;
+      code[at++] = I_LOADPUSH;
+      code[at++] = ARRAY_B + i;
+      if (op == I_VECADD) {
+        code[at++] = I_ADD;
+        code[at++] = I_POPSTORE;
+        code[at++] = ARRAY_C + i;
+      } else {
+        code[at++] = I_MUL;
+        code[at++] = I_ADD;
+      }
+    }
+  }
+  if (op == I_VECDOT) {
+    code[at++] = I_POPSTORE;
+    code[at++] = ARRAY_DOT;
+  }
+  code[at++] = I_DEC;
+  code[at++] = I_JNZ;
+  code[at] = loop - (at + 1);
+  at++;
+  code[at++] = I_STOP;
+  return at;
+}
+
+static void run_array(int32_t op, char *isa) {
+  static VM vm;
+  static int32_t data[ARRAY_DATA_SIZE];
+  static int32_t expected[ARRAY_DATA_SIZE];
+  int32_t *code = (int32_t*) malloc((ARRAY_LENGTH * 7 + 32) * sizeof(int32_t));
+  double *times = (double*) malloc(reps * sizeof(double));
+  Program *program;
+  bool wrong = false;
+  int run;
+  int i;
+
+  if (isa && !bulk_use(isa)) {
+    free(code);
+    free(times);
+    return;
+  }
+  for (i = 0; i < 2 * ARRAY_LENGTH; i++) {
+    expected[i] = i * 7 % 13 - 6;
+  }
+  expected[ARRAY_DOT] = 0;
+  for (i = 0; i < ARRAY_LENGTH; i++) {
+    expected[ARRAY_C + i] = (op == I_VECADD) ? expected[ARRAY_A + i] + expected[ARRAY_B + i] : 0;
+    expected[ARRAY_DOT] += (op == I_VECDOT) ? expected[ARRAY_A + i] * expected[ARRAY_B + i] : 0;
+  }
+  program = load_program(code, array_code(code, op, isa != NULL));
+
+  for (run = -WARMUP; run < reps; run++) {
+    double start;
+    memcpy(data, expected, 2 * ARRAY_LENGTH * sizeof(int32_t));
+    memset(data + ARRAY_C, 0, (ARRAY_LENGTH + 1) * sizeof(int32_t));
+    init(&vm, program, data, ARRAY_DATA_SIZE);
+    start = now();
+    execute(&vm);
+    if (run >= 0) {
+      times[run] = now() - start;
+    }
+    wrong |= memcmp(data, expected, sizeof(data)) != 0;
+  }
+  if (wrong) {
+    fprintf(stderr, "%s: wrong result on %s\n", instructions[op], isa ? isa : "bytecode");
+  }
+  report(op == I_VECADD ? "vecadd" : "vecdot", isa ? isa : "bytecode", "element",
+      (uint64_t) ARRAY_LOOPS * ARRAY_LENGTH, times);
+  free_program(program);
+  free(code);
+  free(times);
+  bulk_use(NULL);
+}
+
+/*
+ * PRINT_COUNT down to 1, each printed by NATIVE native to fd: a loop of
+ * PUSH fd, FRPUSH 0, NATIVE, POP, DEC and JNZ.
+ */
+#define PRINT_COUNT 200000
+
+static char *print_unbuffered(VM *vm, int32_t *args, int32_t *result) {
+  (void) vm;  // dprintf() goes straight to the fd, past the VM's buffer
+  *result = (dprintf(args[0], "%d", args[1]) < 0) ? -1 : 0;
+  return NULL;
+}
+
+static void run_print(bool buffered) {
+  static VM vm;
+  static int unbuffered = -1;
+  int32_t code[] = { I_PUSH, PRINT_COUNT, I_PUSH, 0, I_FRPUSH, 0, I_NATIVE, N_PRINT_INT, 2,
+    I_POP, I_DEC, I_JNZ, -11, I_STOP };
+  double *times = (double*) malloc(reps * sizeof(double));
+  Program *program;
+  int fd = open("/dev/null", O_WRONLY);
+  int run;
+
+  if (unbuffered < 0) {
+    unbuffered = native_register("print_unbuffered", 2, print_unbuffered);
+  }
+  code[3] = fd;
+  code[7] = buffered ? N_PRINT_INT : unbuffered;
+  program = load_program(code, sizeof(code) / sizeof(int32_t));
+  for (run = -WARMUP; run < reps; run++) {
+    double start;
+    init(&vm, program, NULL, 0);
+    start = now();
+    execute(&vm);
+    if (run >= 0) {
+      times[run] = now() - start;
+    }
+  }
+  report("print", buffered ? "buffered" : "write", "int", PRINT_COUNT, times);
+  free_program(program);
+  free(times);
+  close(fd);
+}
+
+/*
+ * A prelude that fills a STARTUP_WORDS table and then counts down from
+ * STARTUP_LOOPS, standing in for whatever a program sets up before it can
+ * serve anything, and then a request that bumps one word of the table.
+ */
+#define STARTUP_WORDS (1 << 20)
+#define STARTUP_LOOPS 100000
+
+static void run_startup(bool cloned) {
+  static VM vm;
+  static int32_t data[STARTUP_WORDS];
+  int32_t code[] = { I_PUSH, 0, I_PUSH, 7, I_PUSH, STARTUP_WORDS, I_VECFILL,
+    I_PUSH, STARTUP_LOOPS, I_DEC, I_JNZ, -3, I_POP, I_STOP,
+    I_LOADPUSH, 3, I_INC, I_POPSTORE, 3, I_STOP };
+  double *times = (double*) malloc(reps * sizeof(double));
+  Program *program = load_program(code, sizeof(code) / sizeof(int32_t));
+  Snapshot *snapshot;
+  int run;
+
+  init(&vm, program, data, STARTUP_WORDS);
+  execute(&vm);
+  snapshot = snapshot_take(&vm);
+  if (!snapshot) {
+    fprintf(stderr, "startup: can't take a snapshot\n");
+    exit(1);
+  }
+  for (run = -WARMUP; run < reps; run++) {
+    double start = now();
+    if (cloned) {
+      if (!snapshot_clone(snapshot, &vm)) {
+        fprintf(stderr, "startup: can't clone the snapshot\n");
+        exit(1);
+      }
+      execute(&vm);
+    } else {
+      init(&vm, program, data, STARTUP_WORDS);
+      execute(&vm);
+      execute(&vm);
+    }
+    if (vm.data[3] != 8) {
+      fprintf(stderr, "startup: wrong result\n");
+    }
+    if (cloned) {
+      snapshot_release(snapshot, &vm);
+    }
+    if (run >= 0) {
+      times[run] = now() - start;
+    }
+  }
+  report("startup", cloned ? "clone" : "prelude", "run", 1, times);
+  snapshot_close(snapshot);
+  free_program(program);
+  free(times);
+}
+
+// a long expression of numbers and parentheses, ending in a variable
+static void expression(char *line, int terms) {
+  char *ops = "+-*/%";
+  int at = sprintf(line, "y = ");
+  int i;
+  for (i = 0; i < terms; i++) {
+    at += sprintf(line + at, "(%d %c -%d) %c ", i + 1, ops[i % 5], i % 7 + 1, ops[(i + 2) % 5]);
+  }
+  sprintf(line + at, "x");
+}
+
+static void run_compiler() {
+  static char line[8192];
+  double *times = (double*) malloc(reps * sizeof(double));
+  Token *tokens;
+  Token *t;
+  uint64_t count = 0;
+  int run;
+  int i;
+
+  listing = NULL;
+  // define x and y first, so every timed compile does the same work
+  for (i = 0; i < 2; i++) {
+    AST_Node *tree;
+    strcpy(line, i ? "y = 1" : "x = 1");
+    tokens = scan_input(line, strlen(line));
+    tree = begin_parsing(tokens);
+    write_instructions(tree);
+    end_compilation();
+  }
+  expression(line, 200);
+  tokens = scan_input(line, strlen(line));
+  for (t = tokens; t; t = t->next) {
+    count++;
+  }
+  end_compilation();
+
+  for (run = -WARMUP; run < reps; run++) {
+    double start = now();
+    // the same line 100 times per run
+    for (i = 0; i < 100; i++) {
+      AST_Node *tree;
+      tokens = scan_input(line, strlen(line));
+      tree = begin_parsing(tokens);
+      write_instructions(tree);
+      end_compilation();
+    }
+    if (run >= 0) {
+      times[run] = now() - start;
+    }
+  }
+  report("compile", "compiler", "token", count * 100, times);
+  free(times);
+}
+
+// scanning a script of about LEX_SCRIPT_SIZE bytes from a file, by the byte
+#define LEX_SCRIPT_SIZE (8 << 20)
+
+static void run_lexer() {
+  static char line[8192];
+  char path[] = "/tmp/vmbenchXXXXXX";
+  double *times = (double*) malloc(reps * sizeof(double));
+  uint64_t size = 0;
+  FILE *script;
+  int fd = mkstemp(path);
+  int run;
+  if (fd < 0 || !(script = fdopen(fd, "w"))) {
+    perror(path);
+    free(times);
+    return;
+  }
+  expression(line, 200);
+  while (size < LEX_SCRIPT_SIZE) {
+    size += fprintf(script, "%s;\n", line);
+  }
+  fclose(script);
+
+  for (run = -WARMUP; run < reps; run++) {
+    double start = now();
+    if (!scan_file(path)) {
+      fprintf(stderr, "%s: not scanned\n", path);
+    }
+    if (run >= 0) {
+      times[run] = now() - start;
+    }
+    end_compilation();
+  }
+  report("lex", "compiler", "byte", size, times);
+  unlink(path);
+  free(times);
+}
+
+int main(int argc, char **argv) {
+  int w;
+  int tier;
+  int i;
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+      load_baseline(argv[++i]);
+    } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+      reps = atoi(argv[++i]);
+    } else {
+      fprintf(stderr, "usage: %s [-c BASELINE] [-r REPS]\n", argv[0]);
+      return 2;
+    }
+  }
+  if (reps < 1) {
+    reps = 1;
+  }
+  workloads[ARITHMETIC_WORKLOAD].code_size = arithmetic(&workloads[ARITHMETIC_WORKLOAD].expected);
+  for (i = 0; i < TAG_COUNT; i++) {
+    workloads[VALUES_WORKLOAD + i].code_size = values(i, &workloads[VALUES_WORKLOAD + i].expected);
+  }
+
+  printf("# workload\ttier\tunit\tcount\tbest ns/unit\tmedian ns/unit\tunits/s%s\n",
+      baseline ? "\tmedian change" : "");
+  for (w = 0; w < WORKLOAD_COUNT; w++) {
+    for (tier = 0; tier < TIER_COUNT; tier++) {
+      run_workload(&workloads[w], tier);
+    }
+  }
+  for (i = 0; i < 2; i++) {
+    int32_t op = i ? I_VECDOT : I_VECADD;
+    run_array(op, NULL);
+    run_array(op, "c");
+    run_array(op, "sse4.1");
+    run_array(op, "avx2");
+  }
+  run_print(true);
+  run_print(false);
+  run_startup(false);
+  run_startup(true);
+  run_compiler();
+  run_lexer();
+  return 0;
+}
@@ -0,0 +1,303 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "opcodes.h"
+#include "bulk.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__)) && !defined(VM_NO_SIMD)
+#define BULK_X86
+#include <immintrin.h>
+#endif
+
+// one CPU's worth of kernels
+typedef struct _Kernels {
+  char *name;
+  int32_t width;  // elements per vector, how far ahead they read
+  void (*map)(int32_t op, int32_t *dst, const int32_t *a, const int32_t *b, int32_t n);
+  int32_t (*sum)(const int32_t *a, int32_t n);
+  int32_t (*dot)(const int32_t *a, const int32_t *b, int32_t n);
+  void (*fill)(int32_t *dst, int32_t value, int32_t n);
+} Kernels;
+
+/*
+ * The C versions, which also finish off the last few elements for the
+ * others. Unsigned, so they wrap around.
+ */
+static void map_c(int32_t op, int32_t *dst, const int32_t *a, const int32_t *b, int32_t n) {
+  int32_t i;
+  switch (op) {
+    case I_VECADD:
+      for (i = 0; i < n; i++) {
+        dst[i] = (int32_t) ((uint32_t) a[i] + (uint32_t) b[i]);
+      }
+      break;
+    case I_VECSUB:
+      for (i = 0; i < n; i++) {
+        dst[i] = (int32_t) ((uint32_t) a[i] - (uint32_t) b[i]);
+      }
+      break;
+    case I_VECMUL:
+      for (i = 0; i < n; i++) {
+        dst[i] = (int32_t) ((uint32_t) a[i] * (uint32_t) b[i]);
+      }
+      break;
+    case I_VECLT:
+      for (i = 0; i < n; i++) {
+        dst[i] = -(a[i] < b[i]);
+      }
+      break;
+  }
+}
+
+static int32_t sum_c(const int32_t *a, int32_t n) {
+  uint32_t total = 0;
+  int32_t i;
+  for (i = 0; i < n; i++) {
+    total += (uint32_t) a[i];
+  }
+  return (int32_t) total;
+}
+
+static int32_t dot_c(const int32_t *a, const int32_t *b, int32_t n) {
+  uint32_t total = 0;
+  int32_t i;
+  for (i = 0; i < n; i++) {
+    total += (uint32_t) a[i] * (uint32_t) b[i];
+  }
+  return (int32_t) total;
+}
+
+static void fill_c(int32_t *dst, int32_t value, int32_t n) {
+  int32_t i;
+  for (i = 0; i < n; i++) {
+    dst[i] = value;
+  }
+}
+
+static Kernels portable = { "c", 1, map_c, sum_c, dot_c, fill_c };
+
+#ifdef BULK_X86
+
+/*
+ * The SSE4.1 and AVX2 versions, four and eight elements at a time, built
+ * for their instruction sets whatever the rest of the file is built for.
+ * Nothing is aligned, as data[] can start anywhere.
+ */
+#define LOAD128(p)     _mm_loadu_si128((const __m128i*) (p))
+#define STORE128(p, v) _mm_storeu_si128((__m128i*) (p), (v))
+#define LOAD256(p)     _mm256_loadu_si256((const __m256i*) (p))
+#define STORE256(p, v) _mm256_storeu_si256((__m256i*) (p), (v))
+
+__attribute__((target("sse4.1")))
+static void map_sse41(int32_t op, int32_t *dst, const int32_t *a, const int32_t *b, int32_t n) {
+  int32_t i = 0;
+  switch (op) {
+    case I_VECADD:
+      for (; n - i >= 4; i += 4) {
+        STORE128(dst + i, _mm_add_epi32(LOAD128(a + i), LOAD128(b + i)));
+      }
+      break;
+    case I_VECSUB:
+      for (; n - i >= 4; i += 4) {
+        STORE128(dst + i, _mm_sub_epi32(LOAD128(a + i), LOAD128(b + i)));
+      }
+      break;
+    case I_VECMUL:
+      for (; n - i >= 4; i += 4) {
+        STORE128(dst + i, _mm_mullo_epi32(LOAD128(a + i), LOAD128(b + i)));
+      }
+      break;
+    case I_VECLT:
+      for (; n - i >= 4; i += 4) {
+        STORE128(dst + i, _mm_cmpgt_epi32(LOAD128(b + i), LOAD128(a + i)));
+      }
+      break;
+  }
+  map_c(op, dst + i, a + i, b + i, n - i);
+}
+
+__attribute__((target("sse4.1")))
+static int32_t sum_sse41(const int32_t *a, int32_t n) {
+  __m128i total = _mm_setzero_si128();
+  int32_t lanes[4];
+  int32_t i = 0;
+  for (; n - i >= 4; i += 4) {
+    total = _mm_add_epi32(total, LOAD128(a + i));
+  }
+  STORE128(lanes, total);
+  return (int32_t) ((uint32_t) sum_c(lanes, 4) + (uint32_t) sum_c(a + i, n - i));
+}
+
+__attribute__((target("sse4.1")))
+static int32_t dot_sse41(const int32_t *a, const int32_t *b, int32_t n) {
+  __m128i total = _mm_setzero_si128();
+  int32_t lanes[4];
+  int32_t i = 0;
+  for (; n - i >= 4; i += 4) {
+    total = _mm_add_epi32(total, _mm_mullo_epi32(LOAD128(a + i), LOAD128(b + i)));
+  }
+  STORE128(lanes, total);
+  return (int32_t) ((uint32_t) sum_c(lanes, 4) + (uint32_t) dot_c(a + i, b + i, n - i));
+}
+
+__attribute__((target("sse4.1")))
+static void fill_sse41(int32_t *dst, int32_t value, int32_t n) {
+  __m128i v = _mm_set1_epi32(value);
+  int32_t i = 0;
+  for (; n - i >= 4; i += 4) {
+    STORE128(dst + i, v);
+  }
+  fill_c(dst + i, value, n - i);
+}
+
+__attribute__((target("avx2")))
+static void map_avx2(int32_t op, int32_t *dst, const int32_t *a, const int32_t *b, int32_t n) {
+  int32_t i = 0;
+  switch (op) {
+    case I_VECADD:
+      for (; n - i >= 8; i += 8) {
+        STORE256(dst + i, _mm256_add_epi32(LOAD256(a + i), LOAD256(b + i)));
+      }
+      break;
+    case I_VECSUB:
+      for (; n - i >= 8; i += 8) {
+        STORE256(dst + i, _mm256_sub_epi32(LOAD256(a + i), LOAD256(b + i)));
+      }
+      break;
+    case I_VECMUL:
+      for (; n - i >= 8; i += 8) {
+        STORE256(dst + i, _mm256_mullo_epi32(LOAD256(a + i), LOAD256(b + i)));
+      }
+      break;
+    case I_VECLT:
+      for (; n - i >= 8; i += 8) {
+        STORE256(dst + i, _mm256_cmpgt_epi32(LOAD256(b + i), LOAD256(a + i)));
+      }
+      break;
+  }
+  map_c(op, dst + i, a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static int32_t sum_avx2(const int32_t *a, int32_t n) {
+  __m256i total = _mm256_setzero_si256();
+  int32_t lanes[8];
+  int32_t i = 0;
+  for (; n - i >= 8; i += 8) {
+    total = _mm256_add_epi32(total, LOAD256(a + i));
+  }
+  STORE256(lanes, total);
+  return (int32_t) ((uint32_t) sum_c(lanes, 8) + (uint32_t) sum_c(a + i, n - i));
+}
+
+__attribute__((target("avx2")))
+static int32_t dot_avx2(const int32_t *a, const int32_t *b, int32_t n) {
+  __m256i total = _mm256_setzero_si256();
+  int32_t lanes[8];
+  int32_t i = 0;
+  for (; n - i >= 8; i += 8) {
+    total = _mm256_add_epi32(total, _mm256_mullo_epi32(LOAD256(a + i), LOAD256(b + i)));
+  }
+  STORE256(lanes, total);
+  return (int32_t) ((uint32_t) sum_c(lanes, 8) + (uint32_t) dot_c(a + i, b + i, n - i));
+}
+
+__attribute__((target("avx2")))
+static void fill_avx2(int32_t *dst, int32_t value, int32_t n) {
+  __m256i v = _mm256_set1_epi32(value);
+  int32_t i = 0;
+  for (; n - i >= 8; i += 8) {
+    STORE256(dst + i, v);
+  }
+  fill_c(dst + i, value, n - i);
+}
+
+static Kernels sse41 = { "sse4.1", 4, map_sse41, sum_sse41, dot_sse41, fill_sse41 };
+static Kernels avx2 = { "avx2", 8, map_avx2, sum_avx2, dot_avx2, fill_avx2 };
+
+#endif
+
+// best first
+static Kernels *all[] = {
+#ifdef BULK_X86
+  &avx2, &sse41,
+#endif
+  &portable
+};
+#define KERNELS_COUNT (sizeof(all) / sizeof(Kernels*))
+
+// the ones in use, or NULL until the first call picks the best
+static Kernels *kernels = NULL;
+
+static bool supported(Kernels *candidate) {
+#ifdef BULK_X86
+  __builtin_cpu_init();
+  if (candidate == &avx2) {
+    return __builtin_cpu_supports("avx2");
+  }
+  if (candidate == &sse41) {
+    return __builtin_cpu_supports("sse4.1");
+  }
+#else
+  (void) candidate;
+#endif
+  return true;
+}
+
+bool bulk_use(const char *isa) {
+  size_t i;
+  for (i = 0; i < KERNELS_COUNT; i++) {
+    if ((!isa || strcmp(isa, all[i]->name) == 0) && supported(all[i])) {
+      kernels = all[i];
+      return true;
+    }
+  }
+  return false;
+}
+
+const char *bulk_isa() {
+  if (!kernels) {
+    bulk_use(NULL);
+  }
+  return kernels->name;
+}
+
+// whether dst starts less than a vector past src, so writing it changes what's still to read
+static bool ahead(const int32_t *dst, const int32_t *src, int32_t width) {
+  return dst - src > 0 && dst - src < width;
+}
+
+void bulk_map(int32_t op, int32_t *dst, const int32_t *a, const int32_t *b, int32_t n) {
+  if (!kernels) {
+    bulk_use(NULL);
+  }
+  if (ahead(dst, a, kernels->width) || ahead(dst, b, kernels->width)) {
+    map_c(op, dst, a, b, n);
+  } else {
+    kernels->map(op, dst, a, b, n);
+  }
+}
+
+int32_t bulk_sum(const int32_t *a, int32_t n) {
+  if (!kernels) {
+    bulk_use(NULL);
+  }
+  return kernels->sum(a, n);
+}
+
+int32_t bulk_dot(const int32_t *a, const int32_t *b, int32_t n) {
+  if (!kernels) {
+    bulk_use(NULL);
+  }
+  return kernels->dot(a, b, n);
+}
+
+void bulk_fill(int32_t *dst, int32_t value, int32_t n) {
+  if (!kernels) {
+    bulk_use(NULL);
+  }
+  kernels->fill(dst, value, n);
+}
@@ -0,0 +1,38 @@
+#ifndef BULK_H_INCLUDED
+#define BULK_H_INCLUDED
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Kernels for the bulk array instructions, VECADD ... VECLT, over runs of
+ * n words of data. Each has a plain C version and, on x86-64 with GCC or
+ * Clang (unless built with -DVM_NO_SIMD), SSE4.1 and AVX2 ones. The best
+ * the CPU has is picked the first time one is needed.
+ *
+ * The element-wise ones work from the first element up, as the loop in
+ * the C version does, so a destination that overlaps a source partway in
+ * gets what that loop would give it; those calls are left to the C
+ * version rather than read a whole vector ahead.
+ */
+
+/*
+ * dst[i] = a[i] op b[i] for the opcode op: VECADD, VECSUB and VECMUL wrap
+ * around as ADD, SUB and MUL do, and VECLT gives -1 where a[i] < b[i] and
+ * 0 where not, a mask to VECMUL by or VECDOT with.
+ */
+extern void bulk_map(int32_t op, int32_t *dst, const int32_t *a, const int32_t *b, int32_t n);
+// the wrapped around sum of a[i], and of a[i] * b[i]
+extern int32_t bulk_sum(const int32_t *a, int32_t n);
+extern int32_t bulk_dot(const int32_t *a, const int32_t *b, int32_t n);
+extern void bulk_fill(int32_t *dst, int32_t value, int32_t n);
+
+/*
+ * Use the kernels for isa, "c", "sse4.1" or "avx2", from now on, or the
+ * best there are for NULL. False if this CPU or build hasn't got them.
+ */
+extern bool bulk_use(const char *isa);
+// the name of the ones in use
+extern const char *bulk_isa();
+
+#endif
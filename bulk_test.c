@@ -0,0 +1,100 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "opcodes.h"
+#include "bulk.h"
+
+/*
+ * Checks for the bulk kernels, run by "make check": each ISA this CPU and
+ * build have has to give what the C versions do, over lengths that leave
+ * a tail after the last whole vector, and with a destination on top of,
+ * just past or just before its first source.
+ */
+
+#define SPACE 1040  // the longest run, and room either side of it
+
+static const char *isas[] = { "sse4.1", "avx2" };
+static const int32_t lengths[] = { 0, 1, 3, 7, 8, 13, 33, 1001 };
+// where dst starts relative to a: on it, a word or two or a vector past, and before
+static const int32_t shifts[] = { 0, 1, 2, 3, 4, 7, 8, 9, -1, -5 };
+static const int32_t ops[] = { I_VECADD, I_VECSUB, I_VECMUL, I_VECLT };
+
+static int failures = 0;
+
+// the same mix of small, negative and wrapping values every time
+static void scramble(int32_t *words, int32_t n, uint32_t seed) {
+  int32_t i;
+  for (i = 0; i < n; i++) {
+    seed = seed * 1103515245 + 12345;
+    words[i] = (i % 3 == 0) ? (int32_t) (seed >> 16) % 100 - 50 : (int32_t) seed;
+  }
+}
+
+// map op over a at 16 and b, into dst at 16 + shift, all in one buffer
+static void map(const char *isa, int32_t op, int32_t *space, const int32_t *b, int32_t n, int32_t shift) {
+  bulk_use(isa);
+  scramble(space, SPACE, 1);
+  bulk_map(op, space + 16 + shift, space + 16, b, n);
+}
+
+static void check(const char *isa) {
+  static int32_t expected[SPACE];
+  static int32_t got[SPACE];
+  static int32_t b[SPACE];
+  size_t l;
+  size_t s;
+  size_t o;
+  scramble(b, SPACE, 2);
+  for (l = 0; l < sizeof(lengths) / sizeof(int32_t); l++) {
+    int32_t n = lengths[l];
+    int32_t want;
+    int32_t have;
+    for (o = 0; o < sizeof(ops) / sizeof(int32_t); o++) {
+      for (s = 0; s < sizeof(shifts) / sizeof(int32_t); s++) {
+        map("c", ops[o], expected, b, n, shifts[s]);
+        map(isa, ops[o], got, b, n, shifts[s]);
+        if (memcmp(expected, got, sizeof(got)) != 0) {
+          printf("%s: %s of %d with dst at a%+d differs\n", isa, instructions[ops[o]], n, shifts[s]);
+          failures++;
+        }
+      }
+    }
+    scramble(expected, SPACE, 3);
+    bulk_use("c");
+    want = bulk_sum(expected, n);
+    bulk_use(isa);
+    have = bulk_sum(expected, n);
+    if (want != have) {
+      printf("%s: sum of %d is %d, not %d\n", isa, n, have, want);
+      failures++;
+    }
+    bulk_use("c");
+    want = bulk_dot(expected, b, n);
+    bulk_use(isa);
+    have = bulk_dot(expected, b, n);
+    if (want != have) {
+      printf("%s: dot of %d is %d, not %d\n", isa, n, have, want);
+      failures++;
+    }
+  }
+}
+
+int main() {
+  size_t i;
+  for (i = 0; i < sizeof(isas) / sizeof(char*); i++) {
+    if (bulk_use(isas[i])) {
+      check(isas[i]);
+    } else {
+      printf("%s: not on this CPU or build, skipped\n", isas[i]);
+    }
+  }
+  if (failures) {
+    printf("%d bulk kernel checks failed\n", failures);
+    return 1;
+  }
+  printf("bulk kernel checks passed\n");
+  return 0;
+}
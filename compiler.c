@@ -0,0 +1,448 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "opcodes.h"
+#include "compiler.h"
+
+//#define TRACE_ON
+
+#ifdef TRACE_ON
+#define log_trace(...) fprintf(stderr,  __VA_ARGS__)
+#else
+#define log_trace(...) ;
+#endif
+#define log_warn(...) fprintf(stderr,  __VA_ARGS__)
+#define log_code(...) if (listing) fprintf(listing,  __VA_ARGS__)
+
+int *code = NULL;
+int data[DATA_CAPACITY];
+int code_size = 0;
+static int code_capacity = 0;
+int data_size = 0;
+FILE *listing = NULL;
+
+Arena compile_arena = ARENA_INIT(0x4000);
+Arena symbol_arena = ARENA_INIT(0x1000);
+
+void end_compilation() {
+  arena_reset(&compile_arena);
+}
+
+char* token_to_string(Token*token) {
+  static char number[16];
+  if (token->kind == TOKEN_WORD) {
+    return interned_name(token->value);
+  }
+  if (token->kind == TOKEN_NUMBER) {
+    snprintf(number, sizeof(number), "%d", token->value);
+    return number;
+  }
+  switch(token->kind) {
+    case TOKEN_PLUS: return "+";
+    case TOKEN_MINUS: return "-";
+    case TOKEN_MULT: return "*";
+    case TOKEN_DIV: return "/";
+    case TOKEN_MOD: return "%";
+    case TOKEN_OPEN_PAREN: return "(";
+    case TOKEN_CLOSE_PAREN: return ")";
+    case TOKEN_SEMICOLON: return ";";
+  }
+  return "UNKNOWN";
+}
+
+AST_Node * new_leaf_node(Token*token) {
+  AST_Node *node = (AST_Node*) arena_alloc(&compile_arena, sizeof(AST_Node));
+  node->leaf = true;
+  node->token = token;
+  node->left = NULL;
+  node->right = NULL;
+  node->operator = NULL;
+  node->apply_unary_minus = false;
+  node->constant = token->kind == TOKEN_NUMBER;
+  node->value = node->constant ? token->value : 0;
+  node->temp = -1;
+  node->number = -1;
+  node->reuse = false;
+  return node;
+}
+AST_Node * new_branch_node() {
+  AST_Node *node = (AST_Node*) arena_alloc(&compile_arena, sizeof(AST_Node));
+  node->leaf = false;
+  node->token = NULL;
+  node->left = NULL;
+  node->right = NULL;
+  node->operator = NULL;
+  node->apply_unary_minus = false;
+  node->constant = false;
+  node->value = 0;
+  node->temp = -1;
+  node->number = -1;
+  node->reuse = false;
+  return node;
+}
+
+AST_Node * parse_assignment(Token** tokens);
+AST_Node * parse_addables(Token** tokens);
+AST_Node * parse_multipliables(Token** tokens);
+AST_Node * parse_term(Token** tokens);
+AST_Node * parse_unary_minus(Token** tokens);
+
+void write_instructions(AST_Node* tree);
+
+AST_Node * parse_term(Token** tokens) {
+  log_trace("parse_term starts &tokens=%08lx\n", tokens);
+  Token *current = *tokens;
+  //printf("parse_term starts B, current=%08lx\n", current);
+  AST_Node * node = NULL;
+  //printf("parse_term starts C, node=%08lx\n", node);
+  if (current->kind == TOKEN_OPEN_PAREN) {
+    log_trace("parse_term found a paren, calling parse to extract subexpression");
+    current = current->next;
+    AST_Node * child = parse_addables(&current);
+    if (!current || current->kind != TOKEN_CLOSE_PAREN) {
+      fputs("closing parenthesis expected\n", stderr);
+      return NULL;
+    }
+    current = current->next;
+    *tokens = current;
+    return child;
+  }
+  if (current->kind == TOKEN_NUMBER) {
+    log_trace("parse_term found a number %s\n", token_to_string(current));
+    node = new_leaf_node(current);
+    current = current->next;
+    *tokens = current; // we consume this token, update pointer
+    return node;
+  }
+  if (current->kind == TOKEN_WORD) {
+    Symbol*sym = find_symbol(current->value);
+    if (!sym) {
+      fprintf(stderr, "Unknown symbol %s\n", token_to_string(current));
+      return NULL;
+    }
+    log_trace("parse_term found known symbol %s\n", token_to_string(current));
+    node = new_leaf_node(current);
+    node->value = sym->data_offset;
+    current = current->next;
+    *tokens = current; // we consume this token, update pointer
+    return node;
+  }
+  fprintf(stderr, "Term expected at %s\n", token_to_string(current));
+  return NULL;
+}
+
+AST_Node * parse_unary_minus(Token** tokens) {
+  log_trace("parse_unary_minus starts &tokens=%08lx\n", tokens);
+  Token *current = *tokens;
+  if (!current)
+    return NULL;
+  if (current->kind != TOKEN_MINUS) {
+    return parse_term(tokens);
+  }
+  current = current->next;
+  if (!current) {
+    fputs("expression expected after unary minus", stderr);
+    return NULL;
+  }
+  AST_Node *term = parse_term(&current);
+  if (!term) {
+    fputs("unary - present but no term after\n", stderr);
+    return NULL;
+  }
+  *tokens = current;
+  log_trace("processing unary minus. term unaryism was %d\n", term->apply_unary_minus);
+  term->apply_unary_minus = ! term->apply_unary_minus;
+  log_trace("processing unary minus. term unaryism is now %d\n", term->apply_unary_minus);
+  return term;
+}
+
+AST_Node * parse_multipliables(Token** tokens) {
+  log_trace("parse_multipliables starts &tokens=%08lx\n", tokens);
+  Token *current = *tokens;
+  AST_Node * lhs = parse_unary_minus(&current);
+  if (!lhs) {
+    return NULL;
+  }
+  while (current && (current->kind == TOKEN_MULT || current->kind == TOKEN_DIV || current->kind == TOKEN_MOD)) {
+    log_trace("parse_multipliables: found connecting operator %s\n", token_to_string(current));
+    Token * operator = current;
+    current = current->next;
+    AST_Node * rhs = parse_unary_minus(&current);
+    if (!rhs) {
+      fputs("right hand side expected\n", stderr);
+      return NULL;
+    }
+    AST_Node *parent = new_branch_node();
+    parent->left = lhs;
+    parent->right = rhs;
+    parent->operator = operator;
+    lhs = parent;
+  }
+  *tokens=current;
+  return lhs;
+}
+
+
+AST_Node * parse_addables(Token** tokens) {
+  log_trace("parse_addables starts &tokens=%08lx\n", tokens);
+  Token *current = *tokens;
+  AST_Node * lhs = parse_multipliables(&current);
+  if (!lhs) {
+    return NULL;
+  }
+  while (current && (current->kind == TOKEN_PLUS || current->kind == TOKEN_MINUS)) {
+    log_trace("parse_addables: found connecting operator %s\n", token_to_string(current));
+    Token * operator = current;
+    current = current->next;
+    AST_Node * rhs = parse_multipliables(&current);
+    if (!rhs) {
+      log_trace("right hand side expected\n");
+      return NULL;
+    }
+    AST_Node *parent = new_branch_node();
+    parent->left = lhs;
+    parent->right = rhs;
+    parent->operator = operator;
+    lhs = parent;
+  }
+  *tokens=current;
+  return lhs;
+}
+
+AST_Node * parse_assignment(Token** tokens) {
+  log_trace("parse_assignment starts &tokens=%08lx\n", tokens);
+  Token *word = *tokens;
+  if (!word) {
+    return NULL;
+  }
+  if (word->kind != TOKEN_WORD) {
+    return parse_addables(tokens);
+  }
+  log_trace("parse_assignment found a word: =%s\n", word);
+  Token * maybeEquals = word->next;
+  if (maybeEquals == NULL || maybeEquals->kind != TOKEN_EQUALS) {
+    return parse_addables(tokens);
+  }
+  log_trace("parse_assignment found =\n");
+  // we have an assignment here.
+  Token*current = maybeEquals->next;
+  log_trace("parse_assignment going for RHS =\n");
+  AST_Node * rhs = parse_addables(&current);
+  if (!rhs) {
+    log_trace("parse_assignment bailing on RHS =\n");
+    return NULL;
+  }
+  if (current) {
+    log_trace("parse: found assignment %s\n", token_to_string(current));
+  } else {
+    log_trace("at end\n");
+  }
+  // defined from here on, so later statements in the line can use it
+  Symbol *sym = find_symbol(word->value);
+  if (!sym) {
+    sym = create_symbol(word->value);
+    log_trace("created sym %s @%d\n", sym->name, sym->data_offset);
+  }
+  AST_Node *lhs = new_leaf_node(word);
+  lhs->value = sym->data_offset;
+
+  AST_Node *parent = new_branch_node();
+  parent->left = lhs;
+  parent->right = rhs;
+  parent->operator = maybeEquals;
+  *tokens=current;
+  return parent;
+}
+
+AST_Node* begin_parsing(Token*head) {
+  Symbol *mark = head_symbol;
+  AST_Node * lhs = parse_assignment(&head);
+  if (!lhs) {
+    forget_symbols(mark);
+    return NULL;
+  }
+  // statements; each one is the right of a ";" whose left is those before it
+  while (head && head->kind == TOKEN_SEMICOLON) {
+    Token * operator = head;
+    head = head->next;
+    if (!head) {
+      break; // a trailing semicolon
+    }
+    AST_Node * rhs = parse_assignment(&head);
+    if (!rhs) {
+      // the variables it was going to define never were
+      forget_symbols(mark);
+      return NULL;
+    }
+    AST_Node *parent = new_branch_node();
+    parent->left = lhs;
+    parent->right = rhs;
+    parent->operator = operator;
+    lhs = parent;
+  }
+  return lhs;
+}
+
+void print_postfix(AST_Node* tree) {
+  if (tree->leaf) {
+    if (tree->apply_unary_minus)
+      fputs("-", stdout);
+    if (tree->constant) {
+      printf("%d", tree->value);
+    } else {
+      fputs(token_to_string(tree->token), stdout);
+    }
+  } else if (tree->reuse) {
+    if (tree->apply_unary_minus)
+      fputs("-", stdout);
+    printf("@%d", tree->temp);
+  } else {
+      fputs("[", stdout);
+      print_postfix(tree->left);
+      if (tree->right) {
+        fputs(",", stdout);
+        print_postfix(tree->right);
+      }
+      fputs("]", stdout);
+      if (tree->right) {
+        fputs(token_to_string(tree->operator), stdout);
+      }
+    if (tree->apply_unary_minus)
+      fputs("neg", stdout);
+  }
+}
+
+// make room for two more words of code
+static void reserve_code() {
+  if (code_size + 2 > code_capacity) {
+    code_capacity = code_capacity ? 2 * code_capacity : 4096;
+    code = (int*) realloc(code, code_capacity * sizeof(int));
+    if (!code) {
+      fprintf(stderr, "Out of memory for %d words of code\n", code_capacity);
+      exit(1);
+    }
+  }
+}
+
+void emit(int32_t op) {
+  log_code("%04x %10s[%02x] \n", code_size, instructions[op], op);
+  reserve_code();
+  code[code_size++] = op;
+}
+
+void emit_arg(int32_t op, int32_t arg) {
+  log_code("%04x %10s[%02x] #0x%04x\n", code_size, instructions[op], op, arg);
+  reserve_code();
+  code[code_size++] = op;
+  code[code_size++] = arg;
+}
+
+// the value of a constant leaf, negated if it has to be
+int32_t constant_value(AST_Node* tree) {
+  return tree->apply_unary_minus ? -tree->value : tree->value;
+}
+
+// is tree a constant that's just 1 or -1, so adding it is an INC or DEC
+bool unit(AST_Node* tree) {
+  return tree->leaf && tree->constant && !tree->reuse
+    && (constant_value(tree) == 1 || constant_value(tree) == -1);
+}
+
+void write_instructions_rec(AST_Node* tree) {
+  if (tree->reuse) {
+    emit_arg(I_LOADPUSH, tree->temp);
+    if (tree->apply_unary_minus)
+      emit(I_NEG);
+    return;
+  }
+  if (tree->leaf) {
+    if (tree->constant) {
+      emit_arg(I_PUSH, constant_value(tree));
+    } else {
+      emit_arg(I_LOADPUSH, tree->value);
+      if (tree->apply_unary_minus)
+        emit(I_NEG);
+    }
+  }
+  else {
+    Token* op = tree->operator;
+    if (op->kind == TOKEN_SEMICOLON) {
+      write_instructions_rec(tree->left);
+      write_instructions_rec(tree->right);
+    }
+    else if (op->kind == TOKEN_EQUALS) {
+      log_trace("makin assignment\n");
+      write_instructions_rec(tree->right);
+      emit_arg(I_POPSTORE, tree->left->value);
+    }
+    else {
+      int kind = tree->operator->kind;
+      bool plus = kind == TOKEN_PLUS;
+      if (tree->right && (plus || kind == TOKEN_MINUS) && unit(tree->right)) {
+        // x + 1 is x INC, and so on
+        write_instructions_rec(tree->left);
+        emit((constant_value(tree->right) == 1) == plus ? I_INC : I_DEC);
+      }
+      else if (tree->right && plus && unit(tree->left)) {
+        write_instructions_rec(tree->right);
+        emit(constant_value(tree->left) == 1 ? I_INC : I_DEC);
+      }
+      else {
+        write_instructions_rec(tree->left);
+        if (tree->right) {
+          write_instructions_rec(tree->right);
+          int op =0;
+          switch(kind) {
+            case TOKEN_MULT: op = I_MUL; break;
+            case TOKEN_DIV: op = I_DIV; break;
+            case TOKEN_MOD: op = I_MOD; break;
+            case TOKEN_PLUS: op = I_ADD; break;
+            case TOKEN_MINUS: op = I_SUB; break;
+          }
+          emit(op);
+        }
+      }
+      // kept for the nodes that reuse it, before any negation
+      if (tree->temp >= 0)
+        emit_arg(I_STORE, tree->temp);
+      if (tree->apply_unary_minus) {
+        emit(I_NEG);
+      }
+    }
+  }
+}
+
+void write_instructions(AST_Node* tree) {
+  code_size = 0;
+  // what the line works out stays on the stack, for the REPL to show
+  write_instructions_rec(tree);
+  finish_instructions();
+}
+
+void append_instructions(AST_Node* tree) {
+  if (!tree->leaf && tree->operator->kind == TOKEN_SEMICOLON) {
+    append_instructions(tree->left);
+    append_instructions(tree->right);
+    return;
+  }
+  write_instructions_rec(tree);
+  // nothing's left on the stack from one statement to the next
+  if (tree->leaf || tree->operator->kind != TOKEN_EQUALS) {
+    emit(I_POP);
+  }
+}
+
+void finish_instructions() {
+  emit(I_STOP);
+}
+
+void dump_tokens(Token*token_list) {
+  Token *cur = token_list;
+  while(cur) {
+    printf("TOKEN kind=%d value=%s\n", cur->kind, token_to_string(cur));
+    cur = cur->next;
+  }
+}
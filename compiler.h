@@ -0,0 +1,99 @@
+#ifndef COMPILER_H_INCLUDED
+#define COMPILER_H_INCLUDED
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "arena.h"
+#include "symbols.h"
+
+/*
+ * The expression compiler behind interp: scan_input() in lexer.c turns a
+ * line into tokens, begin_parsing() the tokens into a tree, and
+ * write_instructions() the tree into bytecode in code[], ending with a STOP and leaving the
+ * value of each statement that isn't an assignment on the stack. Variables live in
+ * data[], one word each, and stay defined from one line to the next.
+ * A line can be several statements separated by semicolons, run in turn.
+ *
+ * The tokens and tree of a line, and anything else only needed while it's
+ * compiled, come from compile_arena and are all freed by end_compilation().
+ * Symbols (symbols.c) outlive that, and come from symbol_arena. Variables
+ * are looked up as they're parsed, so the tree has their data addresses.
+ */
+#define TOKEN_NUMBER        0x01
+
+#define TOKEN_PLUS          0x12
+#define TOKEN_MINUS         0x13
+
+#define TOKEN_MULT          0x34
+#define TOKEN_DIV           0x35
+#define TOKEN_MOD           0x36
+
+#define TOKEN_EQUALS        0x60
+#define TOKEN_WORD          0x70
+
+#define TOKEN_OPEN_PAREN    0x80
+#define TOKEN_CLOSE_PAREN   0x81
+
+#define TOKEN_SEMICOLON     0x90
+
+typedef struct _Token {
+  struct _Token *next; // singly linked list.
+  int kind;
+  int32_t value;       // a number's value, or a word's interned id
+} Token;
+
+// pointers, then words, then flags, so there's no padding between them
+typedef struct _AST_Node {
+  Token*token;
+  struct _AST_Node *left;
+  Token* operator;
+  struct _AST_Node *right;
+  int32_t value;          // a constant's, or a variable's address in data[]
+  int32_t temp;           // data address its value is kept in for reuse, or -1
+  int32_t number;         // optimize()'s value number for it
+  bool leaf;
+  bool apply_unary_minus; // result must be negated
+  bool constant;          // a number, or worked out by optimize(): see value
+  bool reuse;             // ...by an earlier node, so just load it from there
+} AST_Node;
+
+extern Arena compile_arena;
+extern Arena symbol_arena;
+
+// as many words of data[] as there are
+#define DATA_CAPACITY 4096
+
+// grows to fit whatever's written
+extern int *code;
+extern int data[];
+extern int code_size;
+extern int data_size;
+// where write_instructions() lists the code it writes, or NULL for nowhere
+extern FILE *listing;
+
+// scan length bytes of input, or up to a '\0'; NULL if there's nothing there
+// or something that isn't a token
+extern Token* scan_input(const char *input, size_t length);
+// ...or a whole file, mapped rather than read
+extern Token* scan_file(const char *path);
+extern char* token_to_string(Token*token);
+extern void dump_tokens(Token*token_list);
+
+extern AST_Node* begin_parsing(Token*head);
+extern void print_postfix(AST_Node* tree);
+
+extern void write_instructions(AST_Node* tree);
+/*
+ * Or, to compile several lines into one program, append_instructions()
+ * each line's tree after the code already in code[] and finish_instructions()
+ * with the STOP once they're all there. Statements that aren't assignments
+ * are worked out and their values dropped, so the stack doesn't grow.
+ */
+extern void append_instructions(AST_Node* tree);
+extern void finish_instructions();
+// free the tokens, the tree and everything else the last line needed
+extern void end_compilation();
+
+#endif
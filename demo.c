@@ -1,5 +1,19 @@
+// for sysconf()
+#define _POSIX_C_SOURCE 200809L
+
+#include <string.h>
+#include <unistd.h>
+
 #include "opcodes.h"
 #include "vm.h"
+#include "fuse.h"
+#include "regvm.h"
+#include "jit.h"
+#include "aot.h"
+#include "batch.h"
+#include "profile.h"
+#include "image.h"
+#include "layout.h"
 
 #define DATA_SIZE 8192
 #define CODE_SIZE 8192
@@ -22,12 +36,12 @@ int32_t code[CODE_SIZE] = {
   // def multiply(x,y) {
   I_PUSH,    0,  // int total = 0;
   // while (x !=0 ) {
-  I_FRPUSH, -6,
+  I_FRPUSH, -2,
   I_JZ, +12, // exit loop
   I_DEC,         // x--
-  I_FRPOP, -6,   // store x
+  I_FRPOP, -2,   // store x
   I_FRPUSH, 0,
-  I_FRPUSH, -5,
+  I_FRPUSH, -1,
   I_ADD,
   I_FRPOP, 0,
   I_JMP, -16,
@@ -39,7 +53,7 @@ int32_t code[CODE_SIZE] = {
 
 // @33
   // factorial(n) { 
-  I_FRPUSH, -5,
+  I_FRPUSH, -1,
   I_JNZ, 4,     // if (!n)
   I_POP,
   I_PUSH, 1,
@@ -50,17 +64,206 @@ int32_t code[CODE_SIZE] = {
   I_PUSH, 1,    //    return 1;
   I_RETURN,     
   I_CALL, 33, 1, // get fact(n-1)
-  I_FRPUSH, -5,
+  I_FRPUSH, -1,
   I_MUL,
   I_RETURN,
   
 };
 
+// run the program once counting instructions
+void train(uint64_t *counts) {
+  static int32_t saved[DATA_SIZE];
+  static VM vm;
+  Program *program = load_program(code, CODE_SIZE);
+  memset(counts, 0, CODE_SIZE * sizeof(uint64_t));
+  memcpy(saved, data, sizeof(data));
+  init(&vm, program, data, DATA_SIZE);
+  profile_ips(&vm, counts);
+  execute(&vm);
+  memcpy(data, saved, sizeof(data));
+  free_program(program);
+}
+
+// ...then fuse whatever was hot
+int train_and_fuse() {
+  static uint64_t counts[CODE_SIZE];
+  FuseProfile profile = { { 0 } };
+  train(counts);
+  fuse_profile_add(&profile, code, CODE_SIZE, counts);
+  return fuse(code, CODE_SIZE, &profile);
+}
+
+/*
+ * ...or lay the code out along the hot paths. With a profile_file, the
+ * counts come from there if it exists, and are saved there if it doesn't.
+ */
+int train_and_layout(const char *profile_file) {
+  static uint64_t counts[CODE_SIZE];
+  FILE *in = profile_file ? fopen(profile_file, "r") : NULL;
+  if (in) {
+    if (!layout_profile_read(in, counts, CODE_SIZE)) {
+      fprintf(stderr, "%s: not a profile\n", profile_file);
+      exit(1);
+    }
+    fclose(in);
+  } else {
+    train(counts);
+    if (profile_file) {
+      FILE *out = fopen(profile_file, "w");
+      if (!out) {
+        perror(profile_file);
+        exit(1);
+      }
+      layout_profile_write(out, counts, CODE_SIZE);
+      fclose(out);
+    }
+  }
+  return layout(code, CODE_SIZE, CODE_SIZE, counts);
+}
+
+/*
+ * Run the program runs times on 1, 2, 4... threads up to one per CPU, each
+ * run with its own copy of the first BATCH_DATA_SIZE words of data.
+ */
+#define BATCH_DATA_SIZE 2
+
+void batch(Program *program, int runs) {
+  int32_t *batch_data = (int32_t*) malloc((size_t) runs * BATCH_DATA_SIZE * sizeof(int32_t));
+  int32_t *results = (int32_t*) malloc(runs * sizeof(int32_t));
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int threads;
+  int i;
+  for (threads = 1; ; threads *= 2) {
+    BatchStats stats;
+    int wrong = 0;
+    if (threads > cpus) {
+      threads = cpus;
+    }
+    for (i = 0; i < runs; i++) {
+      memcpy(batch_data + (size_t) i * BATCH_DATA_SIZE, data, BATCH_DATA_SIZE * sizeof(int32_t));
+    }
+    stats = run_batch(program, batch_data, BATCH_DATA_SIZE, runs, results, threads);
+    for (i = 0; i < runs; i++) {
+      wrong += results[i] != results[0];
+    }
+    printf("%3d threads: %d runs in %.3fs, %.0f runs/s, result %d",
+        stats.threads, stats.runs, stats.seconds, stats.runs_per_second, results[0]);
+    printf(wrong ? " (%d runs disagree)\n" : "\n", wrong);
+    if (threads >= cpus) {
+      break;
+    }
+  }
+  free(batch_data);
+  free(results);
+}
+
 int main(int argc, char**argv) {
+  static VM vm;
+  Program *program;
+  int code_size = CODE_SIZE;
+  bool registers = false;
+  bool trace = true;
+  char *trace_file = NULL;
+  char *folded_file = NULL;
+  char *image_file = NULL;
+  bool compile = false;
+  bool verified = false;
+  int runs = 0;
+  int i;
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-f") == 0) {
+      code_size = train_and_fuse();
+    } else if (strcmp(argv[i], "-l") == 0) {
+      code_size = train_and_layout(NULL);
+    } else if (strcmp(argv[i], "-L") == 0 && i + 1 < argc) {
+      // the same, with the training run's profile kept in a file
+      code_size = train_and_layout(argv[++i]);
+    } else if (strcmp(argv[i], "-r") == 0) {
+      registers = true;
+    } else if (strcmp(argv[i], "-j") == 0) {
+      // native code isn't traced
+      jit_set_threshold(2);
+      trace = false;
+    } else if (strcmp(argv[i], "-c") == 0) {
+      compile = true;
+    } else if (strcmp(argv[i], "-v") == 0) {
+      verified = true;
+    } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+      runs = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+      // record the trace for tracedump rather than printing it
+      trace_file = argv[++i];
+    } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+      // profile rather than trace, and write the folded stacks to a file
+      folded_file = argv[++i];
+      trace = false;
+    } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      // save the program as an image for vmimage, rather than running it
+      image_file = argv[++i];
+    }
+  }
+  if (image_file) {
+    if (!image_write(image_file, code, code_size, data, DATA_SIZE, 0, NULL, NULL, 0)) {
+      perror(image_file);
+      exit(1);
+    }
+    exit(0);
+  }
+  // write the program out as C rather than running it
+  if (compile) {
+    aot_compile(stdout, code, code_size, data, DATA_SIZE);
+    exit(0);
+  }
+  if (verified) {
+    Verification result;
+    program = load_verified(code, code_size, &result);
+    if (!program) {
+      printf("Rejected: %s at ip=%d\n", result.error, result.ip);
+      exit(1);
+    }
+  } else {
+    program = load_program(code, code_size);
+  }
+  if (runs > 0) {
+    batch(program, runs);
+    exit(0);
+  }
   printf("START:\n");
-  init(code, CODE_SIZE, data, DATA_SIZE);
-  execute(true);
-  state_dump();
+  init(&vm, program, data, DATA_SIZE);
+  if (trace) {
+    vm.trace = trace_create(trace_file);
+    if (!vm.trace) {
+      perror(trace_file);
+      exit(1);
+    }
+  }
+  if (folded_file) {
+    vm.profile = profile_create();
+  }
+  // the register tier doesn't trace, so show what it's going to run instead
+  if (registers && reg_translate(&vm)) {
+    reg_listing(stdout);
+    reg_execute(&vm);
+  } else {
+    execute(&vm);
+  }
+  if (vm.trace) {
+    if (!trace_file) {
+      trace_render(vm.trace, stdout);
+    }
+    trace_close(vm.trace);
+  }
+  state_dump(&vm);
+  if (vm.profile) {
+    FILE *folded = fopen(folded_file, "w");
+    profile_report(vm.profile, stdout);
+    if (!folded) {
+      perror(folded_file);
+      exit(1);
+    }
+    profile_folded(vm.profile, folded);
+    fclose(folded);
+    profile_free(vm.profile);
+  }
   exit(0);
 }
-
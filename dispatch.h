@@ -0,0 +1,33 @@
+#ifndef DISPATCH_H_INCLUDED
+#define DISPATCH_H_INCLUDED
+
+/*
+ * The interpreter loops are written once against the CASE()/NEXT macros so
+ * they can be built two ways:
+ *
+ *  - threaded (default with GCC/Clang): each decoded instruction carries the
+ *    address of its handler, and every handler ends in its own "goto *" to
+ *    the next one, so there is no opcode lookup or bounds check and each
+ *    opcode gets its own branch predictor entry.
+ *  - switch (-DVM_SWITCH_DISPATCH, or any non-GNU compiler): a portable
+ *    for/switch loop over the same decoded instructions.
+ *
+ * Both expect locals pc (the current instruction, with a handler field) and
+ * program (the array JUMP indexes into).
+ */
+#if defined(__GNUC__) && !defined(VM_SWITCH_DISPATCH)
+#define VM_THREADED_DISPATCH
+#endif
+
+#ifdef VM_THREADED_DISPATCH
+#define CASE(op)  L_##op
+#define DISPATCH() goto *pc->handler
+#else
+#define CASE(op)  case op
+#define DISPATCH() continue
+#endif
+// no do/while(0) wrapper here: DISPATCH() may be a "continue"
+#define NEXT       { pc++; DISPATCH(); }
+#define JUMP(to)   { pc = program + (to); DISPATCH(); }
+
+#endif
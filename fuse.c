@@ -0,0 +1,219 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "opcodes.h"
+#include "fuse.h"
+
+typedef struct _Fusion {
+  int32_t super;     // the superinstruction
+  int length;        // how many instructions it replaces
+  int32_t parts[3];
+} Fusion;
+
+// longest first, so that without a profile the bigger fusion wins
+static Fusion fusions[FUSION_COUNT] = {
+  { I_FRPUSH_FRPUSH_ADD, 3, { I_FRPUSH, I_FRPUSH, I_ADD } },
+  { I_FRPUSH_JZ,         2, { I_FRPUSH, I_JZ } },
+  { I_FRPUSH_JNZ,        2, { I_FRPUSH, I_JNZ } },
+  { I_ADD_FRPOP,         2, { I_ADD, I_FRPOP } },
+  { I_DEC_JNZ,           2, { I_DEC, I_JNZ } },
+  { I_PUSH_ADD,          2, { I_PUSH, I_ADD } }
+};
+
+// a jump or call operand that has to be pointed at the rewritten code
+typedef struct _Fixup {
+  int32_t at;          // new address of the instruction
+  int arg;             // which immediate argument
+  int32_t old_target;  // where it pointed in the old code
+  bool relative;
+} Fixup;
+
+static int insn_length(int32_t opcode) {
+  return ((uint32_t) opcode < OPCODE_COUNT) ? 1 + args[opcode] : 1;
+}
+
+/*
+ * Mark where instructions start and which of them are reachable other than
+ * by falling through (jump and call targets, and return addresses). Returns
+ * false if any jump or call lands inside an instruction.
+ */
+static bool find_targets(const int32_t *code, int code_size, bool *start, bool *target) {
+  int32_t at;
+  memset(start, 0, (code_size + 1) * sizeof(bool));
+  memset(target, 0, (code_size + 1) * sizeof(bool));
+  for (at = 0; at < code_size; at += insn_length(code[at])) {
+    start[at] = true;
+  }
+  start[code_size] = true;
+  target[0] = true;
+  for (at = 0; at < code_size; at += insn_length(code[at])) {
+    int32_t opcode = code[at];
+    int32_t dest;
+    if ((uint32_t) opcode >= OPCODE_COUNT || at + args[opcode] >= code_size) {
+      continue;
+    }
+    if (jump_arg[opcode]) {
+      dest = at + insn_length(opcode) + code[at + jump_arg[opcode]];
+    } else if (IS_CALL(opcode)) {
+      dest = code[at + 1];
+      if (opcode == I_CALL && at + 3 <= code_size) {
+        target[at + 3] = true;
+      }
+    } else {
+      continue;
+    }
+    if (dest < 0 || dest > code_size || !start[dest]) {
+      return false;
+    }
+    target[dest] = true;
+  }
+  return true;
+}
+
+static bool matches(const int32_t *code, int code_size, const bool *target, int32_t at, const Fusion *fusion) {
+  int i;
+  for (i = 0; i < fusion->length; i++) {
+    if (at >= code_size || code[at] != fusion->parts[i] || at + args[code[at]] >= code_size) {
+      return false;
+    }
+    if (i > 0 && target[at]) {
+      return false;
+    }
+    at += insn_length(code[at]);
+  }
+  return true;
+}
+
+static int choose_fusion(const int32_t *code, int code_size, const bool *target, int32_t at, const FuseProfile *profile) {
+  int best = -1;
+  int f;
+  for (f = 0; f < FUSION_COUNT; f++) {
+    if (!matches(code, code_size, target, at, &fusions[f])) {
+      continue;
+    }
+    if (!profile) {
+      return f;
+    }
+    if (profile->counts[f] > 0 && (best < 0 || profile->counts[f] > profile->counts[best])) {
+      best = f;
+    }
+  }
+  return best;
+}
+
+int fuse(int32_t *code, int code_size, const FuseProfile *profile) {
+  bool *start = (bool*) malloc((code_size + 1) * sizeof(bool));
+  bool *target = (bool*) malloc((code_size + 1) * sizeof(bool));
+  int32_t *out = (int32_t*) malloc(code_size * sizeof(int32_t));
+  int32_t *new_ip = (int32_t*) malloc((code_size + 1) * sizeof(int32_t));
+  Fixup *fixups = (Fixup*) malloc(code_size * sizeof(Fixup));
+  int fixup_count = 0;
+  int32_t out_size = 0;
+  int32_t at = 0;
+  int i;
+
+  if (!find_targets(code, code_size, start, target)) {
+    out_size = code_size;
+    goto done;
+  }
+  while (at < code_size) {
+    int f = choose_fusion(code, code_size, target, at, profile);
+    int parts = (f >= 0) ? fusions[f].length : 1;
+    int32_t insn_at = out_size;
+    new_ip[at] = insn_at;
+    out[out_size++] = (f >= 0) ? fusions[f].super : code[at];
+    // the superinstruction's immediates are those of its parts, in order
+    while (parts--) {
+      int32_t opcode = code[at];
+      int length = insn_length(opcode);
+      bool whole = (uint32_t) opcode < OPCODE_COUNT && at + length <= code_size;
+      if (at + length > code_size) {
+        length = code_size - at; // truncated, copy what there is
+      }
+      for (i = 1; i < length; i++) {
+        if (whole && (i == jump_arg[opcode] || (IS_CALL(opcode) && i == 1))) {
+          Fixup *fixup = &fixups[fixup_count++];
+          fixup->at = insn_at;
+          fixup->arg = out_size - insn_at;
+          fixup->relative = !IS_CALL(opcode);
+          fixup->old_target = fixup->relative ? at + length + code[at + i] : code[at + i];
+        }
+        out[out_size++] = code[at + i];
+      }
+      at += length;
+    }
+  }
+  new_ip[code_size] = out_size;
+
+  for (i = 0; i < fixup_count; i++) {
+    Fixup *fixup = &fixups[i];
+    int32_t dest = new_ip[fixup->old_target];
+    if (fixup->relative) {
+      dest -= fixup->at + insn_length(out[fixup->at]);
+    }
+    out[fixup->at + fixup->arg] = dest;
+  }
+  memcpy(code, out, out_size * sizeof(int32_t));
+  for (at = out_size; at < code_size; at++) {
+    code[at] = I_NOP;
+  }
+
+done:
+  free(start);
+  free(target);
+  free(out);
+  free(new_ip);
+  free(fixups);
+  return out_size;
+}
+
+void fuse_profile_add(FuseProfile *profile, const int32_t *code, int code_size, const uint64_t *ip_counts) {
+  bool *start = (bool*) malloc((code_size + 1) * sizeof(bool));
+  bool *target = (bool*) malloc((code_size + 1) * sizeof(bool));
+  int32_t at;
+  int f;
+  if (find_targets(code, code_size, start, target)) {
+    for (at = 0; at < code_size; at += insn_length(code[at])) {
+      if (!ip_counts[at]) {
+        continue;
+      }
+      for (f = 0; f < FUSION_COUNT; f++) {
+        if (matches(code, code_size, target, at, &fusions[f])) {
+          profile->counts[f] += ip_counts[at];
+        }
+      }
+    }
+  }
+  free(start);
+  free(target);
+}
+
+void fuse_profile_write(FILE *out, const FuseProfile *profile) {
+  int f;
+  for (f = 0; f < FUSION_COUNT; f++) {
+    fprintf(out, "%s %" PRIu64 "\n", instructions[fusions[f].super], profile->counts[f]);
+  }
+}
+
+int fuse_profile_read(FILE *in, FuseProfile *profile) {
+  char name[64];
+  uint64_t count;
+  int f;
+  memset(profile, 0, sizeof(FuseProfile));
+  while (fscanf(in, "%63s %" SCNu64, name, &count) == 2) {
+    for (f = 0; f < FUSION_COUNT; f++) {
+      if (strcmp(name, instructions[fusions[f].super]) == 0) {
+        break;
+      }
+    }
+    if (f == FUSION_COUNT) {
+      return 0;
+    }
+    profile->counts[f] = count;
+  }
+  return feof(in);
+}
@@ -0,0 +1,41 @@
+#ifndef FUSE_H_INCLUDED
+#define FUSE_H_INCLUDED
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define FUSION_COUNT 6
+
+/*
+ * How often each fusible instruction sequence was executed in a training
+ * run, indexed like the fusion table in fuse.c.
+ */
+typedef struct _FuseProfile {
+  uint64_t counts[FUSION_COUNT];
+} FuseProfile;
+
+/*
+ * Rewrite code in place, replacing common instruction sequences with
+ * superinstructions and fixing up jump offsets and call destinations.
+ * With a profile, only sequences that were executed are fused, and the
+ * hottest one wins where two candidates overlap; with NULL every candidate
+ * is fused in table order. Returns the new code size; the words freed up
+ * at the end are filled with NOPs. Code whose jumps don't all land on
+ * instruction boundaries is left alone.
+ */
+extern int fuse(int32_t *code, int code_size, const FuseProfile *profile);
+
+/*
+ * Add sequence counts to a profile from per-ip execution counts gathered
+ * with profile_ips() while running the unfused code.
+ */
+extern void fuse_profile_add(FuseProfile *profile, const int32_t *code, int code_size, const uint64_t *ip_counts);
+
+/*
+ * Save and load a profile as "NAME count" lines, so it can come from an
+ * earlier process. fuse_profile_read returns 0 on a malformed file.
+ */
+extern void fuse_profile_write(FILE *out, const FuseProfile *profile);
+extern int fuse_profile_read(FILE *in, FuseProfile *profile);
+
+#endif
@@ -0,0 +1,171 @@
+// for MAP_ANONYMOUS, sigaction() and siglongjmp()
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "guard.h"
+
+// the innermost Guard up on each thread
+static __thread Guard *current = NULL;
+
+static size_t page = 0;
+static bool installed = false;
+// what handled each signal before us, for faults that aren't ours
+static struct sigaction previous_segv;
+static struct sigaction previous_bus;
+
+static size_t round_up(size_t bytes) {
+  return (bytes + page - 1) & ~(page - 1);
+}
+
+/*
+ * Make the next part of region usable, doubling it or as far as address,
+ * whichever is more, up to its limit. mprotect() isn't strictly
+ * async-signal-safe, but it is a plain system call wherever this runs.
+ */
+static bool grow(Region *region, uint8_t *address) {
+  size_t need = round_up(address - region->base + 1);
+  size_t size = region->size * 2;
+  if (size < need) {
+    size = need;
+  }
+  if (size > region->limit) {
+    size = region->limit;
+  }
+  if (mprotect(region->base + region->size, size - region->size, PROT_READ | PROT_WRITE) != 0) {
+    return false;
+  }
+  region->size = size;
+  return true;
+}
+
+static void on_fault(int signal, siginfo_t *info, void *context) {
+  uint8_t *address = (uint8_t*) info->si_addr;
+  struct sigaction *previous;
+  Guard *guard;
+  int i;
+  for (guard = current; guard; guard = guard->outer) {
+    for (i = 0; i < GUARD_REGIONS; i++) {
+      Region *region = guard->regions[i];
+      int fault = FAULT_NONE;
+      if (!region || !region->base || address < region->base - page
+          || address >= region->base + round_up(region->limit) + page) {
+        continue;
+      }
+      if (address < region->base) {
+        fault = FAULT_BELOW;
+      } else if (address >= region->base + region->size && address < region->base + region->limit
+          && grow(region, address)) {
+        return;
+      } else if (address >= region->base + region->size) {
+        fault = FAULT_ABOVE;
+      } else {
+        // usable memory, so this fault was something else
+        break;
+      }
+      guard->region = i;
+      guard->fault = fault;
+      guard->address = address;
+      current = guard->outer;
+      siglongjmp(*(sigjmp_buf*) guard->jump, 1);
+    }
+  }
+  // not ours: hand it on to whatever handled it before
+  previous = (signal == SIGBUS) ? &previous_bus : &previous_segv;
+  if (previous->sa_flags & SA_SIGINFO) {
+    previous->sa_sigaction(signal, info, context);
+  } else if (previous->sa_handler != SIG_DFL && previous->sa_handler != SIG_IGN) {
+    previous->sa_handler(signal);
+  } else {
+    // put the default back to fault again, and ours back on the next guard_up()
+    sigaction(signal, previous, NULL);
+    installed = false;
+  }
+}
+
+/*
+ * SA_NODEFER, as the jump back skips the handler's return, and
+ * sigsetjmp(jump, 0) doesn't save the mask to put it right.
+ */
+static void install() {
+  struct sigaction action;
+  struct sigaction old;
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = on_fault;
+  action.sa_flags = SA_SIGINFO | SA_NODEFER;
+  sigemptyset(&action.sa_mask);
+  // two threads can get here at once, and the second mustn't keep ours
+  sigaction(SIGSEGV, &action, &old);
+  if (old.sa_sigaction != on_fault) {
+    previous_segv = old;
+  }
+  sigaction(SIGBUS, &action, &old);
+  if (old.sa_sigaction != on_fault) {
+    previous_bus = old;
+  }
+  installed = true;
+}
+
+bool region_map(Region *region, size_t size, size_t limit) {
+  uint8_t *mapping;
+  if (!page) {
+    page = (size_t) sysconf(_SC_PAGESIZE);
+  }
+  size = round_up(size);
+  if (size > limit) {
+    size = limit;
+  }
+  mapping = (uint8_t*) mmap(NULL, round_up(limit) + 2 * page, PROT_NONE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED) {
+    region->base = NULL;
+    return false;
+  }
+  if (mprotect(mapping + page, size, PROT_READ | PROT_WRITE) != 0) {
+    munmap(mapping, round_up(limit) + 2 * page);
+    region->base = NULL;
+    return false;
+  }
+  region->base = mapping + page;
+  region->size = size;
+  region->limit = limit;
+  if (!installed) {
+    install();
+  }
+  return true;
+}
+
+bool region_fit(Region *region, size_t size) {
+  if (size <= region->size) {
+    return true;
+  }
+  return size <= region->limit && grow(region, region->base + size - 1);
+}
+
+void region_unmap(Region *region) {
+  if (region->base) {
+    munmap(region->base - page, round_up(region->limit) + 2 * page);
+    region->base = NULL;
+  }
+}
+
+void guard_up(Guard *guard) {
+  if (!installed) {
+    install();
+  }
+  guard->fault = FAULT_NONE;
+  guard->outer = current;
+  current = guard;
+}
+
+void guard_down(Guard *guard) {
+  current = guard->outer;
+}
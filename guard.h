@@ -0,0 +1,66 @@
+#ifndef GUARD_H_INCLUDED
+#define GUARD_H_INCLUDED
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Memory fenced off by PROT_NONE pages, for the VM's stacks. A Region is
+ * mapped with all the room it can ever grow to, but only its first size
+ * bytes usable: touching the rest, or the guard page at either end,
+ * faults.
+ *
+ * While a thread has a Guard up, the SIGSEGV handler grows a region of
+ * that Guard's when it faults past its usable part, up to its limit, and
+ * carries on as if nothing had happened. Any other fault on a region's
+ * guard pages goes back to the Guard, saying where, with siglongjmp();
+ * anything else is left to whatever handled SIGSEGV before. So code
+ * running under a Guard needs no checks of its own for running off
+ * either end of a stack.
+ */
+typedef struct _Region {
+  uint8_t *base;  // the first byte, a guard page above the mapping's start
+  size_t size;    // bytes usable so far
+  size_t limit;   // bytes it can grow to, up to the guard page above
+} Region;
+
+// the regions a Guard watches
+#define GUARD_REGIONS 2
+
+// what a Guard caught
+#define FAULT_NONE  0
+#define FAULT_BELOW 1 // the guard page below a region
+#define FAULT_ABOVE 2 // past its limit
+
+typedef struct _Guard {
+  struct _Guard *outer;             // the one up before it on this thread
+  Region *regions[GUARD_REGIONS];
+  void *jump;                       // the sigjmp_buf to go back to
+  // filled in by the handler before it jumps
+  volatile int region;
+  volatile int fault;
+  uint8_t * volatile address;
+} Guard;
+
+/*
+ * Map a region of limit bytes, the first size of them usable. Both are
+ * made whole pages when it comes to the mapping, so a region can use the
+ * rest of its last page. False if there isn't the address space.
+ */
+extern bool region_map(Region *region, size_t size, size_t limit);
+extern void region_unmap(Region *region);
+/*
+ * Make at least the first size bytes of a region usable now, for writing
+ * to it with no Guard up. False if that's past its limit.
+ */
+extern bool region_fit(Region *region, size_t size);
+
+/*
+ * Put guard up on this thread, with its regions and jump filled in, and
+ * take it down again, innermost first.
+ */
+extern void guard_up(Guard *guard);
+extern void guard_down(Guard *guard);
+
+#endif
@@ -0,0 +1,169 @@
+// for open() and mmap()
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "image.h"
+
+static uint32_t align(uint32_t offset) {
+  return (offset + IMAGE_ALIGN - 1) & ~(uint32_t) (IMAGE_ALIGN - 1);
+}
+
+// write bytes at offset, padding with zeros from where the file is up to
+static bool put(FILE *out, uint32_t *at, uint32_t offset, const void *bytes, size_t size) {
+  while (*at < offset) {
+    if (fputc(0, out) == EOF) {
+      return false;
+    }
+    (*at)++;
+  }
+  if (size && fwrite(bytes, 1, size, out) != size) {
+    return false;
+  }
+  *at += size;
+  return true;
+}
+
+bool image_write(const char *path, int32_t *code, int code_size,
+    int32_t *data, int data_size, int32_t entry,
+    char **names, int32_t *offsets, int symbol_count) {
+  ImageHeader header;
+  ImageSymbol *symbols = (ImageSymbol*) malloc((symbol_count + 1) * sizeof(ImageSymbol));
+  char *strings;
+  int32_t strings_size = 0;
+  uint32_t at = 0;
+  bool ok;
+  FILE *out;
+  int i;
+
+  for (i = 0; i < symbol_count; i++) {
+    symbols[i].name = strings_size;
+    symbols[i].data_offset = offsets[i];
+    strings_size += strlen(names[i]) + 1;
+  }
+  strings = (char*) malloc(strings_size + 1);
+  for (i = 0; i < symbol_count; i++) {
+    strcpy(strings + symbols[i].name, names[i]);
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+  header.version = IMAGE_VERSION;
+  header.header_size = sizeof(header);
+  header.entry = entry;
+  header.code_size = code_size;
+  header.code_offset = align(sizeof(header));
+  header.data_size = data_size;
+  header.data_offset = align(header.code_offset + code_size * sizeof(int32_t));
+  header.symbol_count = symbol_count;
+  header.symbols_offset = align(header.data_offset + data_size * sizeof(int32_t));
+  header.strings_size = strings_size;
+  header.strings_offset = header.symbols_offset + symbol_count * sizeof(ImageSymbol);
+
+  out = fopen(path, "wb");
+  ok = out
+    && put(out, &at, 0, &header, sizeof(header))
+    && put(out, &at, header.code_offset, code, code_size * sizeof(int32_t))
+    && put(out, &at, header.data_offset, data, data_size * sizeof(int32_t))
+    && put(out, &at, header.symbols_offset, symbols, symbol_count * sizeof(ImageSymbol))
+    && put(out, &at, header.strings_offset, strings, strings_size);
+  if (out && fclose(out) != 0) {
+    ok = false;
+  }
+  free(symbols);
+  free(strings);
+  return ok;
+}
+
+// is [offset, offset + size) inside the file, and is it aligned
+static bool section(Image *image, uint32_t offset, int32_t count, size_t item, bool page) {
+  if (count < 0 || offset > image->size || (size_t) count > (image->size - offset) / item) {
+    return false;
+  }
+  return page ? offset % IMAGE_ALIGN == 0 : offset % sizeof(int32_t) == 0;
+}
+
+static Image *fail(Image *image, char *error, size_t error_size, const char *reason) {
+  snprintf(error, error_size, "%s", reason);
+  image_close(image);
+  return NULL;
+}
+
+Image *image_open(const char *path, char *error, size_t error_size) {
+  Image *image;
+  ImageHeader *header;
+  struct stat info;
+  void *base;
+  int fd = open(path, O_RDONLY);
+  int i;
+
+  if (fd < 0 || fstat(fd, &info) != 0) {
+    snprintf(error, error_size, "Can't open %s", path);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return NULL;
+  }
+  if ((size_t) info.st_size < sizeof(ImageHeader)) {
+    close(fd);
+    snprintf(error, error_size, "Not an image");
+    return NULL;
+  }
+  // private and writable for the data; the code is made read only below
+  base = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    snprintf(error, error_size, "Can't map %s", path);
+    return NULL;
+  }
+  image = (Image*) calloc(1, sizeof(Image));
+  image->base = (uint8_t*) base;
+  image->size = info.st_size;
+  image->header = header = (ImageHeader*) base;
+
+  if (memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) != 0) {
+    return fail(image, error, error_size, "Not an image");
+  }
+  if (header->version != IMAGE_VERSION || header->header_size != sizeof(ImageHeader)) {
+    return fail(image, error, error_size, "Image is for another version");
+  }
+  if (!section(image, header->code_offset, header->code_size, sizeof(int32_t), true)
+      || !section(image, header->data_offset, header->data_size, sizeof(int32_t), true)
+      || !section(image, header->symbols_offset, header->symbol_count, sizeof(ImageSymbol), false)
+      || !section(image, header->strings_offset, header->strings_size, 1, false)
+      || header->code_offset + header->code_size * sizeof(int32_t) > header->data_offset) {
+    return fail(image, error, error_size, "Image sections out of place");
+  }
+  if (header->entry < 0 || header->entry > header->code_size) {
+    return fail(image, error, error_size, "Image entry point outside the code");
+  }
+  image->code = (int32_t*) (image->base + header->code_offset);
+  image->data = (int32_t*) (image->base + header->data_offset);
+  image->symbols = (ImageSymbol*) (image->base + header->symbols_offset);
+  image->strings = (char*) (image->base + header->strings_offset);
+  for (i = 0; i < header->symbol_count; i++) {
+    int32_t name = image->symbols[i].name;
+    if (name < 0 || name >= header->strings_size
+        || !memchr(image->strings + name, '\0', header->strings_size - name)) {
+      return fail(image, error, error_size, "Image symbol name out of place");
+    }
+  }
+  // nothing may write the code or the header, and then they're never copied
+  if (mprotect(base, header->data_offset, PROT_READ) != 0) {
+    return fail(image, error, error_size, "Can't protect the image's code");
+  }
+  return image;
+}
+
+void image_close(Image *image) {
+  munmap(image->base, image->size);
+  free(image);
+}
@@ -0,0 +1,78 @@
+#ifndef IMAGE_H_INCLUDED
+#define IMAGE_H_INCLUDED
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Program images: a program saved to a file that can be mmap'd and run
+ * as it is. The file is an ImageHeader, then the code, the initial data,
+ * the symbol table and the symbol names, each section starting on a page
+ * boundary so it can be mapped on its own terms:
+ *
+ *  - the code is mapped read only and handed straight to load_program(),
+ *    so every process running an image shares the one copy of its pages
+ *    in the page cache;
+ *  - the data is mapped copy on write, so a VM can use it in place and
+ *    only the pages it writes to get copied, and only for that process.
+ *
+ * Everything is in the host's byte order; the version in the header
+ * changes whenever the layout does, or the opcodes are renumbered.
+ */
+#define IMAGE_MAGIC "VMIMAGE\0"
+#define IMAGE_VERSION 2
+#define IMAGE_ALIGN 4096
+
+typedef struct _ImageHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;     // sizeof(ImageHeader)
+  int32_t entry;            // where to start running
+  int32_t code_size;        // in words, like every size but strings_size
+  uint32_t code_offset;     // in bytes from the start of the file
+  int32_t data_size;
+  uint32_t data_offset;
+  int32_t symbol_count;
+  uint32_t symbols_offset;
+  int32_t strings_size;     // in bytes
+  uint32_t strings_offset;
+} ImageHeader;
+
+// a variable, by its name's offset in the strings and its data address
+typedef struct _ImageSymbol {
+  int32_t name;
+  int32_t data_offset;
+} ImageSymbol;
+
+typedef struct _Image {
+  uint8_t *base;        // the whole file, mapped
+  size_t size;
+  ImageHeader *header;
+  int32_t *code;        // read only
+  int32_t *data;        // copy on write
+  ImageSymbol *symbols;
+  char *strings;
+} Image;
+
+/*
+ * Write an image of the program to path: symbol_count symbols named names
+ * with the data addresses in offsets. Returns false, with errno set, if the
+ * file can't be written.
+ */
+extern bool image_write(const char *path, int32_t *code, int code_size,
+    int32_t *data, int data_size, int32_t entry,
+    char **names, int32_t *offsets, int symbol_count);
+
+/*
+ * Map the image at path. Returns NULL, with the reason in error, if it
+ * can't be read or isn't a well formed image of this version.
+ */
+extern Image *image_open(const char *path, char *error, size_t error_size);
+extern void image_close(Image *image);
+
+static inline char *image_symbol_name(Image *image, int i) {
+  return image->strings + image->symbols[i].name;
+}
+
+#endif
@@ -0,0 +1,736 @@
+// for MAP_ANONYMOUS
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "vm.h"
+#include "opcodes.h"
+#include "jit.h"
+
+#if defined(__x86_64__) && defined(__unix__) && !defined(VM_NO_JIT)
+#define JIT_SUPPORTED
+#include <sys/mman.h>
+#endif
+
+int _jit_threshold = 0;
+
+void jit_set_threshold(int count) {
+  _jit_threshold = count;
+}
+
+#ifdef JIT_SUPPORTED
+
+#define CODE_BUFFER_SIZE (4 << 20)
+// generous upper bounds on the native code for one instruction and its exit
+#define MAX_INSN_BYTES 128
+#define MAX_STUB_BYTES 16
+#define MAX_TAILCALL_ARGS 6
+
+/*
+ * What the native code shares with C. Native code keeps the VM registers
+ * in machine registers while it runs:
+ *
+ *   rbx  &stack[0]       r12  &stack[sp]      r13  &stack[fp]
+ *   r14  &data[0]        r15  this struct     rbp  &control[csp]
+ *
+ * and everything else on the VM's stacks themselves, so there is nothing
+ * to write back on the way out but sp, fp and csp.
+ */
+typedef struct _JitState {
+  int32_t *stack;
+  int32_t *data;
+  void *saved_rsp;  // rsp in jit_run, to unwind native calls on the way out
+  int32_t ip;
+  int32_t sp;
+  int32_t fp;
+  Frame *frame;     // the next free control frame
+  Frame *control;   // ...which is here with none in use
+  Frame *control_end; // as deep as native calls go on the C stack
+} JitState;
+
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBX 3
+#define RSP 4
+#define RBP 5
+#define RSI 6
+#define RDI 7
+#define R12 12
+#define R13 13
+#define R14 14
+#define R15 15
+
+#define STACK RBX
+#define SP    R12
+#define FP    R13
+#define DATA  R14
+#define STATE R15
+#define FRAME RBP
+
+// condition codes for jcc
+#define CC_B  0x2
+#define CC_AE 0x3
+#define CC_Z  0x4
+#define CC_NZ 0x5
+
+static uint8_t *buffer = NULL;
+static size_t used = 0;
+static void (*trampoline)(JitState*, void*);
+static size_t exit_common;   // where native code goes to leave, with the ip in eax
+static size_t units_start;   // the first byte after the trampoline
+
+static void **entries = NULL;   // bytecode address -> native code, or NULL
+static int32_t *counts = NULL;  // arrivals, or -1 where compiling failed
+static Program *loaded = NULL;  // the program all that is for
+static int32_t *code;
+static int code_size;
+
+static void byte(int b) {
+  buffer[used++] = (uint8_t) b;
+}
+
+static void dword(int32_t value) {
+  memcpy(buffer + used, &value, 4);
+  used += 4;
+}
+
+static void qword(uint64_t value) {
+  memcpy(buffer + used, &value, 8);
+  used += 8;
+}
+
+static void patch(size_t at, size_t to) {
+  int32_t rel = (int32_t) (to - (at + 4));
+  memcpy(buffer + at, &rel, 4);
+}
+
+static void rex(int w, int reg, int index, int base) {
+  int prefix = 0x40 | (w << 3) | ((reg & 8) >> 1) | ((index & 8) >> 2) | ((base & 8) >> 3);
+  if (prefix != 0x40) {
+    byte(prefix);
+  }
+}
+
+static void op_bytes(int op) {
+  if (op > 0xff) {
+    byte(op >> 8);
+  }
+  byte(op & 0xff);
+}
+
+// op with a register operand and a [base + disp] operand
+static void op_mem(int w, int op, int reg, int base, int32_t disp) {
+  bool short_disp = disp >= -128 && disp <= 127;
+  rex(w, reg, 0, base);
+  op_bytes(op);
+  byte((short_disp ? 0x40 : 0x80) | (reg & 7) << 3 | (base & 7));
+  if ((base & 7) == RSP) {
+    byte(0x24);
+  }
+  if (short_disp) {
+    byte(disp);
+  } else {
+    dword(disp);
+  }
+}
+
+// op with two register operands
+static void op_reg(int w, int op, int reg, int rm) {
+  rex(w, reg, 0, rm);
+  op_bytes(op);
+  byte(0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// lea dst, [base + index*4 + disp]
+static void lea_index(int dst, int base, int index, int8_t disp) {
+  rex(1, dst, index, base);
+  byte(0x8d);
+  byte(0x44 | (dst & 7) << 3);
+  byte(0x80 | (index & 7) << 3 | (base & 7));
+  byte(disp);
+}
+
+static void push_reg(int reg) {
+  rex(0, 0, 0, reg);
+  byte(0x50 | (reg & 7));
+}
+
+static void pop_reg(int reg) {
+  rex(0, 0, 0, reg);
+  byte(0x58 | (reg & 7));
+}
+
+// reg = index of the slot ptr points at
+static void slot_index(int reg, int ptr) {
+  op_reg(1, 0x89, ptr, reg);    // mov reg, ptr
+  op_reg(1, 0x29, STACK, reg);  // sub reg, rbx
+  op_reg(1, 0xc1, 7, reg);      // sar reg, 2
+  byte(2);
+}
+
+static void move_sp(int8_t bytes) {
+  op_reg(1, 0x83, 0, SP);       // add r12, bytes
+  byte(bytes);
+}
+
+// jcc or jmp with a 32 bit offset to fill in later; returns where it goes
+static size_t jump(int cc) {
+  if (cc < 0) {
+    byte(0xe9);
+  } else {
+    byte(0x0f);
+    byte(0x80 | cc);
+  }
+  dword(0);
+  return used - 4;
+}
+
+static void exit_at(int32_t ip) {
+  byte(0xb8);                   // mov eax, ip
+  dword(ip);
+  patch(jump(-1), exit_common);
+}
+
+/*
+ * jit_run's native half: save the callee-saved registers, load the VM
+ * registers, and call the unit. Whether it returns (a RETURN from the unit
+ * itself, with its return address in eax) or jumps to exit_common from
+ * however deep in native calls, we end up storing sp, fp and eax and
+ * returning to C.
+ */
+static void emit_trampoline() {
+  push_reg(RBX);
+  push_reg(RBP);
+  push_reg(R12);
+  push_reg(R13);
+  push_reg(R14);
+  push_reg(R15);
+  op_reg(1, 0x83, 5, RSP);      // sub rsp, 8: keep the stack aligned
+  byte(8);
+  op_reg(1, 0x89, RDI, STATE);  // mov r15, rdi
+  op_mem(1, 0x89, RSP, STATE, offsetof(JitState, saved_rsp));
+  op_mem(1, 0x8b, STACK, STATE, offsetof(JitState, stack));
+  op_mem(1, 0x8b, DATA, STATE, offsetof(JitState, data));
+  op_mem(1, 0x63, RAX, STATE, offsetof(JitState, sp));  // movsxd
+  lea_index(SP, STACK, RAX, 0);
+  op_mem(1, 0x63, RAX, STATE, offsetof(JitState, fp));
+  lea_index(FP, STACK, RAX, 0);
+  op_mem(1, 0x8b, FRAME, STATE, offsetof(JitState, frame));
+  op_reg(0, 0xff, 2, RSI);      // call rsi
+
+  exit_common = used;
+  op_mem(1, 0x8b, RSP, STATE, offsetof(JitState, saved_rsp));
+  op_mem(0, 0x89, RAX, STATE, offsetof(JitState, ip));
+  slot_index(RAX, SP);
+  op_mem(0, 0x89, RAX, STATE, offsetof(JitState, sp));
+  slot_index(RAX, FP);
+  op_mem(0, 0x89, RAX, STATE, offsetof(JitState, fp));
+  op_mem(1, 0x89, FRAME, STATE, offsetof(JitState, frame));
+  op_reg(1, 0x83, 0, RSP);      // add rsp, 8
+  byte(8);
+  pop_reg(R15);
+  pop_reg(R14);
+  pop_reg(R13);
+  pop_reg(R12);
+  pop_reg(RBP);
+  pop_reg(RBX);
+  byte(0xc3);
+}
+
+static bool writable(bool on) {
+  return mprotect(buffer, CODE_BUFFER_SIZE, on ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC) == 0;
+}
+
+static bool setup() {
+  void *memory = mmap(NULL, CODE_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    return false;
+  }
+  buffer = (uint8_t*) memory;
+  emit_trampoline();
+  units_start = used;
+  trampoline = (void (*)(JitState*, void*)) (void*) buffer;
+  return writable(false);
+}
+
+void jit_reset(Program *program) {
+  loaded = program;
+  code = program->code;
+  code_size = program->code_size;
+  free(entries);
+  free(counts);
+  entries = (void**) calloc(code_size + 1, sizeof(void*));
+  counts = (int32_t*) calloc(code_size + 1, sizeof(int32_t));
+  used = units_start;
+}
+
+static int32_t insn_length(int32_t opcode) {
+  return ((uint32_t) opcode < OPCODE_COUNT) ? 1 + args[opcode] : 1;
+}
+
+// opcodes whose immediates are frame or data offsets
+static bool indexes[OPCODE_COUNT] = {
+  [I_LOADPUSH] = true, [I_POPSTORE] = true, [I_STORE] = true,
+  [I_FRPUSH] = true, [I_FRPOP] = true, [I_FRPUSH_FRPUSH_ADD] = true,
+  [I_ADD_FRPOP] = true, [I_FRPUSH_JZ] = true, [I_FRPUSH_JNZ] = true
+};
+
+// an offset that still fits in a disp32 once scaled
+static bool fits(int32_t index) {
+  return index >= -(1 << 29) && index < (1 << 29);
+}
+
+/*
+ * Per-compile state: which instructions are in the unit, where their code
+ * starts, and the jumps and exits to fill in at the end.
+ */
+typedef struct _Fixup {
+  size_t at;       // the rel32 to fill in
+  int32_t target;  // bytecode address, or ip to exit at for a stub
+} Fixup;
+
+static bool *start;
+static bool *reached;
+static size_t *label;
+static Fixup *jumps;
+static int jump_count;
+static Fixup *stubs;
+static int stub_count;
+
+// the bytecode address this instruction jumps to, or -1 if it isn't one
+static int32_t jump_target(int32_t at) {
+  int32_t opcode = code[at];
+  int32_t target;
+  if (!jump_arg[opcode]) {
+    return -1;
+  }
+  target = at + insn_length(opcode) + code[at + jump_arg[opcode]];
+  return (target >= 0 && target <= code_size && start[target]) ? target : -2;
+}
+
+static bool complete(int32_t at) {
+  return at == code_size
+    || ((uint32_t) code[at] < OPCODE_COUNT && at + args[code[at]] < code_size);
+}
+
+// mark everything reachable from entry without going through a CALL
+static int find_unit(int32_t entry) {
+  int32_t *work = (int32_t*) malloc((code_size + 1) * sizeof(int32_t));
+  int work_count = 0;
+  int count = 0;
+  work[work_count++] = entry;
+  reached[entry] = true;
+  while (work_count > 0) {
+    int32_t at = work[--work_count];
+    int32_t next[2] = { -1, -1 };
+    int k;
+    count++;
+    if (!complete(at) || at == code_size) {
+      continue;
+    }
+    if (jump_target(at) == -2) {
+      continue; // exits to the interpreter, which reports it
+    }
+    next[0] = jump_target(at);
+    if (code[at] != I_JMP && code[at] != I_RETURN && code[at] != I_STOP && code[at] != I_TAILCALL) {
+      next[1] = at + insn_length(code[at]);
+    }
+    for (k = 0; k < 2; k++) {
+      if (next[k] >= 0 && !reached[next[k]]) {
+        reached[next[k]] = true;
+        work[work_count++] = next[k];
+      }
+    }
+  }
+  free(work);
+  return count;
+}
+
+static void add_stub(size_t at, int32_t ip) {
+  stubs[stub_count++] = (Fixup) { at, ip };
+}
+
+static void add_jump(size_t at, int32_t target) {
+  jumps[jump_count++] = (Fixup) { at, target };
+}
+
+// exit to the interpreter at ip unless sp >= depth
+static void check_underflow(int32_t ip, int depth) {
+  if (depth == 0) {
+    op_reg(1, 0x39, STACK, SP);     // cmp r12, rbx
+  } else {
+    op_mem(1, 0x8d, RAX, STACK, 4 * depth);
+    op_reg(1, 0x39, RAX, SP);       // cmp r12, rax
+  }
+  add_stub(jump(CC_B), ip);
+}
+
+static void emit_push_from(int base, int32_t index) {
+  op_mem(0, 0x8b, RAX, base, 4 * index);   // mov eax, [base + 4 * index]
+  move_sp(4);
+  op_mem(0, 0x89, RAX, SP, 0);
+}
+
+static void emit_pop_to(int base, int32_t index) {
+  op_mem(0, 0x8b, RAX, SP, 0);
+  move_sp(-4);
+  op_mem(0, 0x89, RAX, base, 4 * index);
+}
+
+// pop y, then [r12] = [r12] op y
+static void emit_binary(int32_t op) {
+  op_mem(0, 0x8b, (op == I_DIV || op == I_MOD) ? RCX : RAX, SP, 0);
+  move_sp(-4);
+  switch (op) {
+    case I_ADD:
+      op_mem(0, 0x01, RAX, SP, 0);          // add [r12], eax
+      break;
+    case I_SUB:
+      op_mem(0, 0x29, RAX, SP, 0);          // sub [r12], eax
+      break;
+    case I_MUL:
+      op_mem(0, 0x0faf, RAX, SP, 0);        // imul eax, [r12]
+      op_mem(0, 0x89, RAX, SP, 0);
+      break;
+    default:
+      op_mem(0, 0x8b, RAX, SP, 0);
+      byte(0x99);                           // cdq
+      op_reg(0, 0xf7, 7, RCX);              // idiv ecx
+      op_mem(0, 0x89, (op == I_DIV) ? RAX : RDX, SP, 0);
+      break;
+  }
+}
+
+// jump to target if the top of stack is (non)zero
+static void emit_branch(int cc, int32_t target) {
+  op_mem(0, 0x83, 7, SP, 0);                // cmp dword [r12], 0
+  byte(0);
+  add_jump(jump(cc), target);
+}
+
+// rax = the native code for target, or exit at at to let the interpreter do it
+static void load_entry(int32_t at, int32_t target) {
+  byte(0x48);                               // mov rax, &entries[target]
+  byte(0xb8);
+  qword((uint64_t) (uintptr_t) &entries[target]);
+  op_mem(1, 0x8b, RAX, RAX, 0);             // mov rax, [rax]
+  op_reg(1, 0x85, RAX, RAX);                // test rax, rax
+  add_stub(jump(CC_Z), at);
+}
+
+// exit at at, where the interpreter reports it, unless there's a frame to leave
+static void check_frame(int32_t at) {
+  op_mem(1, 0x3b, FRAME, STATE, offsetof(JitState, control));  // cmp rbp, [r15 + control]
+  add_stub(jump(CC_Z), at);
+}
+
+/*
+ * The same frame as I_CALL. Whatever the callee does, it comes back here
+ * by returning from the native call, with the control stack as it was.
+ */
+static void emit_call(int32_t at, int32_t target, int32_t arg_count) {
+  load_entry(at, target);
+  op_mem(1, 0x3b, FRAME, STATE, offsetof(JitState, control_end));
+  add_stub(jump(CC_AE), at);                // too deep, the interpreter carries on
+  op_mem(0, 0xc7, 0, FRAME, offsetof(Frame, ip));
+  dword(at + 3);
+  slot_index(RCX, FP);
+  op_mem(0, 0x89, RCX, FRAME, offsetof(Frame, fp));
+  slot_index(RCX, SP);
+  op_reg(0, 0x81, 5, RCX);                  // sub ecx, arg_count
+  dword(arg_count);
+  op_mem(0, 0x89, RCX, FRAME, offsetof(Frame, sp));
+  op_reg(1, 0x83, 0, FRAME);                // add rbp, sizeof(Frame)
+  byte(sizeof(Frame));
+  op_mem(1, 0x8d, FP, SP, 4);               // lea r13, [r12 + 4]
+  op_reg(0, 0xff, 2, RAX);                  // call rax
+}
+
+static void emit_return(int32_t at) {
+  check_frame(at);
+  op_mem(0, 0x8b, RCX, SP, 0);              // return value
+  op_reg(1, 0x83, 5, FRAME);                // sub rbp, sizeof(Frame)
+  byte(sizeof(Frame));
+  op_mem(0, 0x8b, RAX, FRAME, offsetof(Frame, ip));
+  op_mem(1, 0x63, RDX, FRAME, offsetof(Frame, sp));
+  lea_index(SP, STACK, RDX, 4);
+  op_mem(0, 0x89, RCX, SP, 0);
+  op_mem(1, 0x63, RDX, FRAME, offsetof(Frame, fp));
+  lea_index(FP, STACK, RDX, 0);
+  byte(0xc3);
+}
+
+/*
+ * Move the arguments down to where the current frame's are and jump to the
+ * target: a plain jump within this unit, or into another unit's native code,
+ * which returns to whoever called this one.
+ */
+static void emit_tailcall(int32_t at, int32_t target, int32_t arg_count) {
+  int32_t i;
+  check_frame(at);
+  if (!reached[target]) {
+    load_entry(at, target);
+  }
+  op_mem(1, 0x63, RDX, FRAME, (int32_t) offsetof(Frame, sp) - (int32_t) sizeof(Frame));
+  lea_index(RDI, STACK, RDX, 4);            // where the first argument goes
+  for (i = 0; i < arg_count; i++) {
+    op_mem(0, 0x8b, RCX, SP, 4 * (i + 1 - arg_count));
+    op_mem(0, 0x89, RCX, RDI, 4 * i);
+  }
+  op_mem(1, 0x8d, SP, RDI, 4 * arg_count - 4);
+  op_mem(1, 0x8d, FP, RDI, 4 * arg_count);
+  if (reached[target]) {
+    add_jump(jump(-1), target);
+  } else {
+    op_reg(0, 0xff, 4, RAX);                // jmp rax
+  }
+}
+
+static void emit_insn(int32_t at) {
+  int32_t opcode = code[at];
+  int32_t a = (args[opcode] >= 1) ? code[at + 1] : 0;
+  int32_t b = (args[opcode] >= 2) ? code[at + 2] : 0;
+  int32_t target = jump_target(at);
+
+  if (target == -2 || (indexes[opcode] && (!fits(a) || !fits(b)))) {
+    exit_at(at);
+    return;
+  }
+  switch (opcode) {
+    case I_POPSTORE: case I_STORE: case I_FRPOP: case I_PUSH_ADD:
+      check_underflow(at, 0);
+      break;
+    case I_ADD: case I_SUB: case I_MUL: case I_DIV: case I_MOD:
+    case I_ADD_FRPOP:
+      check_underflow(at, 1);
+      break;
+  }
+  switch (opcode) {
+    case I_NOP:
+      break;
+    case I_PUSH:
+      move_sp(4);
+      op_mem(0, 0xc7, 0, SP, 0);
+      dword(a);
+      break;
+    case I_POP:
+      move_sp(-4);
+      break;
+    case I_ADD: case I_SUB: case I_MUL: case I_DIV: case I_MOD:
+      emit_binary(opcode);
+      break;
+    case I_INC:
+      op_mem(0, 0x83, 0, SP, 0);
+      byte(1);
+      break;
+    case I_DEC:
+      op_mem(0, 0x83, 5, SP, 0);
+      byte(1);
+      break;
+    case I_NEG:
+      op_mem(0, 0xf7, 3, SP, 0);
+      break;
+    case I_LOADPUSH:
+      emit_push_from(DATA, a);
+      break;
+    case I_POPSTORE:
+      emit_pop_to(DATA, a);
+      break;
+    case I_STORE:
+      op_mem(0, 0x8b, RAX, SP, 0);
+      op_mem(0, 0x89, RAX, DATA, 4 * a);
+      break;
+    case I_FRPUSH:
+      emit_push_from(FP, a);
+      break;
+    case I_FRPOP:
+      emit_pop_to(FP, a);
+      break;
+    case I_JZ:
+      emit_branch(CC_Z, target);
+      break;
+    case I_JNZ:
+      emit_branch(CC_NZ, target);
+      break;
+    case I_JMP:
+      add_jump(jump(-1), target);
+      break;
+    case I_CALL:
+      if (a >= 0 && a <= code_size && start[a]) {
+        emit_call(at, a, b);
+      } else {
+        exit_at(at);
+      }
+      break;
+    case I_TAILCALL:
+      // the arguments are copied one by one, so only a few
+      if (a >= 0 && a <= code_size && start[a] && b >= 0 && b <= MAX_TAILCALL_ARGS) {
+        emit_tailcall(at, a, b);
+      } else {
+        exit_at(at);
+      }
+      break;
+    case I_RETURN:
+      emit_return(at);
+      break;
+    case I_FRPUSH_FRPUSH_ADD:
+      emit_push_from(FP, a);
+      emit_push_from(FP, b);
+      emit_binary(I_ADD);
+      break;
+    case I_ADD_FRPOP:
+      emit_binary(I_ADD);
+      emit_pop_to(FP, a);
+      break;
+    case I_DEC_JNZ:
+      op_mem(0, 0x83, 5, SP, 0);            // sub dword [r12], 1 sets ZF
+      byte(1);
+      add_jump(jump(CC_NZ), target);
+      break;
+    case I_PUSH_ADD:
+      op_mem(0, 0x81, 0, SP, 0);            // add dword [r12], a
+      dword(a);
+      break;
+    case I_FRPUSH_JZ:
+      emit_push_from(FP, a);
+      emit_branch(CC_Z, target);
+      break;
+    case I_FRPUSH_JNZ:
+      emit_push_from(FP, a);
+      emit_branch(CC_NZ, target);
+      break;
+    default:
+      // STOP, and anything else we leave to the interpreter
+      exit_at(at);
+      break;
+  }
+}
+
+/*
+ * Whether the unit find_unit() found has typed value, bulk array or
+ * NATIVE instructions. They're left to the interpreter, which quickens the
+ * first, has SIMD kernels for the second and the registry for the third,
+ * and a unit that kept leaving for one would be slower than no unit at all.
+ */
+static bool has_interpreted() {
+  int32_t at;
+  for (at = 0; at < code_size; at += insn_length(code[at])) {
+    if (reached[at] && (IS_VALUE_OP(code[at]) || IS_BULK_OP(code[at]) || code[at] == I_NATIVE)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * Compile the code reachable from entry into one native function, laid
+ * out in bytecode order so falling through stays falling through.
+ */
+static void *compile(int32_t entry) {
+  int32_t at;
+  int i;
+  int count;
+  size_t begin = used;
+  int32_t size = code_size + 1;
+  void *native = NULL;
+
+  start = (bool*) calloc(size, sizeof(bool));
+  reached = (bool*) calloc(size, sizeof(bool));
+  label = (size_t*) malloc(size * sizeof(size_t));
+  for (at = 0; at < code_size; at += insn_length(code[at])) {
+    start[at] = true;
+  }
+  start[code_size] = true;
+  count = find_unit(entry);
+  jumps = (Fixup*) malloc(count * sizeof(Fixup));
+  stubs = (Fixup*) malloc(2 * count * sizeof(Fixup));
+  jump_count = stub_count = 0;
+
+  if (!has_interpreted() && used + (size_t) (count + 1) * (MAX_INSN_BYTES + 2 * MAX_STUB_BYTES) < CODE_BUFFER_SIZE
+      && writable(true)) {
+    // the entry need not come first in bytecode order
+    add_jump(jump(-1), entry);
+    for (at = 0; at <= code_size; at += (at < code_size) ? insn_length(code[at]) : 1) {
+      if (!reached[at]) {
+        continue;
+      }
+      label[at] = used;
+      if (at == code_size || !complete(at)) {
+        exit_at(at);
+      } else {
+        emit_insn(at);
+      }
+    }
+    for (i = 0; i < jump_count; i++) {
+      patch(jumps[i].at, label[jumps[i].target]);
+    }
+    for (i = 0; i < stub_count; i++) {
+      patch(stubs[i].at, used);
+      exit_at(stubs[i].target);
+    }
+    writable(false);
+    native = buffer + begin;
+  }
+
+  free(start);
+  free(reached);
+  free(label);
+  free(jumps);
+  free(stubs);
+  return native;
+}
+
+void *jit_entry(VM *vm, int32_t target) {
+  if (vm->program != loaded) {
+    return NULL;
+  }
+  if (entries[target] || counts[target] < 0) {
+    return entries[target];
+  }
+  if (!buffer && !setup()) {
+    counts[target] = -1;
+    return NULL;
+  }
+  if (++counts[target] >= _jit_threshold) {
+    entries[target] = compile(target);
+    if (!entries[target]) {
+      counts[target] = -1;
+    }
+  }
+  return entries[target];
+}
+
+int32_t jit_run(VM *vm, void *entry) {
+  JitState state = { vm->stack, vm->data, NULL, 0, vm->sp, vm->fp,
+    vm->control + vm->csp, vm->control, vm->control + vm->csp + NATIVE_DEPTH };
+  trampoline(&state, entry);
+  vm->sp = state.sp;
+  vm->fp = state.fp;
+  vm->csp = state.frame - vm->control;
+  return state.ip;
+}
+
+#else
+
+void jit_reset(Program *program) {
+  (void) program;
+}
+
+void *jit_entry(VM *vm, int32_t target) {
+  (void) vm;
+  (void) target;
+  return NULL;
+}
+
+int32_t jit_run(VM *vm, void *entry) {
+  (void) entry;
+  return vm->ip;
+}
+
+#endif
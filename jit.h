@@ -0,0 +1,42 @@
+#ifndef JIT_H_INCLUDED
+#define JIT_H_INCLUDED
+
+#include <stdint.h>
+
+#include "vm.h"
+
+/*
+ * A baseline JIT for x86-64. execute() counts how often each CALL target
+ * and each backward JMP target is reached, and once one gets to the
+ * threshold the code reachable from it is compiled, opcode by opcode, into
+ * native code working directly on the VM stack. Native code calls other
+ * compiled units directly, and hands back to the interpreter at the
+ * instruction it can't do itself: a CALL to something not compiled yet,
+ * STOP, a stack underflow, a bad jump and so on.
+ *
+ * There is one JIT per process, for the most recently loaded program and
+ * for one thread at a time: other programs, and VMs with jit turned off,
+ * are just interpreted. Elsewhere, or built with -DVM_NO_JIT, jit_entry()
+ * never compiles anything and execute() interprets everything as before.
+ */
+
+// compile a target once it has been reached this often; 0 (the default) is off
+extern int _jit_threshold;
+extern void jit_set_threshold(int count);
+
+// forget everything compiled for the last program; load_program() calls this
+extern void jit_reset(Program *program);
+
+/*
+ * Count another arrival at bytecode address target, and return its native
+ * code if it has some (perhaps just compiled), or NULL.
+ */
+extern void *jit_entry(VM *vm, int32_t target);
+
+/*
+ * Run native code from jit_entry() on vm's stack, sp and fp. Returns the
+ * bytecode address to carry on interpreting from, with sp and fp updated.
+ */
+extern int32_t jit_run(VM *vm, void *entry);
+
+#endif
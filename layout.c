@@ -0,0 +1,334 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "opcodes.h"
+#include "layout.h"
+
+typedef struct _Block {
+  int32_t start;     // old address of its first instruction
+  int32_t last;      // ...and of its last
+  int32_t taken;     // old address it jumps to, or -1
+  int32_t next;      // old address it falls through to, or -1 if it can't
+  uint64_t count;    // how often it ran
+  bool glued;        // starts at a CALL's return address, so has to stay put after it
+  bool reachable;    // from the entry, by any path
+  bool placed;
+} Block;
+
+// a jump or call operand that has to be pointed at the new code
+typedef struct _Fixup {
+  int32_t at;          // new address of the instruction
+  int arg;             // which immediate argument
+  int32_t old_target;  // where it pointed in the old code
+  bool relative;
+} Fixup;
+
+static int insn_length(int32_t opcode) {
+  return ((uint32_t) opcode < OPCODE_COUNT) ? 1 + args[opcode] : 1;
+}
+
+static bool conditional(int32_t opcode) {
+  return jump_arg[opcode] && opcode != I_JMP;
+}
+
+// the same test the other way round, or -1 if there isn't one
+static int32_t inverse(int32_t opcode) {
+  switch (opcode) {
+    case I_JZ: return I_JNZ;
+    case I_JNZ: return I_JZ;
+    case I_FRPUSH_JZ: return I_FRPUSH_JNZ;
+    case I_FRPUSH_JNZ: return I_FRPUSH_JZ;
+  }
+  return -1;
+}
+
+/*
+ * Mark where instructions start and where blocks start. Returns false if
+ * an instruction is invalid or truncated, or a jump or call lands inside
+ * one.
+ */
+static bool find_leaders(const int32_t *code, int code_size, bool *start, bool *leader) {
+  int32_t at;
+  memset(start, 0, (code_size + 1) * sizeof(bool));
+  memset(leader, 0, (code_size + 1) * sizeof(bool));
+  for (at = 0; at < code_size; at += insn_length(code[at])) {
+    if ((uint32_t) code[at] >= OPCODE_COUNT || at + args[code[at]] >= code_size) {
+      return false;
+    }
+    start[at] = true;
+  }
+  start[code_size] = true;
+  leader[0] = true;
+  for (at = 0; at < code_size; at += insn_length(code[at])) {
+    int32_t opcode = code[at];
+    int32_t after = at + insn_length(opcode);
+    int32_t dest;
+    if (jump_arg[opcode]) {
+      dest = after + code[at + jump_arg[opcode]];
+    } else if (IS_CALL(opcode)) {
+      dest = code[at + 1];
+    } else {
+      if (opcode == I_RETURN || opcode == I_STOP) {
+        leader[after] = true;
+      }
+      continue;
+    }
+    if (dest < 0 || dest > code_size || !start[dest]) {
+      return false;
+    }
+    leader[dest] = true;
+    if (opcode != I_CALL) {
+      leader[after] = true;
+    }
+  }
+  return true;
+}
+
+// the successor to lay out after block b, or -1
+static int32_t successor(Block *blocks, int32_t *block_at, int code_size, int32_t b) {
+  Block *block = &blocks[b];
+  int32_t best = -1;
+  int32_t candidates[2];
+  int i;
+  candidates[0] = block->next;
+  candidates[1] = block->taken;
+  for (i = 0; i < 2; i++) {
+    int32_t c = (candidates[i] >= 0 && candidates[i] < code_size) ? block_at[candidates[i]] : -1;
+    // only a CALL gets to put its return address after it
+    if (c < 0 || blocks[c].placed || (blocks[c].glued && c != b + 1)) {
+      continue;
+    }
+    if (blocks[c].glued) {
+      return c;
+    }
+    if (block->count == 0) {
+      // cold code stays in its original order
+      return (i == 0) ? c : -1;
+    }
+    if (blocks[c].count > 0 && (best < 0 || blocks[c].count > blocks[best].count)) {
+      best = c;
+    }
+  }
+  return best;
+}
+
+// queue the block starting at target, if it's new
+static void reach(Block *blocks, int32_t *block_at, int code_size, int32_t target,
+    int32_t *work, int *work_count) {
+  if (target >= 0 && target < code_size && !blocks[block_at[target]].reachable) {
+    blocks[block_at[target]].reachable = true;
+    work[(*work_count)++] = block_at[target];
+  }
+}
+
+static void mark_reachable(const int32_t *code, int code_size, Block *blocks, int32_t *block_at, int block_count) {
+  int32_t *work = (int32_t*) malloc(block_count * sizeof(int32_t));
+  int work_count = 0;
+  blocks[0].reachable = true;
+  work[work_count++] = 0;
+  while (work_count > 0) {
+    Block *block = &blocks[work[--work_count]];
+    int32_t at;
+    reach(blocks, block_at, code_size, block->next, work, &work_count);
+    reach(blocks, block_at, code_size, block->taken, work, &work_count);
+    // a block doesn't end at a CALL, so it can make several
+    for (at = block->start; at <= block->last; at += insn_length(code[at])) {
+      if (IS_CALL(code[at])) {
+        reach(blocks, block_at, code_size, code[at + 1], work, &work_count);
+      }
+    }
+  }
+  free(work);
+}
+
+static void place(Block *blocks, int32_t *block_at, int code_size, int32_t b, int32_t *order, int *placed) {
+  while (b >= 0) {
+    blocks[b].placed = true;
+    order[(*placed)++] = b;
+    b = successor(blocks, block_at, code_size, b);
+  }
+}
+
+int layout(int32_t *code, int code_size, int capacity, const uint64_t *ip_counts) {
+  bool *start = (bool*) malloc((code_size + 1) * sizeof(bool));
+  bool *leader = (bool*) malloc((code_size + 1) * sizeof(bool));
+  int32_t *block_at = (int32_t*) malloc((code_size + 1) * sizeof(int32_t));
+  int32_t *new_ip = (int32_t*) malloc((code_size + 1) * sizeof(int32_t));
+  Block *blocks = NULL;
+  int32_t *order = NULL;
+  int32_t *out = NULL;
+  Fixup *fixups = NULL;
+  int block_count = 0;
+  int fixup_count = 0;
+  int32_t out_size = code_size;
+  int32_t end = 0;
+  int placed = 0;
+  int32_t at;
+  int32_t b;
+  int a;
+  int i;
+
+  if (!find_leaders(code, code_size, start, leader)) {
+    goto done;
+  }
+  // trailing NOPs that nothing jumps into are dropped, leaving room for JMPs
+  for (at = 0; at < code_size; at += insn_length(code[at])) {
+    if (code[at] != I_NOP || leader[at]) {
+      end = at + insn_length(code[at]);
+    }
+  }
+  for (at = 0; at < end; at++) {
+    block_count += leader[at];
+  }
+  blocks = (Block*) malloc(block_count * sizeof(Block));
+  order = (int32_t*) malloc(block_count * sizeof(int32_t));
+  block_count = 0;
+  for (at = 0; at < end; at += insn_length(code[at])) {
+    int32_t opcode = code[at];
+    int32_t after = at + insn_length(opcode);
+    Block *block;
+    if (leader[at]) {
+      block = &blocks[block_count];
+      block->start = at;
+      block->count = ip_counts[at];
+      block->glued = block_count > 0 && code[blocks[block_count - 1].last] == I_CALL;
+      block->reachable = false;
+      block->placed = false;
+      block_count++;
+    }
+    block = &blocks[block_count - 1];
+    block_at[at] = block_count - 1;
+    block->last = at;
+    block->taken = jump_arg[opcode] ? after + code[at + jump_arg[opcode]] : -1;
+    block->next = (opcode == I_JMP || opcode == I_RETURN || opcode == I_STOP || opcode == I_TAILCALL) ? -1 : after;
+  }
+
+  mark_reachable(code, end, blocks, block_at, block_count);
+
+  // the entry first, then the hottest paths, then everything that never ran
+  place(blocks, block_at, end, 0, order, &placed);
+  for (;;) {
+    int32_t hottest = -1;
+    for (b = 0; b < block_count; b++) {
+      if (!blocks[b].placed && !blocks[b].glued && blocks[b].count > 0
+          && (hottest < 0 || blocks[b].count > blocks[hottest].count)) {
+        hottest = b;
+      }
+    }
+    if (hottest < 0) {
+      break;
+    }
+    place(blocks, block_at, end, hottest, order, &placed);
+  }
+  for (b = 0; b < block_count; b++) {
+    if (!blocks[b].placed && !blocks[b].glued) {
+      place(blocks, block_at, end, b, order, &placed);
+    }
+  }
+
+  // at worst every block gets a JMP
+  out = (int32_t*) malloc((code_size + 2 * block_count) * sizeof(int32_t));
+  fixups = (Fixup*) malloc((code_size + block_count) * sizeof(Fixup));
+  out_size = 0;
+  for (i = 0; i < placed; i++) {
+    Block *block = &blocks[order[i]];
+    int32_t follow = (i + 1 < placed) ? blocks[order[i + 1]].start : end;
+    int32_t fall = block->next;
+    new_ip[block->start] = out_size;
+    for (at = block->start; at <= block->last; at += insn_length(code[at])) {
+      int32_t insn_at = out_size;
+      int32_t op = code[at];
+      int length = insn_length(op);
+      if (at == block->last && op == I_JMP && block->taken == follow) {
+        break;  // it would only jump to the next instruction
+      }
+      if (at == block->last && conditional(op) && fall != follow
+          && block->taken == follow && inverse(op) >= 0) {
+        // branch to where it used to fall through, and fall through instead
+        op = inverse(op);
+        fall = block->taken;
+        block->taken = block->next;
+      }
+      out[out_size++] = op;
+      for (a = 1; a < length; a++) {
+        if (a == jump_arg[op] || (IS_CALL(op) && a == 1)) {
+          Fixup *fixup = &fixups[fixup_count++];
+          fixup->at = insn_at;
+          fixup->arg = a;
+          fixup->relative = !IS_CALL(op);
+          fixup->old_target = fixup->relative ? block->taken : code[at + 1];
+        }
+        out[out_size++] = code[at + a];
+      }
+    }
+    // a fall through that no longer is one becomes a JMP, unless nothing
+    // can get here: the padding between functions, say
+    if (fall >= 0 && fall != follow && block->reachable) {
+      Fixup *fixup = &fixups[fixup_count++];
+      fixup->at = out_size;
+      fixup->arg = 1;
+      fixup->relative = true;
+      fixup->old_target = fall;
+      out[out_size++] = I_JMP;
+      out[out_size++] = 0;
+    }
+  }
+  // the dropped NOPs, and the end of the code a jump can still name
+  for (at = end; at <= code_size; at++) {
+    new_ip[at] = out_size;
+  }
+
+  if (out_size > capacity) {
+    out_size = code_size;
+    goto done;
+  }
+  for (i = 0; i < fixup_count; i++) {
+    Fixup *fixup = &fixups[i];
+    int32_t dest = new_ip[fixup->old_target];
+    if (fixup->relative) {
+      dest -= fixup->at + insn_length(out[fixup->at]);
+    }
+    out[fixup->at + fixup->arg] = dest;
+  }
+  memcpy(code, out, out_size * sizeof(int32_t));
+  for (at = out_size; at < code_size; at++) {
+    code[at] = I_NOP;
+  }
+
+done:
+  free(start);
+  free(leader);
+  free(block_at);
+  free(new_ip);
+  free(blocks);
+  free(order);
+  free(out);
+  free(fixups);
+  return out_size;
+}
+
+void layout_profile_write(FILE *out, const uint64_t *ip_counts, int code_size) {
+  int32_t at;
+  for (at = 0; at < code_size; at++) {
+    if (ip_counts[at]) {
+      fprintf(out, "%" PRId32 " %" PRIu64 "\n", at, ip_counts[at]);
+    }
+  }
+}
+
+int layout_profile_read(FILE *in, uint64_t *ip_counts, int code_size) {
+  int32_t at;
+  uint64_t count;
+  memset(ip_counts, 0, code_size * sizeof(uint64_t));
+  while (fscanf(in, "%" SCNd32 " %" SCNu64, &at, &count) == 2) {
+    if (at < 0 || at >= code_size) {
+      return 0;
+    }
+    ip_counts[at] = count;
+  }
+  return feof(in);
+}
@@ -0,0 +1,38 @@
+#ifndef LAYOUT_H_INCLUDED
+#define LAYOUT_H_INCLUDED
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Profile guided code layout. Splits code into basic blocks at jump
+ * targets and after jumps, RETURNs and STOPs, then lays them out again
+ * along the hot paths of a per-ip profile (from profile_ips() or a
+ * Profile): each block is followed by its most executed successor, so
+ * that a hot branch falls through instead of jumping, and blocks that never
+ * ran move to the end in their original order.
+ *
+ * Conditional jumps are inverted (JZ <-> JNZ, FRPUSH_JZ <-> FRPUSH_JNZ)
+ * when their target is the block that now follows them; a JMP to the block
+ * that now follows is dropped; and where a fall through can't be kept a JMP
+ * is added. Jump offsets and CALL destinations are rewritten to match. A
+ * CALL's return address is the instruction after it, so nothing is ever
+ * put between the two. The entry block, at 0, stays first.
+ *
+ * Returns the new code size, which may be more or less than code_size but
+ * never more than capacity; words freed up at the end are filled with NOPs.
+ * Code whose jumps don't all land on instruction boundaries, or whose new
+ * layout wouldn't fit, is left alone.
+ */
+extern int layout(int32_t *code, int code_size, int capacity, const uint64_t *ip_counts);
+
+/*
+ * Save and load a per-ip profile as "ip count" lines, one per executed
+ * instruction, so it can come from an earlier process. counts must have
+ * room for code_size entries. layout_profile_read returns 0 on a malformed
+ * file.
+ */
+extern void layout_profile_write(FILE *out, const uint64_t *ip_counts, int code_size);
+extern int layout_profile_read(FILE *in, uint64_t *ip_counts, int code_size);
+
+#endif
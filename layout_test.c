@@ -0,0 +1,102 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "opcodes.h"
+#include "vm.h"
+#include "layout.h"
+
+/*
+ * Checks for layout(), run by "make check": each program is laid out along
+ * a made up profile, then has to pass the verifier and leave the same data
+ * behind as before.
+ */
+
+static int failures = 0;
+
+static void run(int32_t *code, int code_size, int32_t *data, int data_size) {
+  static VM vm;
+  Verification result;
+  Program *program = load_verified(code, code_size, &result);
+  memset(data, 0, data_size * sizeof(int32_t));
+  if (!program) {
+    printf("Rejected: %s at ip=%d\n", result.error, result.ip);
+    failures++;
+    return;
+  }
+  init(&vm, program, data, data_size);
+  execute(&vm);
+  free_program(program);
+}
+
+static void check(char *name, int32_t *code, int code_size, uint64_t *counts) {
+  int32_t before[4];
+  int32_t after[4];
+  int32_t *laid_out = (int32_t*) malloc(2 * code_size * sizeof(int32_t));
+  int size;
+  memcpy(laid_out, code, code_size * sizeof(int32_t));
+  run(code, code_size, before, 4);
+  size = layout(laid_out, code_size, 2 * code_size, counts);
+  run(laid_out, size, after, 4);
+  if (memcmp(before, after, sizeof(before)) != 0) {
+    printf("%s: data [ %d %d ] became [ %d %d ]\n", name, before[0], before[1], after[0], after[1]);
+    failures++;
+  }
+  free(laid_out);
+}
+
+/*
+ * Two CALLs from one block, to f1 and then f2. f1's fall through, to the
+ * hottest block, gets laid out ahead of it, so it needs a JMP to keep it,
+ * which it only gets if f1 is known to be reachable.
+ */
+static void two_calls() {
+  int32_t code[] = {
+    I_CALL, 11, 0, I_POPSTORE, 0, I_CALL, 21, 0, I_POPSTORE, 1, I_STOP,
+    /* f1, 11 */ I_PUSH, 0, I_JNZ, 3,
+    /* 15 */ I_PUSH, 5, I_RETURN,
+    /* 18 */ I_PUSH, 7, I_RETURN,
+    /* f2, 21 */ I_PUSH, 9, I_RETURN
+  };
+  uint64_t counts[sizeof(code) / sizeof(int32_t)];
+  memset(counts, 0, sizeof(counts));
+  counts[0] = 1;
+  counts[11] = 1;
+  counts[15] = 100;
+  counts[21] = 1;
+  check("two calls in one block", code, sizeof(code) / sizeof(int32_t), counts);
+}
+
+/*
+ * A jump to the very end of the code, past trailing NOPs that layout()
+ * drops, has to land on the new end.
+ */
+static void jump_to_end() {
+  int32_t code[] = { I_PUSH, 0, I_JZ, 6, I_PUSH, 1, I_STOP, I_NOP, I_NOP, I_NOP };
+  int32_t laid_out[sizeof(code) / sizeof(int32_t)];
+  uint64_t counts[sizeof(code) / sizeof(int32_t)];
+  int size;
+  memset(counts, 0, sizeof(counts));
+  counts[0] = 1;
+  memcpy(laid_out, code, sizeof(code));
+  size = layout(laid_out, sizeof(code) / sizeof(int32_t), sizeof(code) / sizeof(int32_t), counts);
+  // the JZ is at 2, so its offset is from 4
+  if (laid_out[2] != I_JZ || 4 + laid_out[3] != size) {
+    printf("jump to the end: JZ %d, but the code ends at %d\n", laid_out[3], size);
+    failures++;
+  }
+  check("jump to the end", code, sizeof(code) / sizeof(int32_t), counts);
+}
+
+int main() {
+  two_calls();
+  jump_to_end();
+  if (failures) {
+    printf("%d layout checks failed\n", failures);
+    return 1;
+  }
+  printf("layout checks passed\n");
+  return 0;
+}
@@ -0,0 +1,132 @@
+// for open() and mmap()
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "compiler.h"
+
+/*
+ * The lexer. Every byte is classified by one lookup in a table rather than
+ * by the locale aware isspace()/isdigit()/isalpha(), so a run of spaces,
+ * digits or letters is a tight loop over the table. Numbers are converted
+ * and words interned as they're scanned, so the tokens don't refer back to
+ * the input: it can go as soon as it's scanned, and has no length limit.
+ */
+
+#define SPACE  0x01
+#define DIGIT  0x02
+#define LETTER 0x04
+
+static uint8_t classes[256];
+// the kind of token each single character operator is, or 0
+static uint8_t operators[256];
+
+static void init_tables() {
+  int c;
+  for (c = 0; c < 256; c++) {
+    if (c == ' ' || (c >= '\t' && c <= '\r')) {
+      classes[c] = SPACE;
+    } else if (c >= '0' && c <= '9') {
+      classes[c] = DIGIT;
+    } else if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) {
+      classes[c] = LETTER;
+    }
+  }
+  operators['('] = TOKEN_OPEN_PAREN;
+  operators[')'] = TOKEN_CLOSE_PAREN;
+  operators['+'] = TOKEN_PLUS;
+  operators['-'] = TOKEN_MINUS;
+  operators['*'] = TOKEN_MULT;
+  operators['/'] = TOKEN_DIV;
+  operators['%'] = TOKEN_MOD;
+  operators['='] = TOKEN_EQUALS;
+  operators[';'] = TOKEN_SEMICOLON;
+}
+
+static Token *new_token(int kind, int32_t value) {
+  Token *token = (Token*) arena_alloc(&compile_arena, sizeof(Token));
+  token->next = NULL;
+  token->kind = kind;
+  token->value = value;
+  return token;
+}
+
+Token* scan_input(const char *input, size_t length) {
+  const uint8_t *at = (const uint8_t*) input;
+  const uint8_t *end = at + length;
+  Token *head = NULL;
+  Token **last = &head;
+  if (!classes['0']) {
+    init_tables();
+  }
+  while (at < end) {
+    const uint8_t *start = at;
+    uint8_t class = classes[*at];
+    Token *token;
+    if (class == SPACE) {
+      do {
+        at++;
+      } while (at < end && classes[*at] == SPACE);
+      continue;
+    }
+    if (class == DIGIT) {
+      // wrapping around at 32 bits, as the VM's arithmetic does
+      uint32_t value = 0;
+      do {
+        value = value * 10 + (*at++ - '0');
+      } while (at < end && classes[*at] == DIGIT);
+      token = new_token(TOKEN_NUMBER, (int32_t) value);
+    } else if (class == LETTER) {
+      do {
+        at++;
+      } while (at < end && (classes[*at] & (LETTER | DIGIT)));
+      token = new_token(TOKEN_WORD, intern((const char*) start, at - start));
+    } else if (operators[*at]) {
+      token = new_token(operators[*at++], 0);
+    } else if (*at == '\0') {
+      break; // the end of a C string
+    } else {
+      printf("Invalid token found at position %d starting with '%c'\n", (int) (at - (const uint8_t*) input) + 1, *at);
+      return NULL;
+    }
+    *last = token;
+    last = &token->next;
+  }
+  return head;
+}
+
+Token* scan_file(const char *path) {
+  struct stat info;
+  Token *tokens;
+  void *text;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &info) != 0) {
+    perror(path);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return NULL;
+  }
+  if (info.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
+  text = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (text == MAP_FAILED) {
+    perror(path);
+    return NULL;
+  }
+  posix_madvise(text, info.st_size, POSIX_MADV_SEQUENTIAL);
+  tokens = scan_input((const char*) text, info.st_size);
+  munmap(text, info.st_size);
+  return tokens;
+}
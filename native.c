@@ -0,0 +1,211 @@
+// for write() and read()
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "native.h"
+#include "vm.h"
+
+// all of n bytes, whatever write() manages at a time
+static bool write_all(int fd, const uint8_t *bytes, size_t n) {
+  while (n > 0) {
+    ssize_t wrote = write(fd, bytes, n);
+    if (wrote < 0 && errno == EINTR) {
+      continue;
+    }
+    if (wrote <= 0) {
+      return false;
+    }
+    bytes += wrote;
+    n -= wrote;
+  }
+  return true;
+}
+
+// up to n bytes, fewer only at end of file, or -1
+static ssize_t read_all(int fd, uint8_t *bytes, size_t n) {
+  size_t got = 0;
+  while (got < n) {
+    ssize_t r = read(fd, bytes + got, n - got);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r < 0) {
+      return -1;
+    }
+    if (r == 0) {
+      break;
+    }
+    got += r;
+  }
+  return got;
+}
+
+bool output_flush(Output *output) {
+  bool ok;
+  if (output->used == 0) {
+    return true;
+  }
+  // anything printf()ed before should come out first
+  if (output->fd == STDOUT_FILENO) {
+    fflush(stdout);
+  }
+  ok = write_all(output->fd, output->buffer, output->used);
+  output->used = 0;
+  return ok;
+}
+
+bool output_write(Output *output, int fd, const uint8_t *bytes, size_t n) {
+  if (output->used > 0 && output->fd != fd && !output_flush(output)) {
+    return false;
+  }
+  output->fd = fd;
+  if (n > (size_t) (OUTPUT_SIZE - output->used)) {
+    if (!output_flush(output)) {
+      return false;
+    }
+    if (n >= OUTPUT_SIZE) {
+      return write_all(fd, bytes, n);
+    }
+  }
+  memcpy(output->buffer + output->used, bytes, n);
+  output->used += n;
+  return true;
+}
+
+// n words of data from at are all there
+static bool in_data(VM *vm, int32_t at, int32_t n) {
+  return (uint32_t) at <= (uint32_t) vm->data_size && (uint32_t) n <= (uint32_t) (vm->data_size - at);
+}
+
+static char *print_int(VM *vm, int32_t *args, int32_t *result) {
+  uint8_t digits[12];
+  int at = sizeof(digits);
+  // unsigned, so INT32_MIN negates
+  uint32_t value = (args[1] < 0) ? 0u - (uint32_t) args[1] : (uint32_t) args[1];
+  do {
+    digits[--at] = '0' + value % 10;
+    value /= 10;
+  } while (value);
+  if (args[1] < 0) {
+    digits[--at] = '-';
+  }
+  *result = output_write(&vm->output, args[0], digits + at, sizeof(digits) - at) ? 0 : -1;
+  return NULL;
+}
+
+static char *write_byte(VM *vm, int32_t *args, int32_t *result) {
+  uint8_t byte = (uint8_t) args[1];
+  *result = output_write(&vm->output, args[0], &byte, 1) ? 0 : -1;
+  return NULL;
+}
+
+static char *write_bytes(VM *vm, int32_t *args, int32_t *result) {
+  uint8_t chunk[256];
+  int32_t *from = vm->data + args[1];
+  int32_t left = args[2];
+  int i;
+  if (!in_data(vm, args[1], args[2])) {
+    return "write_bytes outside the data";
+  }
+  *result = 0;
+  while (left > 0) {
+    int n = (left < (int32_t) sizeof(chunk)) ? left : (int) sizeof(chunk);
+    for (i = 0; i < n; i++) {
+      chunk[i] = (uint8_t) from[i];
+    }
+    if (!output_write(&vm->output, args[0], chunk, n)) {
+      *result = -1;
+      break;
+    }
+    from += n;
+    left -= n;
+  }
+  return NULL;
+}
+
+static char *flush(VM *vm, int32_t *args, int32_t *result) {
+  *result = (vm->output.fd != args[0] || output_flush(&vm->output)) ? 0 : -1;
+  return NULL;
+}
+
+static char *read_bytes(VM *vm, int32_t *args, int32_t *result) {
+  uint8_t chunk[4096];
+  int32_t *to = vm->data + args[1];
+  int32_t left = args[2];
+  ssize_t want;
+  ssize_t got;
+  int i;
+  if (!in_data(vm, args[1], args[2])) {
+    return "read_bytes outside the data";
+  }
+  // a prompt should be out before the program waits for an answer
+  output_flush(&vm->output);
+  *result = 0;
+  while (left > 0) {
+    want = (left < (int32_t) sizeof(chunk)) ? left : (int32_t) sizeof(chunk);
+    got = read_all(args[0], chunk, want);
+    if (got < 0) {
+      *result = -1;
+      break;
+    }
+    for (i = 0; i < got; i++) {
+      to[i] = chunk[i];
+    }
+    *result += got;
+    if (got < want) {
+      break;
+    }
+    to += got;
+    left -= got;
+  }
+  return NULL;
+}
+
+// a word cut short by the end of the file is dropped
+static char *read_words(VM *vm, int32_t *args, int32_t *result) {
+  ssize_t got;
+  if (!in_data(vm, args[1], args[2])) {
+    return "read_words outside the data";
+  }
+  output_flush(&vm->output);
+  got = read_all(args[0], (uint8_t*) (vm->data + args[1]), (size_t) args[2] * sizeof(int32_t));
+  *result = (got < 0) ? -1 : (int32_t) (got / sizeof(int32_t));
+  return NULL;
+}
+
+Native natives[NATIVE_LIMIT] = {
+  [N_PRINT_INT] = { "print_int", 2, print_int },
+  [N_WRITE_BYTE] = { "write_byte", 2, write_byte },
+  [N_WRITE_BYTES] = { "write_bytes", 3, write_bytes },
+  [N_FLUSH] = { "flush", 1, flush },
+  [N_READ_BYTES] = { "read_bytes", 3, read_bytes },
+  [N_READ_WORDS] = { "read_words", 3, read_words }
+};
+int native_count = NATIVE_BUILTINS;
+
+int native_register(char *name, int32_t arity, NativeFunction function) {
+  if (native_count == NATIVE_LIMIT || arity < 0 || native_find(name) >= 0) {
+    return -1;
+  }
+  natives[native_count].name = name;
+  natives[native_count].arity = arity;
+  natives[native_count].function = function;
+  return native_count++;
+}
+
+int native_find(const char *name) {
+  int i;
+  for (i = 0; i < native_count; i++) {
+    if (strcmp(natives[i].name, name) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
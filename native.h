@@ -0,0 +1,80 @@
+#ifndef NATIVE_H_INCLUDED
+#define NATIVE_H_INCLUDED
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * C functions bytecode can call with NATIVE n, args: number n in the
+ * registry, which must take exactly args arguments. The arguments are the
+ * top args words of the stack, args[0] the deepest, and are replaced by
+ * the one word the function leaves in *result, as a CALL's are by its
+ * return value. A function that returns a message instead of NULL fails
+ * the run with it.
+ *
+ * The built-in ones come first, at fixed numbers, and the host can add its
+ * own after them with native_register(). The registry is shared by every
+ * VM, so it should be filled in at startup, before any are running.
+ */
+struct _VM;
+typedef char *(*NativeFunction)(struct _VM *vm, int32_t *args, int32_t *result);
+
+typedef struct _Native {
+  char *name;
+  int32_t arity;
+  NativeFunction function;
+} Native;
+
+/*
+ * The built-ins, on file descriptors and runs of data. Output goes through
+ * the VM's buffer (see Output) and they give 0, or -1 if a write fails;
+ * the reads give what they read, fewer than n only at end of file, or -1.
+ *
+ *   N_PRINT_INT    fd, value   the value in decimal
+ *   N_WRITE_BYTE   fd, byte    the low byte of byte
+ *   N_WRITE_BYTES  fd, at, n   the low byte of each of n words of data
+ *   N_FLUSH        fd          write out what's buffered for fd now
+ *   N_READ_BYTES   fd, at, n   up to n bytes into data, a word each
+ *   N_READ_WORDS   fd, at, n   up to n words into data as they are
+ */
+#define N_PRINT_INT   0
+#define N_WRITE_BYTE  1
+#define N_WRITE_BYTES 2
+#define N_FLUSH       3
+#define N_READ_BYTES  4
+#define N_READ_WORDS  5
+#define NATIVE_BUILTINS 6
+
+#define NATIVE_LIMIT 64
+
+extern Native natives[NATIVE_LIMIT];
+extern int native_count;
+
+/*
+ * Add a native, and return its number, or -1 if the registry is full or
+ * the name is taken.
+ */
+extern int native_register(char *name, int32_t arity, NativeFunction function);
+// the number of the native called name, or -1
+extern int native_find(const char *name);
+
+/*
+ * A VM's output buffer, for one file descriptor at a time: writing to
+ * another flushes what there is for the last one first. Whatever is left
+ * is flushed when the run ends, so a program's output costs a write()
+ * per buffer full rather than one per number.
+ */
+#define OUTPUT_SIZE 65536
+
+typedef struct _Output {
+  int fd;
+  int used;
+  uint8_t buffer[OUTPUT_SIZE];
+} Output;
+
+extern bool output_write(Output *output, int fd, const uint8_t *bytes, size_t n);
+// false if the write fails, and what was buffered is dropped
+extern bool output_flush(Output *output);
+
+#endif
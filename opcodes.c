@@ -1,3 +1,4 @@
+#include "opcodes.h"
 
 char *instructions[] = {
   "NOP",
@@ -25,7 +26,32 @@ char *instructions[] = {
   "DIV",  // divide stack[sp-1] / stack[sp],
 
   "MOD",  // modulo stack[sp-1] % stack[sp]
-  "SUB"   // subtract stack[sp-1] - stack[sp]
+  "SUB",  // subtract stack[sp-1] - stack[sp]
+  "FRPUSH_FRPUSH_ADD", // push the sum of two frame slots
+  "ADD_FRPOP",  // add top two, pop the result to a frame slot
+  "DEC_JNZ",
+
+  "PUSH_ADD",   // add an immediate to the top of stack
+  "FRPUSH_JZ",
+  "FRPUSH_JNZ",
+  "TAILCALL",   // call, with the arguments moved down over the caller's
+  "VADD",       // add the top two typed values, whatever their types
+
+  "VSUB",
+  "VMUL",
+  "VDIV",
+  "VNEG",
+  "VECADD",     // add two runs of data into a third
+
+  "VECSUB",
+  "VECMUL",
+  "VECLT",      // -1 where one run of data is less than another, else 0
+  "VECSUM",
+  "VECDOT",
+
+  "VECFILL",
+  "VECCOPY",
+  "NATIVE"      // call a C function from the registry in native.c
 };
 
 int args[256] = {
@@ -50,6 +76,36 @@ int args[256] = {
   0, // neg
   0, // div
   0, // mod
-  0  // sub
+  0, // sub
+  2, // frpush_frpush_add
+  1, // add_frpop
+  1, // dec_jnz
+  1, // push_add
+  2, // frpush_jz
+  2, // frpush_jnz
+  2, // tailcall
+  0, // vadd
+  0, // vsub
+  0, // vmul
+  0, // vdiv
+  0, // vneg
+  0, // vecadd
+  0, // vecsub
+  0, // vecmul
+  0, // veclt
+  0, // vecsum
+  0, // vecdot
+  0, // vecfill
+  0, // veccopy
+  2  // native
+};
+
+int jump_arg[256] = {
+  [I_JNZ] = 1,
+  [I_JZ] = 1,
+  [I_JMP] = 1,
+  [I_DEC_JNZ] = 1,
+  [I_FRPUSH_JZ] = 2,
+  [I_FRPUSH_JNZ] = 2
 };
 
@@ -28,6 +28,59 @@
 
 #define I_MOD 20
 #define I_SUB 21
+
+// superinstructions, only ever produced by the fusion pass in fuse.c
+#define I_FRPUSH_FRPUSH_ADD 22
+#define I_ADD_FRPOP 23
+#define I_DEC_JNZ 24
+#define I_PUSH_ADD 25
+#define I_FRPUSH_JZ 26
+
+#define I_FRPUSH_JNZ 27
+
+// a CALL that reuses the caller's frame rather than returning to it
+#define I_TAILCALL 28
+
+// arithmetic on the three word typed values described in value.h
+#define I_VADD 29
+#define I_VSUB 30
+#define I_VMUL 31
+#define I_VDIV 32
+#define I_VNEG 33
+
+/*
+ * Bulk array instructions over runs of data, see bulk.h. Their operands
+ * are on the stack, the word count n on top, and are all popped:
+ *
+ *   VECADD, VECSUB, VECMUL, VECLT  dst, a, b, n
+ *   VECSUM                         a, n        then push the sum
+ *   VECDOT                         a, b, n     then push the dot product
+ *   VECFILL                        dst, value, n
+ *   VECCOPY                        dst, src, n, as memmove() would
+ */
+#define I_VECADD 34
+#define I_VECSUB 35
+#define I_VECMUL 36
+#define I_VECLT 37
+#define I_VECSUM 38
+
+#define I_VECDOT 39
+#define I_VECFILL 40
+#define I_VECCOPY 41
+
+// a call to C, see native.h: NATIVE n, args
+#define I_NATIVE 42
+
+// one past the highest opcode number
+#define OPCODE_COUNT 43
+
+// the instructions whose first immediate is a call target, a code address
+#define IS_CALL(op) ((op) == I_CALL || (op) == I_TAILCALL)
+// the instructions on typed values
+#define IS_VALUE_OP(op) ((op) >= I_VADD && (op) <= I_VNEG)
+// ...and on runs of data
+#define IS_BULK_OP(op) ((op) >= I_VECADD && (op) <= I_VECCOPY)
+
 /*
  * Human readable representations of the opcodes
  */
@@ -36,5 +89,10 @@ extern char *instructions[];
  * Number of immediate arguments taken by each operation
  */
 extern int args[256];
+/*
+ * Which immediate argument (1 or 2) of each operation is a jump offset,
+ * or 0 for none. Offsets are relative to the start of the next instruction.
+ */
+extern int jump_arg[256];
 
 #endif
@@ -0,0 +1,456 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "optimize.h"
+
+// operators for the nodes it rewrites, say x + -y into x - y
+static Token plus_token = { NULL, TOKEN_PLUS, 0 };
+static Token minus_token = { NULL, TOKEN_MINUS, 0 };
+
+// what's known about a variable at this point in the line
+typedef struct _Variable {
+  uint32_t line;      // which optimize() it's about; anything older is stale
+  bool constant;
+  bool overwritten;   // by a later statement, before anything reads it
+  int32_t value;
+  int32_t version;    // how many times it's been assigned
+} Variable;
+
+// a value number: what was worked out, from what, and where first
+typedef struct _Value {
+  int32_t op;         // an operator token, or CONSTANT or VARIABLE
+  int32_t a, b;       // the operands' numbers, or a constant or a variable and its version
+  AST_Node *first;
+} Value;
+
+#define CONSTANT (-1)
+#define VARIABLE (-2)
+
+// the value numbers of a line, hashed by what they are
+typedef struct _Values {
+  Value *values;      // by number
+  int32_t count;
+  int32_t *table;     // open addressing, -1 for empty
+  uint32_t mask;
+} Values;
+
+static int kind(AST_Node *node) {
+  return node->leaf ? 0 : node->operator->kind;
+}
+
+// a variable's address in data[]
+static int32_t address(AST_Node *leaf) {
+  return leaf->value;
+}
+
+static bool is_constant(AST_Node *node, int32_t value) {
+  return node->leaf && node->constant && node->value == value;
+}
+
+// negated, and not a constant, which carries its sign in its value
+static bool negated(AST_Node *node) {
+  return node->apply_unary_minus && !node->constant;
+}
+
+static void negate(AST_Node *node) {
+  if (node->constant) {
+    node->value = (int32_t) (0u - (uint32_t) node->value);
+  } else {
+    node->apply_unary_minus = !node->apply_unary_minus;
+  }
+}
+
+static void swap(AST_Node *node) {
+  AST_Node *left = node->left;
+  node->left = node->right;
+  node->right = left;
+}
+
+// can working it out divide by zero, or overflow a division
+static bool traps(AST_Node *node) {
+  int op = kind(node);
+  if (node->leaf) {
+    return false;
+  }
+  if ((op == TOKEN_DIV || op == TOKEN_MOD)
+      && !(node->right->constant && node->right->value != 0 && node->right->value != -1)) {
+    return true;
+  }
+  return traps(node->left) || traps(node->right);
+}
+
+// the same expression, apart from being negated or not if sign is false
+static bool same(AST_Node *a, AST_Node *b, bool sign) {
+  if (a->leaf != b->leaf || (sign && a->apply_unary_minus != b->apply_unary_minus)) {
+    return false;
+  }
+  if (a->leaf) {
+    // the same number, or the same variable
+    return a->constant == b->constant && a->value == b->value;
+  }
+  return kind(a) == kind(b) && same(a->left, b->left, true) && same(a->right, b->right, true);
+}
+
+static bool fold(int op, int32_t a, int32_t b, int32_t *result) {
+  switch (op) {
+    case TOKEN_PLUS: *result = (int32_t) ((uint32_t) a + (uint32_t) b); return true;
+    case TOKEN_MINUS: *result = (int32_t) ((uint32_t) a - (uint32_t) b); return true;
+    case TOKEN_MULT: *result = (int32_t) ((uint32_t) a * (uint32_t) b); return true;
+  }
+  // left for the VM to trap on
+  if (b == 0 || (a == INT32_MIN && b == -1)) {
+    return false;
+  }
+  *result = (op == TOKEN_DIV) ? a / b : a % b;
+  return true;
+}
+
+// turn node into the constant value, negated if the node was
+static AST_Node *constant(AST_Node *node, int32_t value) {
+  node->left = node->right = NULL;
+  node->leaf = true;
+  node->token = NULL;
+  node->operator = NULL;
+  node->constant = true;
+  node->value = value;
+  if (node->apply_unary_minus) {
+    node->apply_unary_minus = false;
+    negate(node);
+  }
+  return node;
+}
+
+// replace node by one of its operands, negated if the node was
+static AST_Node *lift(AST_Node *node, AST_Node *operand) {
+  if (node->apply_unary_minus) {
+    negate(operand);
+  }
+  return operand;
+}
+
+// by address, kept from one line to the next so they don't have to be cleared
+static Variable *variables = NULL;
+static int32_t variables_size = 0;
+static uint32_t line = 0;
+
+static Variable *variable(int32_t address) {
+  Variable *v;
+  if (address >= variables_size) {
+    int32_t size = variables_size ? variables_size : 256;
+    while (size <= address) {
+      size *= 2;
+    }
+    variables = (Variable*) realloc(variables, size * sizeof(Variable));
+    memset(variables + variables_size, 0, (size - variables_size) * sizeof(Variable));
+    variables_size = size;
+  }
+  v = &variables[address];
+  if (v->line != line) {
+    memset(v, 0, sizeof(Variable));
+    v->line = line;
+  }
+  return v;
+}
+
+static AST_Node *simplify(AST_Node *node) {
+  AST_Node *left, *right;
+  int32_t value;
+  int op;
+  if (node->leaf) {
+    if (!node->constant && variable(address(node))->constant) {
+      node->constant = true;
+      node->value = variable(address(node))->value;
+    }
+    if (node->constant) {
+      return constant(node, node->value);
+    }
+    return node;
+  }
+  left = node->left = simplify(node->left);
+  right = node->right = simplify(node->right);
+  op = kind(node);
+  if (left->constant && right->constant && fold(op, left->value, right->value, &value)) {
+    return constant(node, value);
+  }
+
+  switch (op) {
+    case TOKEN_PLUS:
+      if (is_constant(right, 0)) {
+        return lift(node, left);
+      }
+      if (is_constant(left, 0)) {
+        return lift(node, right);
+      }
+      if (negated(right)) {
+        negate(right);
+        node->operator = &minus_token;
+      } else if (negated(left)) {
+        negate(left);
+        swap(node);
+        node->operator = &minus_token;
+      }
+      break;
+    case TOKEN_MINUS:
+      if (is_constant(right, 0)) {
+        return lift(node, left);
+      }
+      if (is_constant(left, 0)) {
+        negate(right);
+        return lift(node, right);
+      }
+      if (same(left, right, true) && !traps(left)) {
+        return constant(node, 0);
+      }
+      if (negated(right)) {
+        negate(right);
+        node->operator = &plus_token;
+      }
+      break;
+    case TOKEN_MULT:
+      // the operands' signs move out to the product, where they may cancel
+      if (negated(left)) {
+        negate(left);
+        negate(node);
+      }
+      if (negated(right)) {
+        negate(right);
+        negate(node);
+      }
+      if (is_constant(right, 1)) {
+        return lift(node, left);
+      }
+      if (is_constant(left, 1)) {
+        return lift(node, right);
+      }
+      if (is_constant(right, -1)) {
+        negate(node);
+        return lift(node, left);
+      }
+      if (is_constant(left, -1)) {
+        negate(node);
+        return lift(node, right);
+      }
+      if ((is_constant(right, 0) && !traps(left)) || (is_constant(left, 0) && !traps(right))) {
+        return constant(node, 0);
+      }
+      // ...or into a constant
+      if (node->apply_unary_minus && (right->constant || left->constant)) {
+        negate(right->constant ? right : left);
+        negate(node);
+      }
+      break;
+    case TOKEN_DIV:
+      if (is_constant(right, 1)) {
+        return lift(node, left);
+      }
+      break;
+    case TOKEN_MOD:
+      if (is_constant(right, 1) && !traps(left)) {
+        return constant(node, 0);
+      }
+      break;
+  }
+
+  // -(a - b) is b - a, and -(a + -b) is b - a too
+  op = kind(node);
+  if (node->apply_unary_minus && op == TOKEN_MINUS) {
+    swap(node);
+    negate(node);
+  } else if (node->apply_unary_minus && op == TOKEN_PLUS) {
+    if (negated(node->left) || node->left->constant) {
+      swap(node);
+    }
+    if (negated(node->right) || node->right->constant) {
+      // -(a + c) is -c - a
+      negate(node->right);
+      swap(node);
+      node->operator = &minus_token;
+      negate(node);
+    }
+  }
+  return node;
+}
+
+static void flatten(AST_Node *tree, AST_Node **statements, int *count, AST_Node **seqs, int *seq_count) {
+  if (!tree->leaf && kind(tree) == TOKEN_SEMICOLON) {
+    flatten(tree->left, statements, count, seqs, seq_count);
+    seqs[(*seq_count)++] = tree;
+    statements[(*count)++] = tree->right;
+  } else {
+    statements[(*count)++] = tree;
+  }
+}
+
+static int count_statements(AST_Node *tree) {
+  if (!tree->leaf && kind(tree) == TOKEN_SEMICOLON) {
+    return count_statements(tree->left) + 1;
+  }
+  return 1;
+}
+
+static int count_nodes(AST_Node *node) {
+  return node->leaf ? 1 : 1 + count_nodes(node->left) + count_nodes(node->right);
+}
+
+// a variable the node reads has to keep its last store
+static void read_by(AST_Node *node) {
+  if (node->leaf) {
+    if (!node->constant) {
+      variable(address(node))->overwritten = false;
+    }
+    return;
+  }
+  read_by(node->left);
+  read_by(node->right);
+}
+
+// an operand, as far as a value number goes: its number and whether it's negated
+static int32_t operand(AST_Node *node) {
+  return node->number * 2 + node->apply_unary_minus;
+}
+
+static int32_t value_number(Values *values, int32_t op, int32_t a, int32_t b) {
+  uint32_t hash = ((uint32_t) op * 0x9e3779b1u) ^ ((uint32_t) a * 0x85ebca77u) ^ ((uint32_t) b * 0xc2b2ae3du);
+  uint32_t at;
+  for (at = hash & values->mask; values->table[at] >= 0; at = (at + 1) & values->mask) {
+    Value *value = &values->values[values->table[at]];
+    if (value->op == op && value->a == a && value->b == b) {
+      return values->table[at];
+    }
+  }
+  values->values[values->count].op = op;
+  values->values[values->count].a = a;
+  values->values[values->count].b = b;
+  values->values[values->count].first = NULL;
+  values->table[at] = values->count;
+  return values->count++;
+}
+
+// number the node and everything under it
+static void number(AST_Node *node, Values *values) {
+  if (node->leaf) {
+    node->number = node->constant
+      ? value_number(values, CONSTANT, node->value, 0)
+      : value_number(values, VARIABLE, address(node), variable(address(node))->version);
+    return;
+  }
+  number(node->left, values);
+  number(node->right, values);
+  node->number = value_number(values, kind(node), operand(node->left), operand(node->right));
+}
+
+/*
+ * In the order they're worked out, a branch whose value number has been
+ * seen before is reloaded from the first one's temporary, and nothing
+ * under it is worked out at all.
+ */
+static void share(AST_Node *node, Values *values, int32_t *temp, int data_limit) {
+  Value *value;
+  if (node->leaf) {
+    return;
+  }
+  value = &values->values[node->number];
+  if (value->first && (value->first->temp >= 0 || *temp < data_limit)) {
+    if (value->first->temp < 0) {
+      value->first->temp = (*temp)++;
+    }
+    node->temp = value->first->temp;
+    node->reuse = true;
+    return;
+  }
+  value->first = node;
+  share(node->left, values, temp, data_limit);
+  share(node->right, values, temp, data_limit);
+}
+
+static void eliminate_common(AST_Node **statements, int count, int data_limit) {
+  Values values;
+  int32_t temp = data_size;
+  uint32_t size = 2;
+  int nodes = 0;
+  int i;
+  for (i = 0; i < count; i++) {
+    nodes += count_nodes(statements[i]);
+  }
+  while (size < 2 * (uint32_t) nodes) {
+    size *= 2;
+  }
+  values.values = (Value*) arena_alloc(&compile_arena, nodes * sizeof(Value));
+  values.count = 0;
+  values.table = (int32_t*) arena_alloc(&compile_arena, size * sizeof(int32_t));
+  values.mask = size - 1;
+  memset(values.table, 0xff, size * sizeof(int32_t));
+
+  for (i = 0; i < count; i++) {
+    AST_Node *s = statements[i];
+    AST_Node *value = kind(s) == TOKEN_EQUALS ? s->right : s;
+    number(value, &values);
+    share(value, &values, &temp, data_limit);
+    // anything worked out from it before is out of date
+    if (kind(s) == TOKEN_EQUALS) {
+      variable(address(s->left))->version++;
+    }
+  }
+}
+
+AST_Node* optimize(AST_Node* tree, int data_limit) {
+  int count = count_statements(tree);
+  AST_Node **statements = (AST_Node**) arena_alloc(&compile_arena, count * sizeof(AST_Node*));
+  AST_Node **seqs = (AST_Node**) arena_alloc(&compile_arena, count * sizeof(AST_Node*));
+  int seq_count = 0;
+  int kept = 0;
+  int i;
+
+  line++;
+  count = 0;
+  flatten(tree, statements, &count, seqs, &seq_count);
+
+  // constants, and what they make of the variables assigned them
+  for (i = 0; i < count; i++) {
+    AST_Node *s = statements[i];
+    if (kind(s) == TOKEN_EQUALS) {
+      Variable *v;
+      s->right = simplify(s->right);
+      v = variable(address(s->left));
+      v->constant = s->right->constant;
+      v->value = s->right->value;
+    } else {
+      statements[i] = simplify(s);
+    }
+  }
+
+  // stores that are overwritten before they're read, from the end back
+  for (i = count - 1; i >= 0; i--) {
+    AST_Node *s = statements[i];
+    if (kind(s) == TOKEN_EQUALS) {
+      Variable *v = variable(address(s->left));
+      if (v->overwritten && !traps(s->right)) {
+        statements[i] = NULL;
+        continue;
+      }
+      v->overwritten = true;
+      s = s->right;
+    }
+    read_by(s);
+  }
+  for (i = 0; i < count; i++) {
+    if (statements[i]) {
+      statements[kept++] = statements[i];
+    }
+  }
+
+  eliminate_common(statements, kept, data_limit);
+
+  // put the statements that are left back together
+  for (i = 0; i < seq_count; i++) {
+    if (i + 1 < kept) {
+      seqs[i]->left = (i == 0) ? statements[0] : seqs[i - 1];
+      seqs[i]->right = statements[i + 1];
+    }
+  }
+  return (kept > 1) ? seqs[kept - 2] : statements[0];
+}
@@ -0,0 +1,28 @@
+#ifndef OPTIMIZE_H_INCLUDED
+#define OPTIMIZE_H_INCLUDED
+
+#include "compiler.h"
+
+/*
+ * The optimizer between begin_parsing() and write_instructions(). Over the
+ * statements of a line, in order, it
+ *
+ *  - folds constant arithmetic, including variables assigned a constant
+ *    earlier in the line;
+ *  - simplifies x*1, x+0, x-0, x/1, 0-x, x*0, x-x, x%1 and moves negation
+ *    into constants and operands: x + -y is x - y, -(a - b) is b - a;
+ *  - drops a store to a variable that a later statement overwrites before
+ *    anything reads it;
+ *  - works out each common subexpression once, keeping its value in a
+ *    temporary in data[] from data_size up to data_limit, and reloads it
+ *    wherever it's repeated, as long as no variable in it changed between.
+ *
+ * Results are the same as without it, division by zero included: anything
+ * that might divide by zero is never dropped. Arithmetic wraps around at
+ * 32 bits, as it does in the VM.
+ *
+ * Returns the new tree, allocating anything it needs from compile_arena.
+ */
+extern AST_Node* optimize(AST_Node* tree, int data_limit);
+
+#endif
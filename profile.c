@@ -0,0 +1,253 @@
+// for clock_gettime()
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "opcodes.h"
+#include "profile.h"
+
+// how many of each count profile_report() lists
+#define REPORT_TOP 15
+
+static uint64_t now_ns() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static int32_t add_node(Profile *profile, int32_t parent, int32_t function) {
+  ProfileNode *node;
+  if (profile->node_count == profile->node_capacity) {
+    profile->node_capacity *= 2;
+    profile->nodes = (ProfileNode*) realloc(profile->nodes, profile->node_capacity * sizeof(ProfileNode));
+  }
+  node = &profile->nodes[profile->node_count];
+  node->function = function;
+  node->parent = parent;
+  node->child = -1;
+  node->sibling = -1;
+  node->calls = 0;
+  node->self_ns = 0;
+  if (parent >= 0) {
+    node->sibling = profile->nodes[parent].child;
+    profile->nodes[parent].child = profile->node_count;
+  }
+  return profile->node_count++;
+}
+
+static int32_t child_node(Profile *profile, int32_t parent, int32_t function) {
+  int32_t n;
+  for (n = profile->nodes[parent].child; n >= 0; n = profile->nodes[n].sibling) {
+    if (profile->nodes[n].function == function) {
+      return n;
+    }
+  }
+  return add_node(profile, parent, function);
+}
+
+Profile *profile_create() {
+  Profile *profile = (Profile*) calloc(1, sizeof(Profile));
+  profile->last_opcode = -1;
+  profile->node_capacity = 64;
+  profile->nodes = (ProfileNode*) malloc(profile->node_capacity * sizeof(ProfileNode));
+  add_node(profile, -1, -1);
+  profile->frame_capacity = 64;
+  profile->frames = (ProfileFrame*) malloc(profile->frame_capacity * sizeof(ProfileFrame));
+  return profile;
+}
+
+void profile_free(Profile *profile) {
+  free(profile->ip_counts);
+  free(profile->functions);
+  free(profile->nodes);
+  free(profile->frames);
+  free(profile);
+}
+
+void profile_start(Profile *profile, int32_t *code, int code_size) {
+  if (code_size > profile->code_size) {
+    // one more, for CALLs to the end of the code
+    int size = code_size + 1;
+    int old = profile->code_size ? profile->code_size + 1 : 0;
+    profile->ip_counts = (uint64_t*) realloc(profile->ip_counts, size * sizeof(uint64_t));
+    profile->functions = (ProfileFunction*) realloc(profile->functions, size * sizeof(ProfileFunction));
+    memset(profile->ip_counts + old, 0, (size - old) * sizeof(uint64_t));
+    memset(profile->functions + old, 0, (size - old) * sizeof(ProfileFunction));
+    profile->code_size = code_size;
+  }
+  profile->code = code;
+  profile->last_opcode = -1;
+  profile->depth = 0;
+  profile->current = 0;
+  profile->last = now_ns();
+}
+
+// give the time since the last call to this to the current node
+static uint64_t charge(Profile *profile) {
+  uint64_t now = now_ns();
+  profile->nodes[profile->current].self_ns += now - profile->last;
+  profile->last = now;
+  return now;
+}
+
+void profile_call(Profile *profile, int32_t target) {
+  ProfileFunction *function;
+  ProfileFrame *frame;
+  if (target < 0 || target > profile->code_size) {
+    // execute() won't get far
+    return;
+  }
+  if (profile->depth == profile->frame_capacity) {
+    profile->frame_capacity *= 2;
+    profile->frames = (ProfileFrame*) realloc(profile->frames, profile->frame_capacity * sizeof(ProfileFrame));
+  }
+  frame = &profile->frames[profile->depth++];
+  frame->entered = charge(profile);
+  profile->current = frame->node = child_node(profile, profile->current, target);
+  profile->nodes[profile->current].calls++;
+  function = &profile->functions[target];
+  function->calls++;
+  function->active++;
+}
+
+static void leave(Profile *profile, uint64_t now) {
+  ProfileFrame *frame = &profile->frames[--profile->depth];
+  ProfileFunction *function = &profile->functions[profile->nodes[frame->node].function];
+  if (--function->active == 0) {
+    function->inclusive_ns += now - frame->entered;
+  }
+  profile->current = profile->nodes[frame->node].parent;
+}
+
+void profile_return(Profile *profile) {
+  if (profile->depth > 0) {
+    leave(profile, charge(profile));
+  }
+}
+
+// whatever is still running when execute() stops is over too
+void profile_stop(Profile *profile) {
+  uint64_t now = charge(profile);
+  while (profile->depth > 0) {
+    leave(profile, now);
+  }
+}
+
+static uint64_t *sort_counts;
+
+static int by_count(const void *a, const void *b) {
+  uint64_t x = sort_counts[*(const int32_t*) a];
+  uint64_t y = sort_counts[*(const int32_t*) b];
+  return (x < y) - (x > y);
+}
+
+// the indexes of the n counts, biggest first
+static int32_t *ranked(uint64_t *counts, int32_t n) {
+  int32_t *order = (int32_t*) malloc(n * sizeof(int32_t));
+  int32_t i;
+  for (i = 0; i < n; i++) {
+    order[i] = i;
+  }
+  sort_counts = counts;
+  qsort(order, n, sizeof(int32_t), by_count);
+  return order;
+}
+
+static double percent(uint64_t part, uint64_t whole) {
+  return whole ? 100.0 * part / whole : 0.0;
+}
+
+void profile_report(Profile *profile, FILE *out) {
+  uint64_t total_ns = 0;
+  uint64_t *self_ns;
+  uint64_t *inclusive_ns;
+  int32_t *order;
+  int32_t size = profile->code_size + 1;
+  int32_t i;
+
+  fprintf(out, "PROFILE: %llu instructions, %llu jumps taken\n", (unsigned long long) profile->steps,
+      (unsigned long long) profile->jumps);
+  if (!profile->code) {
+    return;
+  }
+
+  fprintf(out, "\n  OPCODES:\n");
+  order = ranked(profile->op_counts, OPCODE_COUNT);
+  for (i = 0; i < OPCODE_COUNT && profile->op_counts[order[i]]; i++) {
+    fprintf(out, "%18s %12llu %6.2f%%\n", instructions[order[i]],
+        (unsigned long long) profile->op_counts[order[i]],
+        percent(profile->op_counts[order[i]], profile->steps));
+  }
+  free(order);
+
+  fprintf(out, "\n  PAIRS:\n");
+  order = ranked(&profile->pair_counts[0][0], OPCODE_COUNT * OPCODE_COUNT);
+  for (i = 0; i < REPORT_TOP && (&profile->pair_counts[0][0])[order[i]]; i++) {
+    uint64_t count = (&profile->pair_counts[0][0])[order[i]];
+    fprintf(out, "%18s %-18s %12llu %6.2f%%\n", instructions[order[i] / OPCODE_COUNT],
+        instructions[order[i] % OPCODE_COUNT], (unsigned long long) count,
+        percent(count, profile->steps));
+  }
+  free(order);
+
+  fprintf(out, "\n  HOT ADDRESSES:\n");
+  order = ranked(profile->ip_counts, profile->code_size);
+  for (i = 0; i < REPORT_TOP && i < profile->code_size && profile->ip_counts[order[i]]; i++) {
+    fprintf(out, "%14s%04x %-10s %10llu %6.2f%%\n", "", order[i],
+        instructions[profile->code[order[i]]], (unsigned long long) profile->ip_counts[order[i]],
+        percent(profile->ip_counts[order[i]], profile->steps));
+  }
+  free(order);
+
+  // exclusive time per function is the sum over its calling contexts
+  self_ns = (uint64_t*) calloc(size, sizeof(uint64_t));
+  inclusive_ns = (uint64_t*) calloc(size, sizeof(uint64_t));
+  for (i = 0; i < profile->node_count; i++) {
+    total_ns += profile->nodes[i].self_ns;
+    if (profile->nodes[i].function >= 0) {
+      self_ns[profile->nodes[i].function] += profile->nodes[i].self_ns;
+    }
+  }
+  for (i = 0; i < size; i++) {
+    inclusive_ns[i] = profile->functions[i].inclusive_ns;
+  }
+  fprintf(out, "\n  FUNCTIONS:\n%18s %10s %22s %22s\n", "", "calls", "inclusive ns", "exclusive ns");
+  fprintf(out, "%18s %10s %14llu %6.2f%% %14llu %6.2f%%\n", "top", "",
+      (unsigned long long) total_ns, 100.0,
+      (unsigned long long) profile->nodes[0].self_ns, percent(profile->nodes[0].self_ns, total_ns));
+  order = ranked(inclusive_ns, size);
+  for (i = 0; i < size && profile->functions[order[i]].calls; i++) {
+    int32_t f = order[i];
+    fprintf(out, "%13s@%-4d %10llu %14llu %6.2f%% %14llu %6.2f%%\n", "", f,
+        (unsigned long long) profile->functions[f].calls,
+        (unsigned long long) inclusive_ns[f], percent(inclusive_ns[f], total_ns),
+        (unsigned long long) self_ns[f], percent(self_ns[f], total_ns));
+  }
+  free(order);
+  free(self_ns);
+  free(inclusive_ns);
+}
+
+static void print_path(Profile *profile, int32_t n, FILE *out) {
+  if (profile->nodes[n].parent >= 0) {
+    print_path(profile, profile->nodes[n].parent, out);
+    fprintf(out, ";@%d", profile->nodes[n].function);
+  } else {
+    fputs("top", out);
+  }
+}
+
+void profile_folded(Profile *profile, FILE *out) {
+  int32_t n;
+  for (n = 0; n < profile->node_count; n++) {
+    if (profile->nodes[n].self_ns) {
+      print_path(profile, n, out);
+      fprintf(out, " %llu\n", (unsigned long long) profile->nodes[n].self_ns);
+    }
+  }
+}
@@ -0,0 +1,109 @@
+#ifndef PROFILE_H_INCLUDED
+#define PROFILE_H_INCLUDED
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "opcodes.h"
+
+/*
+ * The profiler. A VM with a Profile attached counts every instruction it
+ * runs by opcode, by pair of opcodes in a row and by address, and times
+ * every CALL: how many times each function (named by its entry address,
+ * @33 and so on) was called, the time spent in it including the functions
+ * it calls, and the time spent in its own code.
+ *
+ * Time is attributed to the calling context as well, a tree of call paths
+ * from the top level down, which profile_folded() writes out in the folded
+ * stack format flame graph tools read ("top;@8;@33 1234").
+ *
+ * Times are in nanoseconds, read at each CALL and RETURN only. Native code
+ * isn't profiled, so profiling turns the JIT off like tracing does.
+ */
+
+// one node of the calling context tree; node 0 is the top level
+typedef struct _ProfileNode {
+  int32_t function;   // entry address, or -1 for the top level
+  int32_t parent;
+  int32_t child;      // first child
+  int32_t sibling;    // next child of parent
+  uint64_t calls;
+  uint64_t self_ns;   // time in this node's own code
+} ProfileNode;
+
+// one function activation in progress
+typedef struct _ProfileFrame {
+  int32_t node;
+  uint64_t entered;
+} ProfileFrame;
+
+typedef struct _ProfileFunction {
+  uint64_t calls;
+  uint64_t inclusive_ns; // outermost activations only, so recursion counts once
+  int32_t active;        // activations in progress
+} ProfileFunction;
+
+typedef struct _Profile {
+  int32_t *code;     // the program being run, for opcodes and CALL targets
+  int code_size;     // ip_counts and functions have room for this many
+  uint64_t steps;
+  uint64_t op_counts[OPCODE_COUNT];
+  uint64_t pair_counts[OPCODE_COUNT][OPCODE_COUNT];
+  int32_t last_opcode; // for pair_counts, or -1
+  int32_t last_ip;
+  uint64_t jumps;      // instructions that didn't go on to the next one
+  uint64_t *ip_counts;
+  ProfileFunction *functions; // indexed by entry address
+  ProfileNode *nodes;
+  int32_t node_count;
+  int32_t node_capacity;
+  ProfileFrame *frames;
+  int32_t depth;     // frames in use
+  int32_t frame_capacity;
+  int32_t current;   // the node whose code is running
+  uint64_t last;     // when time was last attributed to current
+} Profile;
+
+// an empty profile, which grows to fit the programs it sees
+extern Profile *profile_create(void);
+extern void profile_free(Profile *profile);
+
+// execute() brackets each run with these
+extern void profile_start(Profile *profile, int32_t *code, int code_size);
+extern void profile_stop(Profile *profile);
+extern void profile_call(Profile *profile, int32_t target);
+extern void profile_return(Profile *profile);
+
+// run before the instruction at ip
+static inline void profile_step(Profile *profile, int32_t ip) {
+  int32_t opcode = profile->code[ip];
+  profile->steps++;
+  profile->op_counts[opcode]++;
+  if (profile->last_opcode >= 0) {
+    profile->pair_counts[profile->last_opcode][opcode]++;
+    profile->jumps += ip != profile->last_ip + 1 + args[profile->last_opcode];
+  }
+  profile->last_opcode = opcode;
+  profile->last_ip = ip;
+  profile->ip_counts[ip]++;
+  if (opcode == I_CALL) {
+    profile_call(profile, profile->code[ip + 1]);
+  } else if (opcode == I_RETURN) {
+    profile_return(profile);
+  } else if (opcode == I_TAILCALL) {
+    // as if the caller had returned and then called it
+    profile_return(profile);
+    profile_call(profile, profile->code[ip + 1]);
+  }
+}
+
+/*
+ * A report of the top counts per opcode, opcode pair and address, and every
+ * function called, most time first. The last program run must still be
+ * loaded.
+ */
+extern void profile_report(Profile *profile, FILE *out);
+extern void profile_folded(Profile *profile, FILE *out);
+
+#endif
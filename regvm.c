@@ -0,0 +1,829 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "vm.h"
+#include "opcodes.h"
+#include "regvm.h"
+#include "dispatch.h"
+
+/*
+ * Register instructions. Registers are numbered relative to fp, like the
+ * FRPUSH/FRPOP offsets: r-1 is the last argument, r0 the first local or
+ * temporary. d is the destination register (or data address, or jump
+ * target), a and b the sources; the ...I forms take b (or a) as an
+ * immediate instead.
+ */
+#define R_MOV     0
+#define R_MOVI    1
+#define R_LOAD    2
+#define R_STORE   3
+#define R_STOREI  4
+#define R_ADD     5
+#define R_SUB     6
+#define R_MUL     7
+#define R_DIV     8
+#define R_MOD     9
+#define R_ADDI    10
+#define R_SUBI    11
+#define R_MULI    12
+#define R_DIVI    13
+#define R_MODI    14
+#define R_NEG     15
+#define R_JMP     16
+#define R_JZ      17
+#define R_JNZ     18
+#define R_CALL    19
+#define R_RETURN  20
+#define R_RETURNI 21
+#define R_STOP    22
+#define R_END     23
+#define R_TAILCALL 24
+#define R_OPCODE_COUNT 25
+
+/*
+ * How reg_listing() shows d, a and b: r register, i immediate, m data
+ * address, t jump target, s stack depth, - unused.
+ */
+static struct {
+  char *name;
+  char *operands;
+} reg_instructions[R_OPCODE_COUNT] = {
+  { "MOV", "rr-" }, { "MOVI", "ri-" }, { "LOAD", "rm-" },
+  { "STORE", "mr-" }, { "STOREI", "mi-" },
+  { "ADD", "rrr" }, { "SUB", "rrr" }, { "MUL", "rrr" }, { "DIV", "rrr" }, { "MOD", "rrr" },
+  { "ADDI", "rri" }, { "SUBI", "rri" }, { "MULI", "rri" }, { "DIVI", "rri" }, { "MODI", "rri" },
+  { "NEG", "rr-" },
+  { "JMP", "t--" }, { "JZ", "tr-" }, { "JNZ", "tr-" },
+  { "CALL", "tsi" }, { "RETURN", "sr-" }, { "RETURNI", "si-" },
+  { "STOP", "-s-" }, { "END", "-s-" }, { "TAILCALL", "tsi" }
+};
+
+typedef struct _RegInsn {
+  void *handler;  // label of the handler (threaded dispatch only)
+  int32_t opcode;
+  int32_t d;
+  int32_t a;
+  int32_t b;
+  int32_t ip;     // bytecode address this came from
+} RegInsn;
+
+RegInsn *_reg_program = NULL;
+int32_t *_reg_map = NULL;   // bytecode address -> index into _reg_program, or -1
+int _reg_program_size = 0;
+bool _reg_threaded = false;
+Program *_reg_for = NULL;   // the program _reg_program was translated from
+
+// the bytecode being translated
+static int32_t *code;
+static int code_size;
+
+/*
+ * What the translator knows about a stack slot above the last one it wrote
+ * back to memory: it holds a constant, a copy of another frame slot, or it
+ * is already in memory.
+ */
+#define E_MEM   0
+#define E_CONST 1
+#define E_SLOT  2
+
+typedef struct _Entry {
+  int kind;
+  int32_t value;
+} Entry;
+
+typedef struct _Translator {
+  RegInsn *out;
+  int count;
+  Entry *stack;     // stack[p - base - 1] describes slot p, for base < p <= top
+  int32_t base;     // slots up to here are all in memory
+  int32_t top;      // depth of the stack: sp - fp
+  int32_t low_fp;   // the smallest fp the current instruction can run with
+  int32_t ip;       // bytecode address being translated
+  int last_result;  // instruction that computed the top of stack, or -1
+} Translator;
+
+// how each stack opcode changes sp - fp (calls and RETURN are handled apart)
+static int stack_effect[OPCODE_COUNT] = {
+  [I_PUSH] = 1, [I_ADD] = -1, [I_LOADPUSH] = 1, [I_POPSTORE] = -1,
+  [I_FRPUSH] = 1, [I_FRPOP] = -1, [I_POP] = -1, [I_MUL] = -1,
+  [I_DIV] = -1, [I_MOD] = -1, [I_SUB] = -1,
+  [I_FRPUSH_FRPUSH_ADD] = 1, [I_ADD_FRPOP] = -2,
+  [I_FRPUSH_JZ] = 1, [I_FRPUSH_JNZ] = 1
+};
+
+static int32_t insn_length(int32_t opcode) {
+  return ((uint32_t) opcode < OPCODE_COUNT) ? 1 + args[opcode] : 1;
+}
+
+/*
+ * Flow analysis state: the depth and lowest fp each reachable instruction
+ * runs with, and which instructions start a block.
+ */
+static int32_t *depth;
+static int32_t *low_fp;
+static bool *leader;
+static bool *start;
+static bool *queued;
+static int32_t *work;
+static int work_count;
+
+#define UNSEEN INT32_MIN
+
+// reach at with this depth and fp; false if another path disagrees on depth
+static bool flow(int32_t at, int32_t at_depth, int32_t at_fp, bool is_leader) {
+  if (at < 0 || at > code_size || !start[at]) {
+    return false;
+  }
+  leader[at] |= is_leader;
+  if (depth[at] == UNSEEN) {
+    depth[at] = at_depth;
+    low_fp[at] = at_fp;
+  } else if (depth[at] != at_depth) {
+    return false;
+  } else if (at_fp < low_fp[at]) {
+    low_fp[at] = at_fp;
+  } else {
+    return true;
+  }
+  if (!queued[at]) {
+    queued[at] = true;
+    work[work_count++] = at;
+  }
+  return true;
+}
+
+/*
+ * Find every reachable instruction from ip 0, following jumps, calls and
+ * returns to the instruction after each call.
+ */
+static bool analyze() {
+  int32_t at;
+  for (at = 0; at <= code_size; at++) {
+    depth[at] = UNSEEN;
+    leader[at] = false;
+    start[at] = false;
+    queued[at] = false;
+  }
+  for (at = 0; at < code_size; at += insn_length(code[at])) {
+    start[at] = true;
+  }
+  start[code_size] = true;
+  work_count = 0;
+  if (!flow(0, -1, 0, true)) {
+    return false;
+  }
+  while (work_count > 0) {
+    int32_t opcode;
+    int32_t next;
+    int32_t d;
+    int32_t fp;
+    at = work[--work_count];
+    queued[at] = false;
+    if (at == code_size) {
+      continue;
+    }
+    opcode = code[at];
+    if ((uint32_t) opcode >= OPCODE_COUNT || at + args[opcode] >= code_size) {
+      return false;
+    }
+    next = at + insn_length(opcode);
+    d = depth[at];
+    fp = low_fp[at];
+    if (opcode == I_CALL) {
+      // the callee starts with an empty stack, and comes back with its
+      // arguments replaced by the return value
+      if (!flow(code[at + 1], -1, fp + d + 1, true)
+          || !flow(next, d - code[at + 2] + 1, fp, true)) {
+        return false;
+      }
+      continue;
+    }
+    if (opcode == I_TAILCALL) {
+      // its arguments end up at least as high as they'd be at the bottom
+      if (!flow(code[at + 1], -1, code[at + 2], true)) {
+        return false;
+      }
+      continue;
+    }
+    if (jump_arg[opcode] && !flow(next + code[at + jump_arg[opcode]], d + stack_effect[opcode], fp, true)) {
+      return false;
+    }
+    if (opcode != I_JMP && opcode != I_RETURN && opcode != I_STOP
+        && !flow(next, d + stack_effect[opcode], fp, false)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static int emit(Translator *t, int32_t opcode, int32_t d, int32_t a, int32_t b) {
+  t->out[t->count] = (RegInsn) { NULL, opcode, d, a, b, t->ip };
+  t->last_result = -1;
+  return t->count++;
+}
+
+static Entry *entry(Translator *t, int32_t p) {
+  return &t->stack[p - t->base - 1];
+}
+
+// what slot p holds: true with *value a constant, or false with a register
+static bool operand(Translator *t, int32_t p, int32_t *value) {
+  if (p > t->base && entry(t, p)->kind != E_MEM) {
+    *value = entry(t, p)->value;
+    return entry(t, p)->kind == E_CONST;
+  }
+  *value = p;
+  return false;
+}
+
+static void materialize(Translator *t, int32_t p) {
+  Entry *e = entry(t, p);
+  if (e->kind == E_CONST) {
+    emit(t, R_MOVI, p, e->value, 0);
+  } else if (e->kind == E_SLOT) {
+    emit(t, R_MOV, p, e->value, 0);
+  }
+  e->kind = E_MEM;
+}
+
+// write every slot back to memory, as at the end of a block
+static void flush(Translator *t) {
+  int32_t p;
+  for (p = t->base + 1; p <= t->top; p++) {
+    materialize(t, p);
+  }
+  t->base = t->top;
+}
+
+// slot p is about to be overwritten: save any pending copies of it first
+static void before_write(Translator *t, int32_t p) {
+  int32_t q;
+  for (q = t->base + 1; q <= t->top; q++) {
+    if (entry(t, q)->kind == E_SLOT && entry(t, q)->value == p) {
+      materialize(t, q);
+    }
+  }
+}
+
+// slot p now holds whatever was just written to it
+static void written(Translator *t, int32_t p) {
+  if (p > t->base && p <= t->top) {
+    entry(t, p)->kind = E_MEM;
+  }
+}
+
+// can the stack VM read the top n slots without an underflow?
+static bool has(Translator *t, int n) {
+  return t->low_fp + t->top - (n - 1) >= 0;
+}
+
+static void push(Translator *t, int kind, int32_t value) {
+  t->last_result = -1;
+  t->top++;
+  *entry(t, t->top) = (Entry) { kind, value };
+}
+
+static void pop(Translator *t) {
+  t->last_result = -1;
+  t->top--;
+  if (t->top < t->base) {
+    t->base = t->top;
+  }
+}
+
+static bool push_slot(Translator *t, int32_t slot) {
+  if (slot > t->top || t->low_fp + slot < 0) {
+    return false;
+  }
+  if (slot > t->base && entry(t, slot)->kind != E_MEM) {
+    Entry copy = *entry(t, slot);
+    push(t, copy.kind, copy.value);
+  } else {
+    push(t, E_SLOT, slot);
+  }
+  return true;
+}
+
+static void push_data(Translator *t, int32_t address) {
+  push(t, E_MEM, 0);
+  emit(t, R_LOAD, t->top, address, 0);
+}
+
+static int32_t fold(int32_t opcode, int32_t x, int32_t y) {
+  switch (opcode) {
+    case R_ADD: return (int32_t) ((uint32_t) x + (uint32_t) y);
+    case R_SUB: return (int32_t) ((uint32_t) x - (uint32_t) y);
+    case R_MUL: return (int32_t) ((uint32_t) x * (uint32_t) y);
+    case R_DIV: return x / y;
+    default:    return x % y;
+  }
+}
+
+// R_ADD etc: pop y and x, push x op y
+static bool binary(Translator *t, int32_t opcode) {
+  int32_t x;
+  int32_t y;
+  bool x_const;
+  bool y_const;
+  int32_t p;
+  if (!has(t, 2)) {
+    return false;
+  }
+  p = t->top - 1;
+  x_const = operand(t, p, &x);
+  y_const = operand(t, t->top, &y);
+  pop(t);
+  if (x_const && y_const && (opcode < R_DIV || (y != 0 && !(x == INT32_MIN && y == -1)))) {
+    entry(t, p)->kind = E_CONST;
+    entry(t, p)->value = fold(opcode, x, y);
+    return true;
+  }
+  if (x_const && (opcode == R_ADD || opcode == R_MUL)) {
+    int32_t swap = x;
+    x = y;
+    y = swap;
+    x_const = false;
+    y_const = true;
+  } else if (x_const) {
+    materialize(t, p);
+    x = p;
+  }
+  if (p > t->base) {
+    entry(t, p)->kind = E_MEM;
+  }
+  before_write(t, p);
+  if (y_const) {
+    opcode += R_ADDI - R_ADD;
+  }
+  t->last_result = emit(t, opcode, p, x, y);
+  return true;
+}
+
+// INC, DEC and NEG
+static bool unary(Translator *t, int32_t opcode, int32_t delta) {
+  int32_t x;
+  if (!has(t, 1)) {
+    return false;
+  }
+  if (operand(t, t->top, &x)) {
+    entry(t, t->top)->value = (opcode == R_NEG) ? (int32_t) -(uint32_t) x : (int32_t) ((uint32_t) x + delta);
+    return true;
+  }
+  if (t->top > t->base) {
+    entry(t, t->top)->kind = E_MEM;
+  }
+  t->last_result = emit(t, opcode, t->top, x, delta);
+  return true;
+}
+
+static bool pop_to_slot(Translator *t, int32_t slot) {
+  int32_t x;
+  bool x_const;
+  int last = t->last_result;
+  int32_t q;
+  if (!has(t, 1) || t->low_fp + slot < 0) {
+    return false;
+  }
+  x_const = operand(t, t->top, &x);
+  pop(t);
+  if (last >= 0) {
+    // send the result straight to the slot instead of copying it there
+    for (q = t->base + 1; q <= t->top; q++) {
+      if (entry(t, q)->kind == E_SLOT && entry(t, q)->value == slot) {
+        break;
+      }
+    }
+    if (q > t->top) {
+      t->out[last].d = slot;
+      written(t, slot);
+      return true;
+    }
+  }
+  before_write(t, slot);
+  if (x_const) {
+    emit(t, R_MOVI, slot, x, 0);
+  } else if (x != slot) {
+    emit(t, R_MOV, slot, x, 0);
+  }
+  written(t, slot);
+  return true;
+}
+
+static bool store_data(Translator *t, int32_t address, bool popping) {
+  int32_t x;
+  if (!has(t, 1)) {
+    return false;
+  }
+  if (operand(t, t->top, &x)) {
+    emit(t, R_STOREI, address, x, 0);
+  } else {
+    emit(t, R_STORE, address, x, 0);
+  }
+  if (popping) {
+    pop(t);
+  }
+  return true;
+}
+
+// JZ or JNZ, which leave the value they test on the stack
+static bool branch(Translator *t, int32_t opcode, int32_t target) {
+  int32_t x;
+  if (!has(t, 1)) {
+    return false;
+  }
+  if (operand(t, t->top, &x)) {
+    flush(t);
+    if ((x == 0) == (opcode == R_JZ)) {
+      emit(t, R_JMP, target, 0, 0);
+    }
+    return true;
+  }
+  flush(t);
+  emit(t, opcode, target, x, 0);
+  return true;
+}
+
+static bool translate_return(Translator *t) {
+  int32_t x;
+  if (!has(t, 1)) {
+    return false;
+  }
+  if (operand(t, t->top, &x)) {
+    emit(t, R_RETURNI, t->top, x, 0);
+  } else {
+    emit(t, R_RETURN, t->top, x, 0);
+  }
+  // nothing left on this frame matters once it has returned
+  t->base = t->top;
+  return true;
+}
+
+static bool translate_insn(Translator *t, int32_t at) {
+  int32_t opcode = code[at];
+  int32_t a = (args[opcode] >= 1) ? code[at + 1] : 0;
+  int32_t b = (args[opcode] >= 2) ? code[at + 2] : 0;
+  int32_t target = jump_arg[opcode] ? at + insn_length(opcode) + code[at + jump_arg[opcode]] : 0;
+  t->ip = at;
+  switch (opcode) {
+    case I_NOP:
+      return true;
+    case I_STOP:
+      flush(t);
+      emit(t, R_STOP, 0, t->top, 0);
+      return true;
+    case I_PUSH:
+      push(t, E_CONST, a);
+      return true;
+    case I_POP:
+      if (!has(t, 1)) return false;
+      pop(t);
+      return true;
+    case I_ADD:
+      return binary(t, R_ADD);
+    case I_SUB:
+      return binary(t, R_SUB);
+    case I_MUL:
+      return binary(t, R_MUL);
+    case I_DIV:
+      return binary(t, R_DIV);
+    case I_MOD:
+      return binary(t, R_MOD);
+    case I_INC:
+      return unary(t, R_ADDI, 1);
+    case I_DEC:
+      return unary(t, R_ADDI, -1);
+    case I_NEG:
+      return unary(t, R_NEG, 0);
+    case I_LOADPUSH:
+      push_data(t, a);
+      return true;
+    case I_POPSTORE:
+      return store_data(t, a, true);
+    case I_STORE:
+      return store_data(t, a, false);
+    case I_FRPUSH:
+      return push_slot(t, a);
+    case I_FRPOP:
+      return pop_to_slot(t, a);
+    case I_JZ:
+      return branch(t, R_JZ, target);
+    case I_JNZ:
+      return branch(t, R_JNZ, target);
+    case I_JMP:
+      flush(t);
+      emit(t, R_JMP, target, 0, 0);
+      return true;
+    case I_CALL:
+      flush(t);
+      emit(t, R_CALL, a, t->top, b);
+      t->top += 1 - b;
+      t->base = t->top;
+      return true;
+    case I_TAILCALL:
+      if (!has(t, b)) return false;
+      flush(t);
+      emit(t, R_TAILCALL, a, t->top, b);
+      return true;
+    case I_RETURN:
+      return translate_return(t);
+    case I_FRPUSH_FRPUSH_ADD:
+      return push_slot(t, a) && push_slot(t, b) && binary(t, R_ADD);
+    case I_ADD_FRPOP:
+      return binary(t, R_ADD) && pop_to_slot(t, a);
+    case I_DEC_JNZ:
+      return unary(t, R_ADDI, -1) && branch(t, R_JNZ, target);
+    case I_PUSH_ADD:
+      push(t, E_CONST, a);
+      return binary(t, R_ADD);
+    case I_FRPUSH_JZ:
+      return push_slot(t, a) && branch(t, R_JZ, target);
+    case I_FRPUSH_JNZ:
+      return push_slot(t, a) && branch(t, R_JNZ, target);
+  }
+  return false;
+}
+
+/*
+ * Translate the reachable code in address order, so falling through from
+ * one instruction to the next stays a fall through. Slots are only written
+ * back to memory at the end of a block; everything inside one is done on
+ * the translator's model of the stack.
+ */
+static bool translate(Translator *t) {
+  int32_t at;
+  int i;
+  for (at = 0; at <= code_size; at += insn_length(code[at])) {
+    if (depth[at] == UNSEEN) {
+      if (at == code_size) break;
+      continue;
+    }
+    if (leader[at]) {
+      flush(t);
+      t->base = t->top = depth[at];
+      _reg_map[at] = t->count;
+      t->last_result = -1;
+    } else if (t->top != depth[at]) {
+      return false;
+    }
+    t->low_fp = low_fp[at];
+    if (at == code_size) {
+      t->ip = at;
+      flush(t);
+      emit(t, R_END, 0, t->top, 0);
+      break;
+    }
+    if (!translate_insn(t, at)) {
+      return false;
+    }
+  }
+  // jump and call targets are still bytecode addresses, all of them leaders
+  for (i = 0; i < t->count; i++) {
+    int32_t opcode = t->out[i].opcode;
+    if (opcode == R_JMP || opcode == R_JZ || opcode == R_JNZ || opcode == R_CALL || opcode == R_TAILCALL) {
+      t->out[i].d = _reg_map[t->out[i].d];
+    }
+  }
+  return true;
+}
+
+bool reg_translate(VM *vm) {
+  Translator t;
+  bool ok;
+  int32_t at;
+  int32_t size;
+
+  code = vm->program->code;
+  code_size = vm->program->code_size;
+  size = code_size + 1;
+
+  depth = (int32_t*) malloc(size * sizeof(int32_t));
+  low_fp = (int32_t*) malloc(size * sizeof(int32_t));
+  leader = (bool*) malloc(size * sizeof(bool));
+  start = (bool*) malloc(size * sizeof(bool));
+  queued = (bool*) malloc(size * sizeof(bool));
+  work = (int32_t*) malloc(size * sizeof(int32_t));
+  free(_reg_program);
+  free(_reg_map);
+  // a bytecode instruction turns into at most a few register instructions
+  _reg_program = (RegInsn*) malloc(4 * size * sizeof(RegInsn));
+  _reg_map = (int32_t*) malloc(size * sizeof(int32_t));
+  for (at = 0; at < size; at++) {
+    _reg_map[at] = -1;
+  }
+  t.out = _reg_program;
+  t.count = 0;
+  t.stack = (Entry*) malloc(2 * size * sizeof(Entry));
+  t.base = t.top = -1;
+  t.last_result = -1;
+
+  ok = analyze() && translate(&t);
+  _reg_program_size = ok ? t.count : 0;
+  _reg_threaded = false;
+  _reg_for = ok ? vm->program : NULL;
+
+  free(t.stack);
+  free(depth);
+  free(low_fp);
+  free(leader);
+  free(start);
+  free(queued);
+  free(work);
+  return ok;
+}
+
+void reg_listing(FILE *out) {
+  int i;
+  int k;
+  for (i = 0; i < _reg_program_size; i++) {
+    RegInsn *insn = &_reg_program[i];
+    int32_t operands[3] = { insn->d, insn->a, insn->b };
+    char *kinds = reg_instructions[insn->opcode].operands;
+    char *separator = " ";
+    fprintf(out, "%04d (%04x) %8s", i, insn->ip, reg_instructions[insn->opcode].name);
+    for (k = 0; k < 3; k++) {
+      switch (kinds[k]) {
+        case 'r': fprintf(out, "%sr%d", separator, operands[k]); break;
+        case 'i': fprintf(out, "%s%d", separator, operands[k]); break;
+        case 'm': fprintf(out, "%s[%d]", separator, operands[k]); break;
+        case 't': fprintf(out, "%s@%04d", separator, operands[k]); break;
+        case 's': fprintf(out, "%ssp=fp%+d", separator, operands[k]); break;
+        default: continue;
+      }
+      separator = ", ";
+    }
+    fputs("\n", out);
+  }
+}
+
+/*
+ * The registers are the frame itself: r points at stack[fp], so r[n] is
+ * the slot FRPUSH n would read. sp is never needed at run time, as every
+ * instruction that cares knows its stack depth statically.
+ */
+#define FAIL(depth, ...) \
+  do { \
+    printf(__VA_ARGS__); \
+    printf(" at ip=%d", pc->ip); \
+    vm->ip = pc->ip; \
+    vm->sp = (r - stack) + (depth); \
+    vm->fp = r - stack; \
+    vm->csp = csp; \
+    return; \
+  } while (0)
+
+// with the stacks guarded, as the interpreter is
+static void reg_run(VM *vm) {
+  RegInsn *program = _reg_program;
+  RegInsn *pc;
+  int32_t *stack = vm->stack;
+  int32_t *data = vm->data;
+  int32_t *r = stack + vm->fp;
+  Frame *control = vm->control;
+  int32_t csp = vm->csp;
+  if ((uint32_t) vm->ip > (uint32_t) code_size || _reg_map[vm->ip] < 0) {
+    printf("Failure: Invalid instruction address %d", vm->ip);
+    return;
+  }
+  pc = program + _reg_map[vm->ip];
+#ifdef VM_THREADED_DISPATCH
+  static void *handlers[R_OPCODE_COUNT] = {
+    &&L_R_MOV, &&L_R_MOVI, &&L_R_LOAD, &&L_R_STORE, &&L_R_STOREI,
+    &&L_R_ADD, &&L_R_SUB, &&L_R_MUL, &&L_R_DIV, &&L_R_MOD,
+    &&L_R_ADDI, &&L_R_SUBI, &&L_R_MULI, &&L_R_DIVI, &&L_R_MODI,
+    &&L_R_NEG, &&L_R_JMP, &&L_R_JZ, &&L_R_JNZ,
+    &&L_R_CALL, &&L_R_RETURN, &&L_R_RETURNI, &&L_R_STOP, &&L_R_END,
+    &&L_R_TAILCALL
+  };
+  if (!_reg_threaded) {
+    int i;
+    for (i = 0; i < _reg_program_size; i++) {
+      _reg_program[i].handler = handlers[_reg_program[i].opcode];
+    }
+    _reg_threaded = true;
+  }
+  DISPATCH();
+#else
+  for (;;) {
+    switch(pc->opcode) {
+#endif
+      CASE(R_MOV):
+        r[pc->d] = r[pc->a];
+        NEXT;
+      CASE(R_MOVI):
+        r[pc->d] = pc->a;
+        NEXT;
+      CASE(R_LOAD):
+        r[pc->d] = data[pc->a];
+        NEXT;
+      CASE(R_STORE):
+        data[pc->d] = r[pc->a];
+        NEXT;
+      CASE(R_STOREI):
+        data[pc->d] = pc->a;
+        NEXT;
+      CASE(R_ADD):
+        r[pc->d] = r[pc->a] + r[pc->b];
+        NEXT;
+      CASE(R_SUB):
+        r[pc->d] = r[pc->a] - r[pc->b];
+        NEXT;
+      CASE(R_MUL):
+        r[pc->d] = r[pc->a] * r[pc->b];
+        NEXT;
+      CASE(R_DIV):
+        r[pc->d] = r[pc->a] / r[pc->b];
+        NEXT;
+      CASE(R_MOD):
+        r[pc->d] = r[pc->a] % r[pc->b];
+        NEXT;
+      CASE(R_ADDI):
+        r[pc->d] = r[pc->a] + pc->b;
+        NEXT;
+      CASE(R_SUBI):
+        r[pc->d] = r[pc->a] - pc->b;
+        NEXT;
+      CASE(R_MULI):
+        r[pc->d] = r[pc->a] * pc->b;
+        NEXT;
+      CASE(R_DIVI):
+        r[pc->d] = r[pc->a] / pc->b;
+        NEXT;
+      CASE(R_MODI):
+        r[pc->d] = r[pc->a] % pc->b;
+        NEXT;
+      CASE(R_NEG):
+        r[pc->d] = - r[pc->a];
+        NEXT;
+      CASE(R_JMP):
+        JUMP(pc->d);
+      CASE(R_JZ):
+        if (!r[pc->a]) {
+          JUMP(pc->d);
+        }
+        NEXT;
+      CASE(R_JNZ):
+        if (r[pc->a]) {
+          JUMP(pc->d);
+        }
+        NEXT;
+      CASE(R_CALL):
+        // the same frame as I_CALL, with slot a the top of stack
+        control[csp].ip = pc->ip + 3;
+        control[csp].fp = r - stack;
+        control[csp].sp = (r - stack) + pc->a - pc->b;
+        csp++;
+        r += pc->a + 1;
+        JUMP(pc->d);
+      CASE(R_TAILCALL): {
+        int32_t *to;
+        int32_t *from = r + pc->a - pc->b + 1;
+        int32_t i;
+        to = stack + control[csp - 1].sp + 1;
+        for (i = 0; i < pc->b; i++) {
+          to[i] = from[i];
+        }
+        r = to + pc->b;
+        JUMP(pc->d);
+      }
+      CASE(R_RETURN):
+      CASE(R_RETURNI): {
+        int32_t value = (pc->opcode == R_RETURN) ? r[pc->a] : pc->a;
+        int32_t y = control[csp - 1].ip;
+        if (_reg_map[y] < 0) {
+          // after a CALL that wasn't translated, in a frame from before
+          FAIL(pc->d, "Failure: Invalid return address %d", y);
+        }
+        csp--;
+        r = stack + control[csp].fp;
+        stack[control[csp].sp + 1] = value;
+        JUMP(_reg_map[y]);
+      }
+      CASE(R_STOP):
+        vm->ip = pc->ip + 1;
+        vm->sp = (r - stack) + pc->a;
+        vm->fp = r - stack;
+        vm->csp = csp;
+        return;
+      CASE(R_END):
+        vm->ip = code_size;
+        vm->sp = (r - stack) + pc->a;
+        vm->fp = r - stack;
+        vm->csp = csp;
+        return;
+#ifndef VM_THREADED_DISPATCH
+    }
+  }
+#endif
+}
+
+void reg_execute(VM *vm) {
+  if (vm->program != _reg_for) {
+    // not what was translated, if anything was
+    execute(vm);
+    return;
+  }
+  run_guarded(vm, reg_run);
+}
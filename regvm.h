@@ -0,0 +1,28 @@
+#ifndef REGVM_H_INCLUDED
+#define REGVM_H_INCLUDED
+
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "vm.h"
+
+/*
+ * The register tier. reg_translate() turns the program vm was set up with
+ * into three-address code whose registers are the slots of the current
+ * frame, locals and expression temporaries alike, so that
+ * FRPUSH a; FRPUSH b; ADD; FRPOP c becomes a single ADD c, a, b.
+ *
+ * Only code with a fixed stack depth at every instruction is translated,
+ * and only if it provably never underflows the stack or reads above its
+ * top. Otherwise reg_translate() returns false
+ * and the program should be run with execute() as usual. A translated
+ * program leaves the same stack, registers and data behind as execute().
+ *
+ * There is one translated program at a time, so reg_execute() runs VMs on
+ * anything else with execute().
+ */
+extern bool reg_translate(VM *vm);
+extern void reg_execute(VM *vm);
+extern void reg_listing(FILE *out);
+
+#endif
@@ -0,0 +1,79 @@
+#!/bin/sh
+# Checks for the interp REPL, run by "make check": a line's value has to be
+# left on the stack for it to show, and -O has to leave the same value, and
+# fail the same way, as it does without. Only the last line's state dump
+# counts, as the trace before it shows the stack after every instruction.
+
+failures=0
+
+fail() {
+  echo "$1"
+  failures=$((failures + 1))
+}
+
+# the stack after the last line of $1, run with the flags in $2
+stack() {
+  printf "$1" | ./interp $2 | grep -F 'STACK:' | tail -n 1
+}
+
+# how many $3 instructions the listing of $1, compiled with $2, has
+count() {
+  printf "$1" | ./interp $2 | grep -cE "^[0-9a-f]{4} +$3\\["
+}
+
+expect() {
+  if [ "$(stack "$1")" != "   $2" ]; then
+    fail "$3: expected \"$2\""
+  fi
+}
+
+# the same stack with -O as without
+optimized() {
+  if [ "$(stack "$1" -O)" != "$(stack "$1")" ]; then
+    fail "$2: -O left \"$(stack "$1" -O)\", not \"$(stack "$1")\""
+  fi
+}
+
+# $3 instructions compiled with -O, and $4 without
+counted() {
+  if [ "$(count "$1" -O $3)" != "$4" ] || [ "$(count "$1" "" $3)" != "$5" ]; then
+    fail "$2: $(count "$1" -O $3) $3 with -O and $(count "$1" "" $3) without, not $4 and $5"
+  fi
+}
+
+expect 'a = 2\na*3\n' 'STACK: [ 6 ]' "an expression's value"
+expect 'a = 2\n' 'STACK: [ ]' "an assignment"
+
+folded='x = 2 * 3 + 4; x\nx = 2147483647 + 1; x\n'
+optimized "$folded" "constant folding"
+counted "$folded" "constant folding" MUL 0 1
+
+repeated='a = 6\nb = a / 3 + a / 3; b\n'
+optimized "$repeated" "a common subexpression"
+counted "$repeated" "a common subexpression kept in a temporary" STORE 1 0
+counted "$repeated" "a common subexpression worked out once" DIV 1 2
+
+overwritten='a = 2\ny = a; y = a + 1; y\n'
+optimized "$overwritten" "a dead store"
+counted "$overwritten" "a dead store dropped" POPSTORE 2 3
+
+unary='a = 5\nb = a + 1; c = a - 1; d = -a; e = 0 - a; b * 100 + c * 10 + d + e\n'
+optimized "$unary" "INC, DEC and negation"
+counted "$unary" "0 - a as a NEG" NEG 2 1
+
+# x * 0 is 0, but not when working out x divides by zero
+for trap in 'z = 0\nq = 5 / z * 0; 1\n' 'q = 5 / 0 * 0; 1\n' 'z = 0\nq = 5 %% z; q = 1; q\n'; do
+  # in a subshell, so the shell's report of the signal is hidden too
+  (printf "$trap" | ./interp) > /dev/null 2>&1
+  plain=$?
+  (printf "$trap" | ./interp -O) > /dev/null 2>&1
+  if [ $? -ne $plain ] || [ $plain -eq 0 ]; then
+    fail "a division by zero: -O dropped it"
+  fi
+done
+
+if [ $failures -ne 0 ]; then
+  echo "$failures REPL checks failed"
+  exit 1
+fi
+echo "REPL checks passed"
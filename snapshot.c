@@ -0,0 +1,232 @@
+// for memfd_create(), pwrite() and mmap()
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "vm.h"
+#include "guard.h"
+#include "snapshot.h"
+
+// a page, as mmap() needs the data section to start on one
+#define SNAPSHOT_ALIGN 4096
+
+static uint32_t align(uint32_t offset) {
+  return (offset + SNAPSHOT_ALIGN - 1) & ~(uint32_t) (SNAPSHOT_ALIGN - 1);
+}
+
+// all of size bytes at offset, whatever pwrite() manages at a time
+static bool put(int fd, uint32_t offset, const void *bytes, size_t size) {
+  const uint8_t *from = (const uint8_t*) bytes;
+  while (size > 0) {
+    ssize_t wrote = pwrite(fd, from, size, offset);
+    if (wrote < 0 && errno == EINTR) {
+      continue;
+    }
+    if (wrote <= 0) {
+      return false;
+    }
+    from += wrote;
+    offset += wrote;
+    size -= wrote;
+  }
+  return true;
+}
+
+// a file with no name, for a snapshot that's only in memory
+static int memory_file() {
+  FILE *file;
+  int fd;
+#ifdef MFD_CLOEXEC
+  fd = memfd_create("vm snapshot", MFD_CLOEXEC);
+  if (fd >= 0) {
+    return fd;
+  }
+#endif
+  // an unlinked temporary file does as well, if not as fast
+  file = tmpfile();
+  if (!file) {
+    return -1;
+  }
+  fd = dup(fileno(file));
+  fclose(file);
+  return fd;
+}
+
+static Snapshot *fail(Snapshot *snapshot, char *error, size_t error_size, const char *reason) {
+  snprintf(error, error_size, "%s", reason);
+  snapshot_close(snapshot);
+  return NULL;
+}
+
+// is [offset, offset + count items) inside the file, and is it aligned
+static bool section(Snapshot *snapshot, uint32_t offset, int32_t count, size_t item, bool page) {
+  if (count < 0 || offset > snapshot->size || (size_t) count > (snapshot->size - offset) / item) {
+    return false;
+  }
+  return page ? offset % SNAPSHOT_ALIGN == 0 : offset % sizeof(int32_t) == 0;
+}
+
+// map the snapshot in fd, which it keeps, and check it over
+static Snapshot *attach(int fd, char *error, size_t error_size) {
+  Snapshot *snapshot;
+  SnapshotHeader *header;
+  Frame *control;
+  struct stat info;
+  void *base;
+  int32_t i;
+
+  if (fstat(fd, &info) != 0 || (size_t) info.st_size < sizeof(SnapshotHeader)) {
+    close(fd);
+    snprintf(error, error_size, "Not a snapshot");
+    return NULL;
+  }
+  base = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (base == MAP_FAILED) {
+    close(fd);
+    snprintf(error, error_size, "Can't map the snapshot");
+    return NULL;
+  }
+  snapshot = (Snapshot*) calloc(1, sizeof(Snapshot));
+  snapshot->fd = fd;
+  snapshot->base = (uint8_t*) base;
+  snapshot->size = info.st_size;
+  snapshot->header = header = (SnapshotHeader*) base;
+
+  if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0) {
+    return fail(snapshot, error, error_size, "Not a snapshot");
+  }
+  if (header->version != SNAPSHOT_VERSION || header->header_size != sizeof(SnapshotHeader)) {
+    return fail(snapshot, error, error_size, "Snapshot is for another version");
+  }
+  if (header->sp < -1 || header->fp < 0 || header->fp > header->sp + 1 || header->csp < 0
+      || header->ip < 0 || header->ip > header->code_size) {
+    return fail(snapshot, error, error_size, "Snapshot registers out of range");
+  }
+  if (!section(snapshot, header->code_offset, header->code_size, sizeof(int32_t), true)
+      || !section(snapshot, header->data_offset, header->data_size, sizeof(int32_t), true)
+      || !section(snapshot, header->stack_offset, header->sp + 1, sizeof(int32_t), false)
+      || !section(snapshot, header->control_offset, header->csp, sizeof(Frame), false)) {
+    return fail(snapshot, error, error_size, "Snapshot sections out of place");
+  }
+  snapshot->program = load_program((int32_t*) (snapshot->base + header->code_offset), header->code_size);
+  // RETURN trusts the return addresses it finds, as only CALL makes them
+  control = (Frame*) (snapshot->base + header->control_offset);
+  for (i = 0; i < header->csp; i++) {
+    if (control[i].ip < 0 || control[i].ip > header->code_size
+        || snapshot->program->ip_map[control[i].ip] < 0
+        || control[i].fp < 0 || control[i].sp < -1) {
+      return fail(snapshot, error, error_size, "Snapshot control stack out of range");
+    }
+  }
+  return snapshot;
+}
+
+Snapshot *snapshot_take(VM *vm) {
+  SnapshotHeader header;
+  char error[96];
+  uint32_t size;
+  int fd = memory_file();
+
+  if (fd < 0) {
+    return NULL;
+  }
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.version = SNAPSHOT_VERSION;
+  header.header_size = sizeof(header);
+  header.ip = vm->ip;
+  header.sp = vm->sp;
+  header.fp = vm->fp;
+  header.csp = vm->csp;
+  header.code_size = vm->program->code_size;
+  header.code_offset = align(sizeof(header));
+  header.data_size = vm->data_size;
+  header.data_offset = align(header.code_offset + header.code_size * sizeof(int32_t));
+  header.stack_offset = align(header.data_offset + header.data_size * sizeof(int32_t));
+  header.control_offset = header.stack_offset + (header.sp + 1) * sizeof(int32_t);
+  size = align(header.control_offset + header.csp * sizeof(Frame));
+
+  if (ftruncate(fd, size) != 0
+      || !put(fd, 0, &header, sizeof(header))
+      || !put(fd, header.code_offset, vm->program->code, header.code_size * sizeof(int32_t))
+      || !put(fd, header.data_offset, vm->data, header.data_size * sizeof(int32_t))
+      || !put(fd, header.stack_offset, vm->stack, (header.sp + 1) * sizeof(int32_t))
+      || !put(fd, header.control_offset, vm->control, header.csp * sizeof(Frame))) {
+    close(fd);
+    return NULL;
+  }
+  return attach(fd, error, sizeof(error));
+}
+
+Snapshot *snapshot_open(const char *path, char *error, size_t error_size) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    snprintf(error, error_size, "Can't open %s", path);
+    return NULL;
+  }
+  return attach(fd, error, error_size);
+}
+
+bool snapshot_write(Snapshot *snapshot, const char *path) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  bool ok;
+  if (fd < 0) {
+    return false;
+  }
+  ok = put(fd, 0, snapshot->base, snapshot->size);
+  if (close(fd) != 0) {
+    ok = false;
+  }
+  return ok;
+}
+
+void snapshot_close(Snapshot *snapshot) {
+  free_program(snapshot->program);
+  munmap(snapshot->base, snapshot->size);
+  close(snapshot->fd);
+  free(snapshot);
+}
+
+bool snapshot_clone(Snapshot *snapshot, VM *vm) {
+  SnapshotHeader *header = snapshot->header;
+  int32_t *data = NULL;
+  if (header->data_size > 0) {
+    void *mapping = mmap(NULL, header->data_size * sizeof(int32_t), PROT_READ | PROT_WRITE,
+        MAP_PRIVATE, snapshot->fd, header->data_offset);
+    if (mapping == MAP_FAILED) {
+      return false;
+    }
+    data = (int32_t*) mapping;
+  }
+  init(vm, snapshot->program, data, header->data_size);
+  // the spare slot below the stack, and then sp + 1 more
+  if (!region_fit(&vm->stack_region, (header->sp + 2) * sizeof(int32_t))
+      || !region_fit(&vm->control_region, header->csp * sizeof(Frame))) {
+    snapshot_release(snapshot, vm);
+    return false;
+  }
+  memcpy(vm->stack, snapshot->base + header->stack_offset, (header->sp + 1) * sizeof(int32_t));
+  memcpy(vm->control, snapshot->base + header->control_offset, header->csp * sizeof(Frame));
+  vm->ip = header->ip;
+  vm->sp = header->sp;
+  vm->fp = header->fp;
+  vm->csp = header->csp;
+  return true;
+}
+
+void snapshot_release(Snapshot *snapshot, VM *vm) {
+  if (vm->data) {
+    munmap(vm->data, snapshot->header->data_size * sizeof(int32_t));
+  }
+  vm->data = NULL;
+  vm->data_size = 0;
+}
@@ -0,0 +1,80 @@
+#ifndef SNAPSHOT_H_INCLUDED
+#define SNAPSHOT_H_INCLUDED
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "vm.h"
+
+/*
+ * Snapshots of a VM that has run as far as it can without knowing what
+ * it's for, say to the STOP at the end of a prelude: its code, data, both
+ * stacks and registers. A VM cloned from one carries on from the saved ip
+ * with execute() as if it were the one that stopped there.
+ *
+ * A snapshot is laid out like a program image (image.h), a SnapshotHeader
+ * then the code, data, stack and control stack, each section on a page
+ * boundary, and lives in a file: one in memory from snapshot_take(), or
+ * one on disk from snapshot_write() and snapshot_open(). Either way it's
+ * mapped once, read only, and its code loaded once, into a Program every
+ * clone shares. Each clone maps the data section MAP_PRIVATE, so clones
+ * share the snapshot's data pages and only copy the ones they write to,
+ * and copies the stacks, which are only as deep as they were when it
+ * was taken.
+ *
+ * Everything is in the host's byte order, and the version changes with
+ * the layout or the opcodes, as for images.
+ */
+#define SNAPSHOT_MAGIC "VMSNAP\0\0"
+#define SNAPSHOT_VERSION 1
+
+typedef struct _SnapshotHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;     // sizeof(SnapshotHeader)
+  int32_t ip;
+  int32_t sp;
+  int32_t fp;
+  int32_t csp;
+  int32_t code_size;        // in words
+  uint32_t code_offset;     // in bytes from the start of the file
+  int32_t data_size;        // in words
+  uint32_t data_offset;
+  uint32_t stack_offset;    // sp + 1 words
+  uint32_t control_offset;  // csp Frames
+} SnapshotHeader;
+
+typedef struct _Snapshot {
+  int fd;                   // the file, which clones map their data from
+  uint8_t *base;            // ...and all of it, mapped read only
+  size_t size;
+  SnapshotHeader *header;
+  Program *program;
+} Snapshot;
+
+/*
+ * Snapshot vm as it is now, between runs, into memory. NULL if there isn't
+ * the memory for it.
+ */
+extern Snapshot *snapshot_take(VM *vm);
+/*
+ * Map the snapshot at path. Returns NULL, with the reason in error, if it
+ * can't be read or isn't a well formed snapshot of this version.
+ */
+extern Snapshot *snapshot_open(const char *path, char *error, size_t error_size);
+// false, with errno set, if the file can't be written
+extern bool snapshot_write(Snapshot *snapshot, const char *path);
+// the clones must be released first
+extern void snapshot_close(Snapshot *snapshot);
+
+/*
+ * init() vm as a clone of the snapshot, ready to execute(). False if its
+ * data can't be mapped or its stacks won't grow as deep as the snapshot's.
+ * A clone's data is the snapshot's, so it has to go back with
+ * snapshot_release() rather than be freed.
+ */
+extern bool snapshot_clone(Snapshot *snapshot, VM *vm);
+extern void snapshot_release(Snapshot *snapshot, VM *vm);
+
+#endif
@@ -0,0 +1,167 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "symbols.h"
+
+#define INTERN_INITIAL_CAPACITY 256
+
+// an interned name, by the hash of its text
+typedef struct _Interned {
+  uint32_t hash;
+  int32_t id;      // -1 for an empty slot
+} Interned;
+
+typedef struct _Scope {
+  struct _Scope *outer;
+  Symbol *mark;    // head_symbol when it was entered
+} Scope;
+
+Symbol * head_symbol = NULL;
+
+static Interned *table = NULL;
+static uint32_t table_capacity = 0;   // a power of two, at least twice name_count
+static char **names = NULL;           // by id
+static Symbol **bindings = NULL;      // by id, what each is bound to now
+static int32_t name_count = 0;
+static int32_t name_capacity = 0;
+
+static Scope *scope = NULL;           // NULL is the global scope
+// left by leave_scope() and forget_symbols(), for reuse
+static Scope *spare_scopes = NULL;
+static Symbol *spare_symbols = NULL;
+
+static void *grow(void *array, size_t size) {
+  array = realloc(array, size);
+  if (!array) {
+    fprintf(stderr, "Out of memory for the symbol table\n");
+    exit(1);
+  }
+  return array;
+}
+
+// FNV-1a
+static uint32_t hash_of(const char *text, size_t length) {
+  uint32_t hash = 2166136261u;
+  size_t i;
+  for (i = 0; i < length; i++) {
+    hash = (hash ^ (uint8_t) text[i]) * 16777619u;
+  }
+  return hash;
+}
+
+static void rehash(uint32_t capacity) {
+  Interned *old = table;
+  uint32_t old_capacity = table_capacity;
+  uint32_t i;
+  table = (Interned*) grow(NULL, capacity * sizeof(Interned));
+  table_capacity = capacity;
+  for (i = 0; i < capacity; i++) {
+    table[i].id = -1;
+  }
+  for (i = 0; i < old_capacity; i++) {
+    if (old[i].id >= 0) {
+      uint32_t at = old[i].hash & (capacity - 1);
+      while (table[at].id >= 0) {
+        at = (at + 1) & (capacity - 1);
+      }
+      table[at] = old[i];
+    }
+  }
+  free(old);
+}
+
+int32_t intern(const char *text, size_t length) {
+  uint32_t hash = hash_of(text, length);
+  uint32_t at;
+  char *name;
+  if (2 * (uint32_t) (name_count + 1) > table_capacity) {
+    rehash(table_capacity ? 2 * table_capacity : INTERN_INITIAL_CAPACITY);
+  }
+  for (at = hash & (table_capacity - 1); table[at].id >= 0; at = (at + 1) & (table_capacity - 1)) {
+    if (table[at].hash == hash) {
+      name = names[table[at].id];
+      if (memcmp(name, text, length) == 0 && name[length] == '\0') {
+        return table[at].id;
+      }
+    }
+  }
+
+  if (name_count == name_capacity) {
+    name_capacity = name_capacity ? 2 * name_capacity : INTERN_INITIAL_CAPACITY;
+    names = (char**) grow(names, name_capacity * sizeof(char*));
+    bindings = (Symbol**) grow(bindings, name_capacity * sizeof(Symbol*));
+  }
+  name = (char*) arena_alloc(&symbol_arena, length + 1);
+  memcpy(name, text, length);
+  name[length] = '\0';
+  names[name_count] = name;
+  bindings[name_count] = NULL;
+  table[at].hash = hash;
+  table[at].id = name_count;
+  return name_count++;
+}
+
+char *interned_name(int32_t id) {
+  return names[id];
+}
+
+Symbol * find_symbol(int32_t id) {
+  return bindings[id];
+}
+
+Symbol * create_symbol(int32_t id) {
+  Symbol *symbol = spare_symbols;
+  if (symbol) {
+    spare_symbols = symbol->next;
+  } else {
+    symbol = (Symbol*) arena_alloc(&symbol_arena, sizeof(Symbol));
+  }
+  symbol->next = head_symbol;
+  symbol->shadowed = bindings[id];
+  symbol->name = names[id];
+  symbol->id = id;
+  symbol->data_offset = data_size++;
+  bindings[id] = symbol;
+  head_symbol = symbol;
+  return symbol;
+}
+
+void forget_symbols(Symbol *mark) {
+  while (head_symbol != mark) {
+    Symbol *symbol = head_symbol;
+    head_symbol = symbol->next;
+    bindings[symbol->id] = symbol->shadowed;
+    // they were given out in order, so this is the word it got
+    data_size = symbol->data_offset;
+    symbol->next = spare_symbols;
+    spare_symbols = symbol;
+  }
+}
+
+void enter_scope() {
+  Scope *inner = spare_scopes;
+  if (inner) {
+    spare_scopes = inner->outer;
+  } else {
+    inner = (Scope*) arena_alloc(&symbol_arena, sizeof(Scope));
+  }
+  inner->outer = scope;
+  inner->mark = head_symbol;
+  scope = inner;
+}
+
+void leave_scope() {
+  Scope *inner = scope;
+  if (!inner) {
+    fprintf(stderr, "leave_scope() in the global scope\n");
+    return;
+  }
+  forget_symbols(inner->mark);
+  scope = inner->outer;
+  inner->outer = spare_scopes;
+  spare_scopes = inner;
+}
@@ -0,0 +1,48 @@
+#ifndef SYMBOLS_H_INCLUDED
+#define SYMBOLS_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Names and the variables they stand for. The lexer interns every word it
+ * scans, so from then on a name is a small integer id and comparing two is
+ * comparing ints: the interned names are kept in an open addressing hash
+ * table keyed by the text, and stay for as long as the process does.
+ *
+ * A variable is a Symbol bound to an id in the innermost scope. Each id
+ * has a slot saying which Symbol it's bound to now, so finding one is an
+ * array lookup; a binding in an inner scope shadows the one outside it,
+ * and leave_scope() puts back whatever was shadowed and gives the scope's
+ * data[] words back. The global scope is the one you start in.
+ */
+typedef struct _Symbol {
+  struct _Symbol *next;      // the one defined before it, in any scope
+  struct _Symbol *shadowed;  // what its id was bound to before, or NULL
+  char *name;
+  int32_t id;
+  int32_t data_offset;
+} Symbol;
+
+// the most recently defined first
+extern Symbol * head_symbol;
+
+// the id of the length bytes of text, interning them if they're new
+extern int32_t intern(const char *text, size_t length);
+extern char *interned_name(int32_t id);
+
+// the variable id is bound to, or NULL
+extern Symbol * find_symbol(int32_t id);
+// a new variable in the next word of data[], bound to id in this scope
+extern Symbol * create_symbol(int32_t id);
+
+extern void enter_scope();
+extern void leave_scope();
+
+/*
+ * Undo every create_symbol() since head_symbol was mark, for a line that
+ * didn't parse after all.
+ */
+extern void forget_symbols(Symbol *mark);
+
+#endif
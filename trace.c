@@ -0,0 +1,297 @@
+// for ftruncate()
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "opcodes.h"
+#include "vm.h"
+#include "trace.h"
+#include "value.h"
+
+#define TRACE_INITIAL_SIZE (1 << 20)
+
+// (re)map the file at a new size; the old mapping stays if that fails
+static bool map(Trace *trace, size_t size) {
+  void *memory;
+  if (ftruncate(trace->fd, size) != 0) {
+    return false;
+  }
+  memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, trace->fd, 0);
+  if (memory == MAP_FAILED) {
+    return false;
+  }
+  if (trace->base) {
+    munmap(trace->base, trace->size);
+  }
+  trace->base = (uint8_t*) memory;
+  trace->size = size;
+  return true;
+}
+
+Trace *trace_create(const char *path) {
+  Trace *trace = (Trace*) malloc(sizeof(Trace));
+  trace->fd = -1;
+  trace->base = NULL;
+  trace->size = 0;
+  if (path) {
+    trace->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (trace->fd < 0 || !map(trace, TRACE_INITIAL_SIZE)) {
+      if (trace->fd >= 0) {
+        close(trace->fd);
+      }
+      free(trace);
+      return NULL;
+    }
+  } else {
+    trace->base = (uint8_t*) malloc(TRACE_INITIAL_SIZE);
+    trace->size = TRACE_INITIAL_SIZE;
+  }
+  trace_reset(trace);
+  return trace;
+}
+
+void trace_reset(Trace *trace) {
+  memcpy(trace->base, TRACE_MAGIC, strlen(TRACE_MAGIC));
+  trace->used = strlen(TRACE_MAGIC);
+  trace->end = trace->size;
+  trace->dropped = 0;
+}
+
+void trace_close(Trace *trace) {
+  if (trace->fd >= 0) {
+    munmap(trace->base, trace->size);
+    if (ftruncate(trace->fd, trace->used) != 0) {
+      perror("trace");
+    }
+    close(trace->fd);
+  } else {
+    free(trace->base);
+  }
+  free(trace);
+}
+
+bool trace_grow(Trace *trace, size_t bytes) {
+  size_t size = trace->size * 2;
+  uint8_t *memory;
+  if (trace->end < trace->size) {
+    return false;  // full already
+  }
+  while (size < trace->used + bytes) {
+    size *= 2;
+  }
+  if (trace->fd < 0 && size > TRACE_MEMORY_LIMIT) {
+    size = TRACE_MEMORY_LIMIT;
+  }
+  if (size < trace->used + bytes) {
+    memory = NULL;
+  } else if (trace->fd >= 0) {
+    memory = map(trace, size) ? trace->base : NULL;
+  } else {
+    memory = (uint8_t*) realloc(trace->base, size);
+  }
+  if (!memory) {
+    // a run dropped now would leave the steps after it decoded against the
+    // wrong code, so nothing more goes in
+    trace->end = trace->used;
+    return false;
+  }
+  trace->base = memory;
+  trace->size = size;
+  trace->end = size;
+  return true;
+}
+
+void trace_run(Trace *trace, int32_t *code, int32_t code_size,
+    int32_t *stack, int32_t sp, int32_t fp) {
+  TraceRun run = { TRACE_RUN, code_size, sp, fp };
+  size_t code_bytes = code_size * sizeof(int32_t);
+  size_t stack_bytes = (sp + 1) * sizeof(int32_t);
+  size_t bytes = sizeof(run) + code_bytes + stack_bytes;
+  if (trace->used + bytes > trace->end && !trace_grow(trace, bytes)) {
+    trace->dropped++;
+    return;
+  }
+  memcpy(trace->base + trace->used, &run, sizeof(run));
+  memcpy(trace->base + trace->used + sizeof(run), code, code_bytes);
+  memcpy(trace->base + trace->used + sizeof(run) + code_bytes, stack, stack_bytes);
+  trace->used += bytes;
+}
+
+/*
+ * Decoding: the stack is rebuilt as it goes, starting from each run's copy,
+ * and grows with the deepest step. Slot -1 is the spare one execute() has
+ * below the stack.
+ */
+static int32_t *stack_memory = NULL;
+static int32_t *stack = NULL;
+static int32_t stack_room = 0;  // slots from 0 up
+
+/*
+ * Make room for slots up to top. A step pushes two slots at most, and
+ * takes more than that in the trace, so nothing real is deeper than the
+ * trace is long.
+ */
+static bool fit(int32_t top, size_t size) {
+  int32_t room = stack_room ? stack_room : STACK_SIZE;
+  int32_t *memory;
+  if (stack && top < stack_room) {
+    return true;
+  }
+  if (top > 0 && (size_t) top >= size / sizeof(int32_t)) {
+    return false;
+  }
+  while (room <= top) {
+    room *= 2;
+  }
+  memory = (int32_t*) realloc(stack_memory, (room + 1) * sizeof(int32_t));
+  if (!memory) {
+    return false;
+  }
+  stack_memory = memory;
+  stack = stack_memory + 1;
+  stack_room = room;
+  return true;
+}
+
+static void write_slot(int32_t slot, int32_t value) {
+  if (slot >= -1 && slot < stack_room) {
+    stack[slot] = value;
+  }
+}
+
+// what step's instruction wrote below the next step's top of stack
+static void side_effects(int32_t *code, TraceStep *step, TraceStep *next) {
+  int32_t opcode = code[step->ip];
+  int32_t a = code[step->ip + 1];
+  int32_t i;
+  switch (opcode) {
+    case I_FRPOP:
+      write_slot(step->fp + a, step->tos);
+      break;
+    case I_ADD_FRPOP:
+      if (step->sp >= 1) {
+        write_slot(step->fp + a, (int32_t) ((uint32_t) stack[step->sp - 1] + (uint32_t) step->tos));
+      }
+      break;
+    case I_TAILCALL:
+      // the arguments, moved down to just under the new fp
+      for (i = step->sp + 1 - code[step->ip + 2]; i <= step->sp; i++) {
+        if (i >= 0) {
+          write_slot(next->fp - (step->sp + 1 - i), stack[i]);
+        }
+      }
+      break;
+    case I_VADD: case I_VSUB: case I_VMUL: case I_VDIV:
+      // the result's payload, under the tag the next step has on top
+      if (step->sp >= 5) {
+        value_arithmetic(opcode, &stack[step->sp - 5], &stack[step->sp - 2]);
+      }
+      break;
+    case I_VNEG:
+      if (step->sp >= 2) {
+        value_negate(&stack[step->sp - 2]);
+      }
+      break;
+  }
+}
+
+static void print_step(int32_t *code, TraceStep *step, FILE *out) {
+  int32_t ip = step->ip;
+  int opcode = code[ip];
+  int arg_count = args[opcode];
+  int t;
+  fputs("   STACK: [ ", out);
+  for (t = 0; t <= step->sp; t++) {
+    fprintf(out, "%d ", stack[t]);
+  }
+  fputs("]\n", out);
+  fprintf(out, "    REGS: ip=%d, sp=%d, fp=%d\n", ip, step->sp, step->fp);
+  fprintf(out, "%04x %10s ", ip, instructions[opcode]);
+  if (arg_count >= 1) {
+    fprintf(out, "%4d", code[ip+1]);
+  } else {
+    fprintf(out, "    ");
+  }
+  if (arg_count >= 2) {
+    fprintf(out, ", %4d", code[ip+2]);
+  } else {
+    fprintf(out, "      ");
+  }
+  fputs("\n\n", out);
+}
+
+bool trace_decode(const uint8_t *bytes, size_t size, FILE *out) {
+  size_t at = strlen(TRACE_MAGIC);
+  int32_t *code = NULL;
+  int32_t code_size = 0;
+  TraceStep last = { 0, 0, 0, 0 };
+  bool stepped = false;
+
+  if (size < at || memcmp(bytes, TRACE_MAGIC, at) != 0) {
+    return false;
+  }
+  while (at + sizeof(int32_t) <= size) {
+    int32_t kind;
+    memcpy(&kind, bytes + at, sizeof(kind));
+    if (kind == TRACE_RUN) {
+      TraceRun run;
+      if (at + sizeof(run) > size) {
+        return false;
+      }
+      memcpy(&run, bytes + at, sizeof(run));
+      at += sizeof(run);
+      if (run.code_size < 0 || run.sp < -1 || !fit(run.sp, size)
+          || at + (size_t) (run.code_size + run.sp + 1) * sizeof(int32_t) > size) {
+        return false;
+      }
+      free(code);
+      code_size = run.code_size;
+      // a word of slack, for the operand of a 0 argument instruction at the end
+      code = (int32_t*) calloc(code_size + 2, sizeof(int32_t));
+      memcpy(code, bytes + at, code_size * sizeof(int32_t));
+      at += code_size * sizeof(int32_t);
+      memcpy(stack, bytes + at, (run.sp + 1) * sizeof(int32_t));
+      at += (run.sp + 1) * sizeof(int32_t);
+      stepped = false;
+    } else {
+      TraceStep step;
+      if (!code || at + sizeof(step) > size) {
+        free(code);
+        return false;
+      }
+      memcpy(&step, bytes + at, sizeof(step));
+      at += sizeof(step);
+      if (step.ip < 0 || step.ip >= code_size || (uint32_t) code[step.ip] >= OPCODE_COUNT
+          || step.ip + args[code[step.ip]] >= code_size
+          || step.sp < -1 || !fit(step.sp, size)) {
+        free(code);
+        return false;
+      }
+      if (stepped) {
+        side_effects(code, &last, &step);
+      }
+      stack[step.sp] = step.tos;
+      print_step(code, &step, out);
+      last = step;
+      stepped = true;
+    }
+  }
+  free(code);
+  return at == size;
+}
+
+bool trace_render(Trace *trace, FILE *out) {
+  bool ok = trace_decode(trace->base, trace->used, out);
+  if (trace->dropped) {
+    fprintf(out, "... %llu more records dropped: the trace was full\n",
+        (unsigned long long) trace->dropped);
+  }
+  return ok;
+}
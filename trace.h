@@ -0,0 +1,96 @@
+#ifndef TRACE_H_INCLUDED
+#define TRACE_H_INCLUDED
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Binary execution traces. A VM with a Trace attached appends a 16 byte
+ * TraceStep before every instruction it runs, and nothing else: no
+ * formatting and no I/O but the odd page fault. The text the old printf
+ * tracer printed is rendered afterwards, in this process with
+ * trace_render() or in another one with tracedump.
+ *
+ * A trace is the "VMTRACE1" magic followed by runs. Each run, one per
+ * execute() call, is a TraceRun with the code image and the stack as they
+ * were at the start, then its steps. Opcodes and operands come from the
+ * code image, and the stack at each step is rebuilt from the one before,
+ * as every instruction only writes the top of the stack, the slot a
+ * FRPOP or ADD_FRPOP names, a TAILCALL's arguments, or the payload of a
+ * typed value instruction's result, which is worked out again.
+ *
+ * Each Trace belongs to one VM, so there is nothing to lock.
+ *
+ * A trace in memory grows up to TRACE_MEMORY_LIMIT, one to a file for as
+ * long as the disk has room, as its pages are written back rather than
+ * held. It isn't a ring: a step is decoded against the run before it, so
+ * the oldest can't be dropped. Once a trace is full, or can't grow, it
+ * keeps what it has and counts the steps it drops after that.
+ */
+#define TRACE_MAGIC "VMTRACE1"
+#define TRACE_RUN (-1)
+#define TRACE_MEMORY_LIMIT ((size_t) 256 << 20)
+
+typedef struct _TraceStep {
+  int32_t ip;   // >= 0, which is what tells a step from a run
+  int32_t sp;
+  int32_t fp;
+  int32_t tos;  // the value on top of the stack, cached or not
+} TraceStep;
+
+typedef struct _TraceRun {
+  int32_t kind; // TRACE_RUN
+  int32_t code_size;
+  int32_t sp;   // followed by code_size words of code and sp + 1 of stack
+  int32_t fp;
+} TraceRun;
+
+typedef struct _Trace {
+  int fd;        // the mapped file, or -1 for plain memory
+  uint8_t *base;
+  size_t size;   // bytes mapped or allocated
+  size_t used;
+  size_t end;    // where recording stops: size, or used once it's full
+  uint64_t dropped;
+} Trace;
+
+/*
+ * Record into the file at path, mmap'd and grown as needed, or into memory
+ * if path is NULL. Returns NULL if the file can't be set up.
+ */
+extern Trace *trace_create(const char *path);
+// drop everything recorded so far
+extern void trace_reset(Trace *trace);
+// unmap, truncate the file to what was recorded, and free
+extern void trace_close(Trace *trace);
+
+// make room for at least bytes more, or stop recording and return false
+extern bool trace_grow(Trace *trace, size_t bytes);
+extern void trace_run(Trace *trace, int32_t *code, int32_t code_size,
+    int32_t *stack, int32_t sp, int32_t fp);
+
+static inline void trace_step(Trace *trace, int32_t ip, int32_t sp, int32_t fp, int32_t tos) {
+  TraceStep *step;
+  if (trace->used + sizeof(TraceStep) > trace->end && !trace_grow(trace, sizeof(TraceStep))) {
+    trace->dropped++;
+    return;
+  }
+  step = (TraceStep*) (trace->base + trace->used);
+  step->ip = ip;
+  step->sp = sp;
+  step->fp = fp;
+  step->tos = tos;
+  trace->used += sizeof(TraceStep);
+}
+
+/*
+ * Print a trace the way trace_it() used to print each step as it ran.
+ * Returns false if the bytes aren't a well formed trace. trace_render()
+ * ends with how many steps were dropped, if any were.
+ */
+extern bool trace_decode(const uint8_t *bytes, size_t size, FILE *out);
+extern bool trace_render(Trace *trace, FILE *out);
+
+#endif
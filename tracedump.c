@@ -0,0 +1,50 @@
+// for open() and mmap()
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "trace.h"
+
+/*
+ * Print a trace recorded with "demo -t FILE" the way the VM used to print
+ * it while it ran.
+ */
+int main(int argc, char **argv) {
+  struct stat info;
+  void *bytes;
+  bool ok;
+  int fd;
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s TRACE\n", argv[0]);
+    return 2;
+  }
+  fd = open(argv[1], O_RDONLY);
+  if (fd < 0 || fstat(fd, &info) != 0) {
+    perror(argv[1]);
+    return 1;
+  }
+  if (info.st_size == 0) {
+    fprintf(stderr, "%s: Not a trace\n", argv[1]);
+    return 1;
+  }
+  bytes = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (bytes == MAP_FAILED) {
+    perror(argv[1]);
+    return 1;
+  }
+  ok = trace_decode((const uint8_t*) bytes, info.st_size, stdout);
+  munmap(bytes, info.st_size);
+  close(fd);
+  if (!ok) {
+    fprintf(stderr, "%s: Not a trace, or a damaged one\n", argv[1]);
+    return 1;
+  }
+  return 0;
+}
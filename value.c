@@ -0,0 +1,92 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "opcodes.h"
+#include "value.h"
+
+static bool valid(const int32_t *value) {
+  return (uint32_t) value[VALUE_TAG] < TAG_COUNT;
+}
+
+static int64_t as_int64(const int32_t *value) {
+  return value[VALUE_TAG] == TAG_INT32 ? (int64_t) value[VALUE_LOW] : value_int64(value);
+}
+
+static double as_double(const int32_t *value) {
+  switch (value[VALUE_TAG]) {
+    case TAG_INT32: return (double) value[VALUE_LOW];
+    case TAG_INT64: return (double) value_int64(value);
+  }
+  return value_double(value);
+}
+
+// the wrapping arithmetic of the VM's own instructions, in 64 bits
+static char *integer(int32_t op, uint64_t x, uint64_t y, uint64_t *result) {
+  switch (op) {
+    case I_VADD: *result = x + y; break;
+    case I_VSUB: *result = x - y; break;
+    case I_VMUL: *result = x * y; break;
+    case I_VDIV:
+      if (y == 0) {
+        return "Division by zero";
+      }
+      // the one quotient that doesn't fit, INT64_MIN / -1, wraps too
+      *result = ((int64_t) y == -1) ? -x : (uint64_t) ((int64_t) x / (int64_t) y);
+      break;
+  }
+  return NULL;
+}
+
+char *value_arithmetic(int32_t op, int32_t *left, const int32_t *right) {
+  int32_t tag;
+  uint64_t result;
+  char *error;
+  if (!valid(left) || !valid(right)) {
+    return "Invalid value tag";
+  }
+  tag = left[VALUE_TAG] > right[VALUE_TAG] ? left[VALUE_TAG] : right[VALUE_TAG];
+  if (tag == TAG_DOUBLE) {
+    double x = as_double(left);
+    double y = as_double(right);
+    switch (op) {
+      case I_VADD: x += y; break;
+      case I_VSUB: x -= y; break;
+      case I_VMUL: x *= y; break;
+      case I_VDIV: x /= y; break;
+    }
+    value_set_double(left, x);
+  } else if (tag == TAG_INT64) {
+    if ((error = integer(op, (uint64_t) as_int64(left), (uint64_t) as_int64(right), &result))) {
+      return error;
+    }
+    value_set_bits(left, result);
+  } else {
+    // sign extended, so dividing INT32_MIN by -1 wraps at 32 bits too
+    if ((error = integer(op, (uint64_t) as_int64(left), (uint64_t) as_int64(right), &result))) {
+      return error;
+    }
+    left[VALUE_LOW] = (int32_t) (uint32_t) result;
+  }
+  left[VALUE_TAG] = tag;
+  return NULL;
+}
+
+char *value_negate(int32_t *value) {
+  if (!valid(value)) {
+    return "Invalid value tag";
+  }
+  switch (value[VALUE_TAG]) {
+    case TAG_INT32:
+      value[VALUE_LOW] = (int32_t) (0u - (uint32_t) value[VALUE_LOW]);
+      break;
+    case TAG_INT64:
+      value_set_bits(value, 0 - value_bits(value));
+      break;
+    case TAG_DOUBLE:
+      value_set_double(value, -value_double(value));
+      break;
+  }
+  return NULL;
+}
@@ -0,0 +1,90 @@
+#ifndef VALUE_H_INCLUDED
+#define VALUE_H_INCLUDED
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Typed values, for the VADD family of instructions. Everything else in
+ * the VM works on 32-bit ints one word each, and keeps doing so at full
+ * speed; a typed value is three words of stack or data, the low and high
+ * halves of a 64-bit payload and then a tag saying how to read it:
+ *
+ *   TAG_INT32   the low word, and the high one is ignored
+ *   TAG_INT64   both, as a two's complement int64
+ *   TAG_DOUBLE  both, as the bits of an IEEE double
+ *
+ * So the tag is on top once a value is pushed, three zeroed words are the
+ * int32 0, and values are moved about with ordinary PUSHes, FRPUSHes and
+ * POPSTOREs, three at a time. Arithmetic on two values of different types
+ * is done in the wider: int32 goes to int64, and either goes to double.
+ */
+#define TAG_INT32  0
+#define TAG_INT64  1
+#define TAG_DOUBLE 2
+#define TAG_COUNT  3
+
+// the words of a value, from its lowest address
+#define VALUE_LOW   0
+#define VALUE_HIGH  1
+#define VALUE_TAG   2
+#define VALUE_WORDS 3
+
+/*
+ * The payload of the value starting at value, whatever its tag. On a
+ * little endian machine the two words are the payload as it is laid out in
+ * memory, so this is one load or store rather than two and some shifting.
+ */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+static inline uint64_t value_bits(const int32_t *value) {
+  uint64_t bits;
+  memcpy(&bits, value + VALUE_LOW, sizeof(bits));
+  return bits;
+}
+
+static inline void value_set_bits(int32_t *value, uint64_t bits) {
+  memcpy(value + VALUE_LOW, &bits, sizeof(bits));
+}
+#else
+static inline uint64_t value_bits(const int32_t *value) {
+  return (uint64_t) (uint32_t) value[VALUE_HIGH] << 32 | (uint32_t) value[VALUE_LOW];
+}
+
+static inline void value_set_bits(int32_t *value, uint64_t bits) {
+  value[VALUE_LOW] = (int32_t) (uint32_t) bits;
+  value[VALUE_HIGH] = (int32_t) (uint32_t) (bits >> 32);
+}
+#endif
+
+// the payload as each type, without looking at the tag
+static inline int64_t value_int64(const int32_t *value) {
+  return (int64_t) value_bits(value);
+}
+
+static inline double value_double(const int32_t *value) {
+  uint64_t bits = value_bits(value);
+  double d;
+  memcpy(&d, &bits, sizeof(d));
+  return d;
+}
+
+static inline void value_set_int64(int32_t *value, int64_t x) {
+  value_set_bits(value, (uint64_t) x);
+}
+
+static inline void value_set_double(int32_t *value, double d) {
+  uint64_t bits;
+  memcpy(&bits, &d, sizeof(bits));
+  value_set_bits(value, bits);
+}
+
+/*
+ * left = left op right, for the I_VADD ... I_VDIV opcode op, or just
+ * value = -value. NULL if that worked, or why not: an invalid tag, or an
+ * integer division by zero. Integer arithmetic wraps around, as the
+ * VM's does.
+ */
+extern char *value_arithmetic(int32_t op, int32_t *left, const int32_t *right);
+extern char *value_negate(int32_t *value);
+
+#endif
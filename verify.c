@@ -0,0 +1,284 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+
+#include "opcodes.h"
+#include "verify.h"
+#include "native.h"
+
+// how each opcode changes sp - fp (calls and RETURN are handled apart)
+static int stack_effect[OPCODE_COUNT] = {
+  [I_PUSH] = 1, [I_ADD] = -1, [I_LOADPUSH] = 1, [I_POPSTORE] = -1,
+  [I_FRPUSH] = 1, [I_FRPOP] = -1, [I_POP] = -1, [I_MUL] = -1,
+  [I_DIV] = -1, [I_MOD] = -1, [I_SUB] = -1,
+  [I_FRPUSH_FRPUSH_ADD] = 1, [I_ADD_FRPOP] = -2,
+  [I_FRPUSH_JZ] = 1, [I_FRPUSH_JNZ] = 1,
+  [I_VADD] = -3, [I_VSUB] = -3, [I_VMUL] = -3, [I_VDIV] = -3,
+  [I_VECADD] = -4, [I_VECSUB] = -4, [I_VECMUL] = -4, [I_VECLT] = -4,
+  [I_VECSUM] = -1, [I_VECDOT] = -2, [I_VECFILL] = -3, [I_VECCOPY] = -3
+};
+
+// how many values each opcode needs on the stack
+static int operands[OPCODE_COUNT] = {
+  [I_ADD] = 2, [I_SUB] = 2, [I_MUL] = 2, [I_DIV] = 2, [I_MOD] = 2,
+  [I_INC] = 1, [I_DEC] = 1, [I_NEG] = 1, [I_POP] = 1,
+  [I_JZ] = 1, [I_JNZ] = 1, [I_STORE] = 1, [I_POPSTORE] = 1,
+  [I_FRPOP] = 1, [I_RETURN] = 1, [I_ADD_FRPOP] = 2,
+  [I_DEC_JNZ] = 1, [I_PUSH_ADD] = 1,
+  // three words per typed value
+  [I_VADD] = 6, [I_VSUB] = 6, [I_VMUL] = 6, [I_VDIV] = 6, [I_VNEG] = 3,
+  [I_VECADD] = 4, [I_VECSUB] = 4, [I_VECMUL] = 4, [I_VECLT] = 4,
+  [I_VECSUM] = 2, [I_VECDOT] = 3, [I_VECFILL] = 3, [I_VECCOPY] = 3
+};
+
+// the top level has no frame, and no arguments below its frame offset 0
+#define TOP_LEVEL -1
+#define UNSEEN INT32_MIN
+
+static int32_t *code;
+static int code_size;
+static Verification *result;
+
+/*
+ * Flow analysis state: the depth (sp - fp) each reachable instruction runs
+ * with, and the fewest arguments any frame it runs in was called with, or
+ * TOP_LEVEL.
+ */
+static int32_t *depth;
+static int32_t *arg_count;
+static bool *start;
+static bool *queued;
+static int32_t *work;
+static int work_count;
+
+static int32_t insn_length(int32_t opcode) {
+  return ((uint32_t) opcode < OPCODE_COUNT) ? 1 + args[opcode] : 1;
+}
+
+static bool fail(int32_t at, char *format, ...) {
+  va_list list;
+  va_start(list, format);
+  vsnprintf(result->error, sizeof(result->error), format, list);
+  va_end(list);
+  result->ip = at;
+  return false;
+}
+
+// reach target from the instruction at from, with this depth and arg count
+static bool flow(int32_t from, int32_t target, int32_t at_depth, int32_t at_args) {
+  if (target < 0 || target > code_size || !start[target]) {
+    return fail(from, "Invalid %s target %d", IS_CALL(code[from]) ? "call" : "jump", target);
+  }
+  if (depth[target] == UNSEEN) {
+    depth[target] = at_depth;
+    arg_count[target] = at_args;
+  } else if (depth[target] != at_depth) {
+    return fail(from, "Stack depth %d at %d, but %d on another path", at_depth, target, depth[target]);
+  } else if (at_args < arg_count[target]) {
+    arg_count[target] = at_args;
+  } else {
+    return true;
+  }
+  if (!queued[target]) {
+    queued[target] = true;
+    work[work_count++] = target;
+  }
+  return true;
+}
+
+// an offset FRPUSH can read: an argument, or on the stack
+static bool readable(int32_t at, int32_t slot, int32_t d, int32_t k) {
+  if (slot < ((k == TOP_LEVEL) ? 0 : -k) || slot > d) {
+    return fail(at, "Frame offset %d outside the frame", slot);
+  }
+  return true;
+}
+
+// ...and one FRPOP can write, where d is the depth after popping
+static bool writable(int32_t at, int32_t slot, int32_t d, int32_t k) {
+  // the slot just popped is fine too
+  return readable(at, slot, d + 1, k);
+}
+
+static bool check(int32_t at) {
+  int32_t opcode = code[at];
+  int32_t a;
+  int32_t b;
+  int32_t d = depth[at];
+  int32_t k = arg_count[at];
+  int32_t next;
+
+  if ((uint32_t) opcode >= OPCODE_COUNT) {
+    return fail(at, "Invalid opcode %d", opcode);
+  }
+  if (at + args[opcode] >= code_size) {
+    return fail(at, "Truncated %s instruction", instructions[opcode]);
+  }
+  a = (args[opcode] >= 1) ? code[at + 1] : 0;
+  b = (args[opcode] >= 2) ? code[at + 2] : 0;
+  next = at + insn_length(opcode);
+  if (d + 1 < operands[opcode]) {
+    return fail(at, "Stack underflow");
+  }
+
+  switch (opcode) {
+    case I_LOADPUSH: case I_POPSTORE: case I_STORE:
+      if (a < 0) {
+        return fail(at, "Invalid data address %d", a);
+      }
+      if (a >= result->data_size) {
+        result->data_size = a + 1;
+      }
+      break;
+    case I_FRPUSH: case I_FRPUSH_JZ: case I_FRPUSH_JNZ:
+      if (!readable(at, a, d, k)) return false;
+      break;
+    case I_FRPUSH_FRPUSH_ADD:
+      if (!readable(at, a, d, k) || !readable(at, b, d + 1, k)) return false;
+      break;
+    case I_FRPOP:
+      if (!writable(at, a, d - 1, k)) return false;
+      break;
+    case I_ADD_FRPOP:
+      if (!writable(at, a, d - 2, k)) return false;
+      break;
+    case I_CALL:
+      if (b < 0 || b > d + 1) {
+        return fail(at, "CALL with %d arguments and %d on the stack", b, d + 1);
+      }
+      if (a == code_size) {
+        return fail(at, "Invalid call target %d", a);
+      }
+      // the callee starts with an empty stack, and comes back with its
+      // arguments replaced by the return value
+      return flow(at, a, -1, b) && flow(at, next, d - b + 1, k);
+    case I_TAILCALL:
+      if (k == TOP_LEVEL) {
+        return fail(at, "TAILCALL outside a function");
+      }
+      if (b < 0 || b > d + 1) {
+        return fail(at, "TAILCALL with %d arguments and %d on the stack", b, d + 1);
+      }
+      if (a == code_size) {
+        return fail(at, "Invalid call target %d", a);
+      }
+      // ...and never comes back here
+      return flow(at, a, -1, b);
+    case I_NATIVE:
+      if ((uint32_t) a >= (uint32_t) native_count || natives[a].arity != b) {
+        return fail(at, "No native %d taking %d arguments", a, b);
+      }
+      if (b > d + 1) {
+        return fail(at, "NATIVE with %d arguments and %d on the stack", b, d + 1);
+      }
+      return flow(at, next, d - b + 1, k);
+    case I_RETURN:
+      if (k == TOP_LEVEL) {
+        return fail(at, "RETURN outside a function");
+      }
+      return true;
+  }
+  if (jump_arg[opcode] && !flow(at, next + code[at + jump_arg[opcode]], d + stack_effect[opcode], k)) {
+    return false;
+  }
+  if (opcode != I_JMP && opcode != I_STOP) {
+    return flow(at, next, d + stack_effect[opcode], k);
+  }
+  return true;
+}
+
+// the deepest slot from fp the instruction at writes
+static int32_t peak(int32_t at) {
+  int32_t opcode = code[at];
+  switch (opcode) {
+    case I_FRPUSH_FRPUSH_ADD: return depth[at] + 2;
+    case I_NATIVE: return depth[at] + (code[at + 2] == 0);
+  }
+  return depth[at] + (stack_effect[opcode] > 0 ? stack_effect[opcode] : 0);
+}
+
+// how many slots from fp the code reachable from entry needs, not counting calls
+static int32_t frame_size(int32_t entry) {
+  bool *reached = (bool*) calloc(code_size + 1, sizeof(bool));
+  int32_t size = 0;
+  work_count = 0;
+  work[work_count++] = entry;
+  reached[entry] = true;
+  while (work_count > 0) {
+    int32_t at = work[--work_count];
+    int32_t opcode = code[at];
+    int32_t next[2] = { -1, -1 };
+    int i;
+    if (at == code_size) {
+      continue;
+    }
+    if (peak(at) + 1 > size) {
+      size = peak(at) + 1;
+    }
+    if (jump_arg[opcode]) {
+      next[0] = at + insn_length(opcode) + code[at + jump_arg[opcode]];
+    }
+    if (opcode != I_JMP && opcode != I_RETURN && opcode != I_STOP && opcode != I_TAILCALL) {
+      next[1] = at + insn_length(opcode);
+    }
+    for (i = 0; i < 2; i++) {
+      if (next[i] >= 0 && !reached[next[i]]) {
+        reached[next[i]] = true;
+        work[work_count++] = next[i];
+      }
+    }
+  }
+  free(reached);
+  return size;
+}
+
+bool verify(int32_t *program, int program_size, Verification *verification) {
+  int32_t size = program_size + 1;
+  int32_t at;
+  bool ok;
+
+  code = program;
+  code_size = program_size;
+  result = verification;
+  result->ip = 0;
+  result->error[0] = '\0';
+  result->data_size = 0;
+  result->stack_size = 0;
+
+  depth = (int32_t*) malloc(size * sizeof(int32_t));
+  arg_count = (int32_t*) malloc(size * sizeof(int32_t));
+  start = (bool*) calloc(size, sizeof(bool));
+  queued = (bool*) calloc(size, sizeof(bool));
+  work = (int32_t*) malloc(size * sizeof(int32_t));
+  for (at = 0; at < size; at++) {
+    depth[at] = UNSEEN;
+  }
+  for (at = 0; at < code_size; at += insn_length(code[at])) {
+    start[at] = true;
+  }
+  start[code_size] = true;
+
+  work_count = 0;
+  ok = flow(0, 0, -1, TOP_LEVEL);
+  while (ok && work_count > 0) {
+    at = work[--work_count];
+    queued[at] = false;
+    // running off the end is fine
+    if (at < code_size) {
+      ok = check(at);
+    }
+  }
+
+  if (ok) {
+    result->stack_size = frame_size(0);
+  }
+
+  free(depth);
+  free(arg_count);
+  free(start);
+  free(queued);
+  free(work);
+  return ok;
+}
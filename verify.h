@@ -0,0 +1,37 @@
+#ifndef VERIFY_H_INCLUDED
+#define VERIFY_H_INCLUDED
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * What verify() found out about a program. On failure ip and error say
+ * which reachable instruction is the problem and why.
+ */
+typedef struct _Verification {
+  int32_t ip;
+  char error[96];
+  int data_size;        // one past the highest data address used
+  int stack_size;       // slots the top level needs, calls not included
+} Verification;
+
+/*
+ * Check everything execute() checks as it goes, and the things it doesn't,
+ * once for the whole program: every instruction reachable from ip 0 is
+ * whole and valid, every jump and call lands on one, the stack has the same
+ * depth at an instruction on every path to it and never goes below the
+ * current frame, frame offsets stay inside the frame and its arguments,
+ * RETURN and TAILCALL are only ever in a function, every NATIVE is to a
+ * registered native with the arguments it takes, and data addresses
+ * aren't negative. That leaves only data addresses past the end of the
+ * data, which data_size is what's needed to check once, and stack
+ * overflow, which the VM's guard pages catch however deep the calls go.
+ * The bulk array instructions' and natives' ranges come off the stack, so
+ * they're checked as they run, verified or not.
+ *
+ * Returns false with result->ip and result->error filled in if the
+ * program fails.
+ */
+extern bool verify(int32_t *code, int code_size, Verification *result);
+
+#endif
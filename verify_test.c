@@ -0,0 +1,82 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "opcodes.h"
+#include "native.h"
+#include "verify.h"
+
+/*
+ * Checks for verify(), run by "make check": programs it has to accept, and
+ * ones it has to reject, at the right instruction and for the right reason.
+ */
+
+static int failures = 0;
+
+static void accept(char *name, int32_t *code, int code_size) {
+  Verification result;
+  if (!verify(code, code_size, &result)) {
+    printf("%s: rejected, %s at ip=%d\n", name, result.error, result.ip);
+    failures++;
+  }
+}
+
+static void reject(char *name, int32_t *code, int code_size, int32_t ip, char *error) {
+  Verification result;
+  if (verify(code, code_size, &result)) {
+    printf("%s: accepted\n", name);
+    failures++;
+  } else if (result.ip != ip || strstr(result.error, error) != result.error) {
+    printf("%s: %s at ip=%d, not %s at ip=%d\n", name, result.error, result.ip, error, ip);
+    failures++;
+  }
+}
+
+#define ACCEPT(name, ...) \
+  do { \
+    int32_t code[] = { __VA_ARGS__ }; \
+    accept(name, code, sizeof(code) / sizeof(int32_t)); \
+  } while (0)
+#define REJECT(name, ip, error, ...) \
+  do { \
+    int32_t code[] = { __VA_ARGS__ }; \
+    reject(name, code, sizeof(code) / sizeof(int32_t), ip, error); \
+  } while (0)
+
+int main() {
+  ACCEPT("a loop", I_PUSH, 3, I_DEC, I_JNZ, -3, I_POPSTORE, 0, I_STOP);
+  ACCEPT("a call and its arguments",
+      I_PUSH, 2, I_PUSH, 3, I_CALL, 9, 2, I_POPSTORE, 0, I_STOP,
+      /* 9 */ I_FRPUSH, -2, I_FRPUSH, -1, I_ADD, I_RETURN);
+  ACCEPT("the same depth at a join",
+      I_PUSH, 1, I_JZ, 4, I_PUSH, 2, I_JMP, 2, I_PUSH, 3, I_POPSTORE, 0, I_STOP);
+  ACCEPT("a native", I_PUSH, 1, I_PUSH, 42, I_NATIVE, N_PRINT_INT, 2, I_POP, I_STOP);
+
+  REJECT("underflow", 2, "Stack underflow", I_PUSH, 1, I_ADD, I_STOP);
+  REJECT("a pop from an empty stack", 0, "Stack underflow", I_POP, I_STOP);
+  REJECT("a jump into an instruction", 2, "Invalid jump target 5",
+      I_PUSH, 1, I_JNZ, 1, I_PUSH, 2, I_STOP);
+  REJECT("a jump past the end", 0, "Invalid jump target 12", I_JMP, 10, I_STOP);
+  REJECT("a call into an instruction", 0, "Invalid call target 4",
+      I_CALL, 4, 0, I_PUSH, 1, I_RETURN);
+  REJECT("different depths at a join", 4, "Stack depth 1 at 6, but 0",
+      I_PUSH, 1, I_JZ, 2, I_PUSH, 2, I_PUSH, 3, I_STOP);
+  REJECT("a CALL with more arguments than the stack has", 2, "CALL with 2 arguments and 1 on the stack",
+      I_PUSH, 1, I_CALL, 6, 2, I_STOP,
+      /* 6 */ I_FRPUSH, -1, I_RETURN);
+  REJECT("a function reading an argument its CALL doesn't pass", 6, "Frame offset -2 outside the frame",
+      I_PUSH, 1, I_CALL, 6, 1, I_STOP,
+      /* 6 */ I_FRPUSH, -2, I_RETURN);
+  REJECT("a NATIVE with the wrong number of arguments", 4, "No native 0 taking 1 arguments",
+      I_PUSH, 1, I_PUSH, 2, I_NATIVE, N_PRINT_INT, 1, I_STOP);
+  REJECT("a RETURN at the top level", 2, "RETURN outside a function", I_PUSH, 1, I_RETURN);
+
+  if (failures) {
+    printf("%d verifier checks failed\n", failures);
+    return 1;
+  }
+  printf("verifier checks passed\n");
+  return 0;
+}
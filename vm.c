@@ -1,220 +1,934 @@
+// for sigsetjmp()
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
+#include <setjmp.h>
 
 #include "vm.h"
 #include "opcodes.h"
+#include "dispatch.h"
+#include "jit.h"
+#include "verify.h"
+#include "trace.h"
+#include "profile.h"
+#include "value.h"
+#include "bulk.h"
+#include "guard.h"
+#include "native.h"
+
+// pseudo-opcodes that only ever appear in the decoded instruction stream
+#define X_END      (OPCODE_COUNT + 0) // ran off the end of the code
+#define X_BADJUMP  (OPCODE_COUNT + 1) // jump or call to a non-instruction address
+#define X_INVALID  (OPCODE_COUNT + 2) // undefined or truncated instruction
+/*
+ * ...and the type specialised forms the typed value instructions rewrite
+ * themselves to as they run, see REWRITE().
+ */
+#define Q_ADD_I32  (OPCODE_COUNT + 3)
+#define Q_ADD_I64  (OPCODE_COUNT + 4)
+#define Q_ADD_F64  (OPCODE_COUNT + 5)
+#define Q_SUB_I32  (OPCODE_COUNT + 6)
+#define Q_SUB_I64  (OPCODE_COUNT + 7)
+#define Q_SUB_F64  (OPCODE_COUNT + 8)
+#define Q_MUL_I32  (OPCODE_COUNT + 9)
+#define Q_MUL_I64  (OPCODE_COUNT + 10)
+#define Q_MUL_F64  (OPCODE_COUNT + 11)
+#define Q_DIV_I32  (OPCODE_COUNT + 12)
+#define Q_DIV_I64  (OPCODE_COUNT + 13)
+#define Q_DIV_F64  (OPCODE_COUNT + 14)
+#define Q_NEG_I32  (OPCODE_COUNT + 15)
+#define Q_NEG_I64  (OPCODE_COUNT + 16)
+#define Q_NEG_F64  (OPCODE_COUNT + 17)
+#define DECODED_OPCODE_COUNT (OPCODE_COUNT + 18)
+
+// a real instruction rather than one of the X_ stand-ins
+#define IS_INSTRUCTION(op) ((op) < OPCODE_COUNT || (op) > X_INVALID)
+
+// what each typed value instruction quickens to, by its operands' tag
+static int32_t quickened[OPCODE_COUNT][TAG_COUNT] = {
+  [I_VADD] = { Q_ADD_I32, Q_ADD_I64, Q_ADD_F64 },
+  [I_VSUB] = { Q_SUB_I32, Q_SUB_I64, Q_SUB_F64 },
+  [I_VMUL] = { Q_MUL_I32, Q_MUL_I64, Q_MUL_F64 },
+  [I_VDIV] = { Q_DIV_I32, Q_DIV_I64, Q_DIV_F64 },
+  [I_VNEG] = { Q_NEG_I32, Q_NEG_I64, Q_NEG_F64 }
+};
+
+// how often an instruction's guard can fail before it stays generic
+#define QUICKEN_LIMIT 4
+
+/*
+ * One pre-decoded instruction. load_program() translates the raw bytecode
+ * into an array of these once, so the interpreter never looks at the code
+ * while it runs: immediates are already fetched, and jump/call targets are
+ * indexes into the decoded array rather than bytecode offsets.
+ */
+typedef struct _Insn {
+  void *handler;  // label of the handler (threaded dispatch only)
+  int32_t opcode;
+  int32_t a;      // first immediate, or decoded jump/call target
+  int32_t b;      // second immediate
+  int32_t ip;     // bytecode address this was decoded from
+} Insn;
+
+// the three ways a program is threaded, by which instructions run the hooks
+#define HOOK_NONE  0
+#define HOOK_JIT   1 // just CALL and JMP
+#define HOOK_ALL   2
+
+#ifdef VM_THREADED_DISPATCH
+// execute()'s handler addresses, see thread()
+static void **_handlers = NULL;
+#endif
+
+static int32_t insn_length(int32_t opcode) {
+  return ((uint32_t) opcode < OPCODE_COUNT) ? 1 + args[opcode] : 1;
+}
+
+/*
+ * Index of the decoded instruction at bytecode address target. Jumps that
+ * land anywhere else get their own X_BADJUMP record so the error can name
+ * the instruction that jumped.
+ */
+static int32_t decoded_target(Program *program, int32_t from, int32_t target) {
+  if (target >= 0 && target <= program->code_size && program->ip_map[target] >= 0) {
+    return program->ip_map[target];
+  }
+  program->decoded[0][program->decoded_size] = (Insn) { NULL, X_BADJUMP, target, 0, from };
+  return program->decoded_size++;
+}
+
+/*
+ * Translate the code into decoded[0]: one record per instruction, then an
+ * X_END record standing in for ip == code_size, then any X_BADJUMP records.
+ */
+static void decode(Program *program) {
+  int32_t *code = program->code;
+  int code_size = program->code_size;
+  int32_t *ip_map;
+  Insn *decoded;
+  int32_t at;
+  int32_t count = 0;
+  int32_t jumps = 0;
+
+  ip_map = program->ip_map = (int32_t*) malloc((code_size + 1) * sizeof(int32_t));
+  for (at = 0; at <= code_size; at++) {
+    ip_map[at] = -1;
+  }
+  for (at = 0; at < code_size; at += insn_length(code[at])) {
+    if ((uint32_t) code[at] < OPCODE_COUNT && (jump_arg[code[at]] || IS_CALL(code[at]))) {
+      jumps++;
+    }
+    ip_map[at] = count++;
+  }
+  ip_map[code_size] = count;
+
+  decoded = program->decoded[0] = (Insn*) malloc((count + 1 + jumps) * sizeof(Insn));
+  decoded[count] = (Insn) { NULL, X_END, 0, 0, code_size };
+  program->decoded_size = count + 1;
+  for (at = 0; at < code_size; at += insn_length(code[at])) {
+    int32_t opcode = code[at];
+    Insn *insn = &decoded[ip_map[at]];
+    *insn = (Insn) { NULL, opcode, 0, 0, at };
+    if ((uint32_t) opcode >= OPCODE_COUNT || at + args[opcode] >= code_size) {
+      // only an error if we actually get there
+      insn->opcode = X_INVALID;
+      insn->a = opcode;
+      continue;
+    }
+    if (args[opcode] >= 1) insn->a = code[at + 1];
+    if (args[opcode] >= 2) insn->b = code[at + 2];
+    if (jump_arg[opcode] == 1) {
+      insn->a = decoded_target(program, at, at + 1 + args[opcode] + insn->a);
+    } else if (jump_arg[opcode] == 2) {
+      insn->b = decoded_target(program, at, at + 1 + args[opcode] + insn->b);
+    } else if (IS_CALL(opcode)) {
+      insn->a = decoded_target(program, at, insn->a);
+    }
+  }
+}
+
+static void interpret(VM *vm);
+
+/*
+ * Fill in the handlers, once for each way of hooking instructions, so
+ * execute() only ever reads the program. The switch build has no handlers
+ * and shares one copy between all three.
+ */
+static void thread(Program *program) {
+#ifdef VM_THREADED_DISPATCH
+  size_t size = program->decoded_size * sizeof(Insn);
+  int hooks;
+  int x;
+  if (!_handlers) {
+    interpret(NULL);
+  }
+  for (hooks = HOOK_NONE; hooks <= HOOK_ALL; hooks++) {
+    Insn *decoded = program->decoded[hooks];
+    if (hooks != HOOK_NONE) {
+      decoded = program->decoded[hooks] = (Insn*) malloc(size);
+      memcpy(decoded, program->decoded[0], size);
+    }
+    for (x = 0; x < program->decoded_size; x++) {
+      int32_t opcode = decoded[x].opcode;
+      bool hooked = (hooks == HOOK_ALL && IS_INSTRUCTION(opcode))
+        || (hooks == HOOK_JIT && (IS_CALL(opcode) || opcode == I_JMP));
+      // the hook handler's address is kept after the real ones
+      decoded[x].handler = _handlers[hooked ? DECODED_OPCODE_COUNT : opcode];
+    }
+  }
+#else
+  program->decoded[HOOK_JIT] = program->decoded[HOOK_ALL] = program->decoded[HOOK_NONE];
+#endif
+}
 
-#define STACK_SIZE 8192
+// what the stacks of VMs init()ed from now on can grow to
+static int32_t stack_limit = STACK_LIMIT;
+static int32_t control_limit = CONTROL_LIMIT;
 
+static Program *load(int32_t *code, int code_size, Verification *verified) {
+  Program *program = (Program*) malloc(sizeof(Program));
+  program->code = code;
+  program->code_size = code_size;
+  program->verified = verified != NULL;
+  program->data_size = verified ? verified->data_size : 0;
+  decode(program);
+  thread(program);
+  jit_reset(program);
+  return program;
+}
 
-int32_t ip = 0;  // instruction pointer
-int32_t sp = -1; // stack pointer
-int32_t fp = 0;  // frame pointer
+Program *load_program(int32_t *code, int code_size) {
+  return load(code, code_size, NULL);
+}
 
-int32_t _stack[STACK_SIZE];
-int32_t* _code;
-int32_t* _data;
-int _code_size;
-int _data_size;
+Program *load_verified(int32_t *code, int code_size, Verification *result) {
+  Program *program = NULL;
+  if (!verify(code, code_size, result)) {
+    return NULL;
+  }
+  if (result->stack_size > stack_limit) {
+    result->ip = 0;
+    snprintf(result->error, sizeof(result->error), "Needs %d stack slots, but there are %d",
+        result->stack_size, stack_limit);
+  } else {
+    program = load(code, code_size, result);
+  }
+  return program;
+}
 
-void init(int32_t*code, int code_size, int32_t*data, int data_size) {
-  _code = code;
-  _data = data;
-  _code_size = code_size;
-  _data_size = data_size;
-  ip = 0;
-  sp = -1;
-  fp = 0;
+void free_program(Program *program) {
+  if (!program) {
+    return;
+  }
+#ifdef VM_THREADED_DISPATCH
+  free(program->decoded[HOOK_JIT]);
+  free(program->decoded[HOOK_ALL]);
+#endif
+  free(program->decoded[HOOK_NONE]);
+  free(program->ip_map);
+  free(program);
 }
 
-void execute(bool trace) {
+void set_stack_limits(int32_t slots, int32_t frames) {
+  if (slots > 0) {
+    stack_limit = slots;
+  }
+  if (frames > 0) {
+    control_limit = frames;
+  }
+}
+
+static void map_stacks(VM *vm) {
+  size_t stack_bytes = (size_t) (stack_limit + 1) * sizeof(int32_t);
+  size_t control_bytes = (size_t) control_limit * sizeof(Frame);
+  if (vm->stack_region.base && vm->stack_region.limit != stack_bytes) {
+    region_unmap(&vm->stack_region);
+  }
+  if (vm->control_region.base && vm->control_region.limit != control_bytes) {
+    region_unmap(&vm->control_region);
+  }
+  // one spare slot below the stack: with an empty stack the cached top of
+  // stack (see execute) is spilled to stack[-1]
+  if ((!vm->stack_region.base
+        && !region_map(&vm->stack_region, (STACK_SIZE + 1) * sizeof(int32_t), stack_bytes))
+      || (!vm->control_region.base
+        && !region_map(&vm->control_region, CONTROL_SIZE * sizeof(Frame), control_bytes))) {
+    fprintf(stderr, "Out of memory for the stacks\n");
+    exit(1);
+  }
+  vm->stack = (int32_t*) vm->stack_region.base + 1;
+  vm->control = (Frame*) vm->control_region.base;
+}
+
+void init(VM *vm, Program *program, int32_t *data, int data_size) {
+  vm->program = program;
+  vm->data = data;
+  vm->data_size = data_size;
+  map_stacks(vm);
+  vm->ip = 0;
+  vm->sp = -1;
+  vm->fp = 0;
+  vm->csp = 0;
+  vm->ip_counts = NULL;
+  vm->trace = NULL;
+  vm->profile = NULL;
+  vm->output.used = 0;
+  vm->jit = true;
+}
+
+void free_stacks(VM *vm) {
+  region_unmap(&vm->stack_region);
+  region_unmap(&vm->control_region);
+}
+
+void profile_ips(VM *vm, uint64_t *counts) {
+  vm->ip_counts = counts;
+}
+
+/*
+ * The registers live in locals while the loop runs: pc for the instruction
+ * pointer, sp, fp, frame for the next free control frame (vm->csp as a
+ * pointer) and (unless built with -DVM_NO_TOS_CACHE) tos for the value on
+ * top of the stack. vm's registers and stack[sp] are only brought up to
+ * date by SAVE_REGS() when we leave execute().
+ * Everything else about the machine is in *vm, so any number of VMs can run
+ * at once as long as each sticks to one thread.
+ *
+ * Nothing checks that sp, fp or frame stay on their stacks: running off
+ * either end faults on a guard page, and run_guarded() takes it from
+ * there, with the registers in the locals lost. The guard page is below
+ * the spare slot under an empty stack (see init), though, so the
+ * instructions that take more than one operand count what's there: the
+ * arithmetic, ADD_FRPOP, and the typed value and bulk array ones.
+ *
+ * Tracing, profiling and ip counting are "hooks" run before an instruction.
+ * Tracing only appends the registers to vm->trace; see trace.h. The
+ * threaded build runs a copy of the program with every instruction pointed
+ * at L_HOOK instead of its own handler while any hook is on, so they cost
+ * nothing when they are off. The JIT check is a hook too, but only on CALL
+ * and JMP, so it gets a copy of its own.
+ */
+
+/*
+ * With the top of stack cached, everything below sp is always up to date
+ * in stack but stack[sp] itself is not until SPILL(). Pushing spills the
+ * old top before the new value is evaluated, so PUSH(stack[fp + n]) is
+ * fine even when fp + n == sp.
+ */
+#ifndef VM_NO_TOS_CACHE
+#define TOS        tos
+#define SPILL()    (stack[sp] = tos)
+#define FILL()     (tos = stack[sp])
+#else
+#define TOS        stack[sp]
+#define SPILL()    ((void) 0)
+#define FILL()     ((void) 0)
+#endif
+#define PUSH(v)    do { SPILL(); sp++; TOS = (v); } while (0)
+#define POP_TO(v)  do { (v) = TOS; sp--; FILL(); } while (0)
+#define BINARY(op) do { if (sp < 1) UNDERFLOW(); POP_TO(y); TOS = TOS op y; } while (0)
+
+#define SAVE_REGS(at) \
+  do { \
+    SPILL(); \
+    vm->ip = (at); \
+    vm->sp = sp; \
+    vm->fp = fp; \
+    vm->csp = frame - vm->control; \
+  } while (0)
+
+#define FAIL(...) \
+  do { \
+    output_flush(&vm->output); \
+    printf(__VA_ARGS__); \
+    printf(" at ip=%d", pc->ip); \
+    SAVE_REGS(pc->ip); \
+    return; \
+  } while (0)
+#define UNDERFLOW() FAIL("Stack underflow")
+
+#define HOOKS() \
+  do { \
+    if (vm->ip_counts) vm->ip_counts[pc->ip]++; \
+    if (vm->trace) trace_step(vm->trace, pc->ip, sp, fp, TOS); \
+    if (vm->profile) profile_step(vm->profile, pc->ip); \
+  } while (0)
+
+/*
+ * A CALL's frame goes on the control stack, and the arguments stay put as
+ * the bottom of the callee's frame.
+ */
+#define ENTER() \
+  do { \
+    SPILL(); \
+    frame->ip = pc->ip + 3; \
+    frame->fp = fp; \
+    frame->sp = sp - pc->b; \
+    frame++; \
+    fp = sp + 1; \
+  } while (0)
+
+/*
+ * A TAILCALL's arguments go where the current frame's did, replacing it,
+ * and the frame it would have returned to is the callee's.
+ */
+#define REENTER() \
+  do { \
+    SPILL(); \
+    y = frame[-1].sp + 1 - (sp + 1 - pc->b); \
+    for (x = sp + 1 - pc->b; x <= sp; x++) { \
+      stack[x + y] = stack[x]; \
+    } \
+    sp = frame[-1].sp + pc->b; \
+    fp = sp + 1; \
+    FILL(); \
+  } while (0)
+
+/*
+ * At a CALL, a TAILCALL or a backward JMP, with the JIT on: if the target
+ * has native code (or has just got hot enough to get some), make the call
+ * or jump, run the native code, and carry on interpreting wherever it
+ * stops.
+ */
+#define JIT_ENTRY() \
+  if (jit && (pc->opcode == I_CALL || (pc->opcode == I_TAILCALL && frame > vm->control) \
+        || (pc->opcode == I_JMP && program[pc->a].ip <= pc->ip)) \
+      && program[pc->a].opcode < OPCODE_COUNT && (native = jit_entry(vm, program[pc->a].ip))) { \
+    if (pc->opcode == I_CALL) { \
+      ENTER(); \
+    } else if (pc->opcode == I_TAILCALL) { \
+      REENTER(); \
+    } \
+    SAVE_REGS(program[pc->a].ip); \
+    y = jit_run(vm, native); \
+    sp = vm->sp; \
+    fp = vm->fp; \
+    frame = vm->control + vm->csp; \
+    FILL(); \
+    if ((uint32_t) y > (uint32_t) code_size || ip_map[y] < 0) { \
+      FAIL("Failure: Invalid return address %d", y); \
+    } \
+    pc = program + ip_map[y]; \
+    DISPATCH(); \
+  }
+
+/*
+ * Pop a RETURN's frame, leaving the return value on top in place of the
+ * arguments and the return address in y. Everything under the arguments
+ * was spilled by the CALL.
+ */
+#define UNWIND() \
+  do { \
+    x = TOS; \
+    frame--; \
+    sp = frame->sp + 1; \
+    fp = frame->fp; \
+    y = frame->ip; \
+    TOS = x; \
+  } while (0)
+
+/*
+ * The typed value instructions start out generic, handing the arithmetic
+ * to value.c, and the first time one finds both its operands with the
+ * same tag it rewrites its own decoded instruction into the form for that
+ * type: Q_ADD_I32 is an add on the low words and nothing else. Each
+ * quickened form checks its guess, and that it has operands at all so it
+ * can serve verified and unverified code alike, and if the guess was
+ * wrong puts the generic form back and counts that in b. After
+ * QUICKEN_LIMIT wrong guesses an instruction stays generic.
+ *
+ * A hooked instruction keeps the hook as its handler, and gets to its new
+ * form through the opcode.
+ */
+#ifdef VM_THREADED_DISPATCH
+#define REWRITE(op) \
+  do { \
+    if (pc->handler != handlers[DECODED_OPCODE_COUNT]) { \
+      pc->handler = handlers[op]; \
+    } \
+    pc->opcode = (op); \
+  } while (0)
+#else
+#define REWRITE(op) (pc->opcode = (op))
+#endif
+
+// run the generic form of op, whatever pc->opcode says by now
+#define GENERIC(op) do { x = (op); goto generic_value; } while (0)
+
+#define DEOPT(op) \
+  do { \
+    pc->b++; \
+    REWRITE(op); \
+    GENERIC(op); \
+  } while (0)
+
+// two values with this tag on top, the right one's payload at sp - 2
+#define GUARD_BINARY(tag, op) \
+  if (sp < 5 || TOS != (tag) || stack[sp - 3] != (tag)) { \
+    DEOPT(op); \
+  }
+
+/*
+ * The quickened binary instructions pop the right operand and work on the
+ * left one's payload in place, which already has the right tag.
+ */
+#define QUICK_INT32(op, operator) \
+  GUARD_BINARY(TAG_INT32, op); \
+  sp -= 3; \
+  stack[sp - 2] = (int32_t) ((uint32_t) stack[sp - 2] operator (uint32_t) stack[sp + 1]); \
+  TOS = TAG_INT32; \
+  NEXT;
+
+#define QUICK_INT64(op, operator) \
+  GUARD_BINARY(TAG_INT64, op); \
+  sp -= 3; \
+  value_set_bits(&stack[sp - 2], value_bits(&stack[sp - 2]) operator value_bits(&stack[sp + 1])); \
+  TOS = TAG_INT64; \
+  NEXT;
+
+#define QUICK_DOUBLE(op, operator) \
+  GUARD_BINARY(TAG_DOUBLE, op); \
+  sp -= 3; \
+  value_set_double(&stack[sp - 2], value_double(&stack[sp - 2]) operator value_double(&stack[sp + 1])); \
+  TOS = TAG_DOUBLE; \
+  NEXT;
+
+#define GUARD_UNARY(tag) \
+  if (sp < 2 || TOS != (tag)) { \
+    DEOPT(I_VNEG); \
+  }
+
+/*
+ * The bulk array instructions check their ranges as they go, verified or
+ * not, as they come off the stack: n words of data from at must all be
+ * there.
+ */
+#define IN_DATA(at, n) \
+  ((uint32_t) (at) <= (uint32_t) vm->data_size && (uint32_t) (n) <= (uint32_t) (vm->data_size - (at)))
+#define RANGE_FAIL() FAIL("Failure: %s of %d words outside the data", instructions[pc->opcode], TOS)
+
+/*
+ * interpret(NULL) runs nothing; it just hands its handler addresses to
+ * thread(), which is the only place they are needed outside.
+ */
+static void interpret(VM *vm) {
   int32_t x;
   int32_t y;
-  int32_t opcode;
-  bool fatal = false;
-  while (ip < _code_size && !fatal) {
-    opcode = _code[ip];
-    if (trace) {
-      trace_it(ip);
+  bool jit;
+  void *native;
+  Insn *program;
+  int32_t *ip_map;
+  int32_t code_size;
+  int32_t *stack;
+  int32_t *data;
+  Insn *pc;
+  int32_t sp;
+  int32_t fp;
+  Frame *frame;
+#ifndef VM_NO_TOS_CACHE
+  int32_t tos;
+#endif
+  char *message;
+#ifdef VM_THREADED_DISPATCH
+  // the hook handler goes last, see thread()
+  static void *handlers[DECODED_OPCODE_COUNT + 1] = {
+    &&L_I_NOP, &&L_I_STOP, &&L_I_PUSH, &&L_I_ADD, &&L_I_INC,
+    &&L_I_DEC, &&L_I_JNZ, &&L_I_LOADPUSH, &&L_I_POPSTORE, &&L_I_STORE,
+    &&L_I_CALL, &&L_I_RETURN, &&L_I_FRPUSH, &&L_I_FRPOP, &&L_I_JZ,
+    &&L_I_POP, &&L_I_JMP, &&L_I_MUL, &&L_I_NEG, &&L_I_DIV,
+    &&L_I_MOD, &&L_I_SUB,
+    &&L_I_FRPUSH_FRPUSH_ADD, &&L_I_ADD_FRPOP, &&L_I_DEC_JNZ,
+    &&L_I_PUSH_ADD, &&L_I_FRPUSH_JZ, &&L_I_FRPUSH_JNZ, &&L_I_TAILCALL,
+    &&L_I_VADD, &&L_I_VSUB, &&L_I_VMUL, &&L_I_VDIV, &&L_I_VNEG,
+    &&L_I_VECADD, &&L_I_VECSUB, &&L_I_VECMUL, &&L_I_VECLT, &&L_I_VECSUM,
+    &&L_I_VECDOT, &&L_I_VECFILL, &&L_I_VECCOPY, &&L_I_NATIVE,
+    &&L_X_END, &&L_X_BADJUMP, &&L_X_INVALID,
+    &&L_Q_ADD_I32, &&L_Q_ADD_I64, &&L_Q_ADD_F64,
+    &&L_Q_SUB_I32, &&L_Q_SUB_I64, &&L_Q_SUB_F64,
+    &&L_Q_MUL_I32, &&L_Q_MUL_I64, &&L_Q_MUL_F64,
+    &&L_Q_DIV_I32, &&L_Q_DIV_I64, &&L_Q_DIV_F64,
+    &&L_Q_NEG_I32, &&L_Q_NEG_I64, &&L_Q_NEG_F64,
+    &&L_HOOK
+  };
+  if (!vm) {
+    _handlers = handlers;
+    return;
+  }
+#endif
+  // native code isn't traced or profiled, so either turns the JIT off
+  jit = vm->jit && _jit_threshold && !vm->trace && !vm->profile;
+  program = vm->program->decoded[(vm->trace || vm->profile || vm->ip_counts) ? HOOK_ALL : jit ? HOOK_JIT : HOOK_NONE];
+  ip_map = vm->program->ip_map;
+  code_size = vm->program->code_size;
+  stack = vm->stack;
+  data = vm->data;
+  sp = vm->sp;
+  fp = vm->fp;
+  frame = vm->control + vm->csp;
+  FILL();
+  if ((uint32_t) vm->ip > (uint32_t) code_size || ip_map[vm->ip] < 0) {
+    printf("Failure: Invalid instruction address %d", vm->ip);
+    return;
+  }
+  if (vm->program->verified) {
+    // the verifier only vouches for runs from the start
+    if (vm->ip != 0 || sp != -1 || fp != 0 || vm->csp != 0) {
+      printf("Failure: Verified program not run from the start");
+      return;
+    }
+    if (vm->data_size < vm->program->data_size) {
+      printf("Failure: Program needs %d words of data", vm->program->data_size);
+      return;
+    }
+  }
+  if (vm->trace) {
+    trace_run(vm->trace, vm->program->code, code_size, stack, sp, fp);
+  }
+  pc = program + ip_map[vm->ip];
+#ifdef VM_THREADED_DISPATCH
+  DISPATCH();
+L_HOOK:
+  HOOKS();
+  JIT_ENTRY();
+  goto *handlers[pc->opcode];
+#else
+  bool hooks = vm->trace || vm->profile || vm->ip_counts || jit;
+  for (;;) {
+    if (hooks && IS_INSTRUCTION(pc->opcode)) {
+      HOOKS();
+      JIT_ENTRY();
     }
-    ip++;
-    switch(opcode) {
-      case I_STOP:
+    switch(pc->opcode) {
+#endif
+      CASE(I_NOP):
+        NEXT;
+      CASE(I_STOP):
+        SAVE_REGS(pc->ip + 1);
         return;
-      case I_PUSH:
-        _stack[++sp] = _code[ip++];
-        break;
-      case I_POP:
+      CASE(I_PUSH):
+        PUSH(pc->a);
+        NEXT;
+      CASE(I_POP):
         sp--;
-        break;
-      case I_ADD:
-        if (sp < 0) {
-          printf("Stack underflow");
-          fatal = true;
-        } else {
-          y = _stack[sp--];
-          x = _stack[sp];
-          _stack[sp] = x + y;
-        }
-        break;
-      case I_MUL:
-        if (sp < 0) {
-          printf("Stack underflow");
-          fatal = true;
-        } else {
-          y = _stack[sp--];
-          x = _stack[sp];
-          _stack[sp] = x * y;
-        }
-        break;
-      case I_DIV:
-        if (sp < 0) {
-          printf("Stack underflow");
-          fatal = true;
-        } else {
-          y = _stack[sp--];
-          x= _stack[sp];
-          _stack[sp] = x / y;
-        }
-        break;
-      case I_MOD:
-        if (sp < 0) {
-          printf("Stack underflow");
-          fatal = true;
-        } else {
-          y = _stack[sp--];
-          x = _stack[sp];
-          _stack[sp] = x % y;
-        }
-        break;
-      case I_SUB:
-        if (sp < 0) {
-          printf("Stack underflow");
-          fatal = true;
-        } else {
-          y = _stack[sp--];
-          x = _stack[sp];
-          _stack[sp] = x / y;
-        }
-        break;
-      case I_INC:
-        _stack[sp]++;
-        break;
-      case I_NEG:
-        _stack[sp] = - _stack[sp];;
-        break;
-      case I_DEC:
-        _stack[sp]--;
-        break;
-      case I_LOADPUSH:
-        _stack[++sp] = _data[_code[ip++]];
-        break;
-      case I_POPSTORE:
-        if (sp < 0) {
-          printf("Stack underflow");
-          fatal = true;
-        } else {
-          _data[_code[ip++]] = _stack[sp--];
-        }
-        break;
-      case I_FRPUSH:
-        y = fp + _code[ip++];
-        _stack[++sp] = _stack[y];
-        break;
-      case I_FRPOP:
-        if (sp < 0) {
-          printf("Stack underflow");
-          fatal = true;
-        } else {
-          y = fp + _code[ip++];
-          _stack[y] = _stack[sp--];
-        }
-        break;
-      case I_STORE:
-        if (sp < 0) {
-          printf("Stack underflow");
-          fatal = true;
-        } else {
-          _data[_code[ip++]] = _stack[sp];
-        }
-        break;
-      case I_JNZ:
-        y = _code[ip++];
-        if (_stack[sp]) {
-          ip += y;
-        }
-        break;
-      case I_JZ:
-        y = _code[ip++];
-        if (!_stack[sp]) {
-          ip += y;
-        }
-        break;
-      case I_JMP:
-        y = _code[ip++];
-        ip += y;
-        break;
-      case I_CALL: {
-        int32_t dest = _code[ip++];
-        int32_t arg_count = _code[ip++];
-        int32_t old_sp = sp;
-        _stack[++sp] = arg_count;
-        _stack[++sp] = old_sp;;
-        _stack[++sp] = ip;
-        _stack[++sp] = fp;
-        ip = dest;
-        fp = sp + 1;
-        break;
-      }
-      case I_RETURN: {
-        int32_t return_value = _stack[sp--];
-        int32_t old_fp = fp;
-        sp = _stack[old_fp-3] - _stack[old_fp-4];
-        ip = _stack[old_fp-2];
-        fp = _stack[old_fp-1];
-        _stack[++sp] = return_value;
-        break;
-      }
-      default:
-        printf("Failure: Invalid opcode %d", opcode);
+        FILL();
+        NEXT;
+      CASE(I_ADD):
+        BINARY(+);
+        NEXT;
+      CASE(I_MUL):
+        BINARY(*);
+        NEXT;
+      CASE(I_DIV):
+        BINARY(/);
+        NEXT;
+      CASE(I_MOD):
+        BINARY(%);
+        NEXT;
+      CASE(I_SUB):
+        BINARY(-);
+        NEXT;
+      CASE(I_INC):
+        TOS++;
+        NEXT;
+      CASE(I_NEG):
+        TOS = - TOS;
+        NEXT;
+      CASE(I_DEC):
+        TOS--;
+        NEXT;
+      CASE(I_LOADPUSH):
+        PUSH(data[pc->a]);
+        NEXT;
+      CASE(I_POPSTORE):
+        POP_TO(data[pc->a]);
+        NEXT;
+      CASE(I_FRPUSH):
+        PUSH(stack[fp + pc->a]);
+        NEXT;
+      CASE(I_FRPOP):
+        // fill after the store, which may be to the new top of stack
+        x = TOS;
+        sp--;
+        stack[fp + pc->a] = x;
+        FILL();
+        NEXT;
+      CASE(I_STORE):
+        data[pc->a] = TOS;
+        NEXT;
+      CASE(I_JNZ):
+        if (TOS) {
+          JUMP(pc->a);
+        }
+        NEXT;
+      CASE(I_JZ):
+        if (!TOS) {
+          JUMP(pc->a);
+        }
+        NEXT;
+      CASE(I_JMP):
+        JUMP(pc->a);
+      CASE(I_CALL):
+        ENTER();
+        JUMP(pc->a);
+      CASE(I_TAILCALL):
+        REENTER();
+        JUMP(pc->a);
+      CASE(I_RETURN):
+        // only ever the address after a CALL, so always an instruction
+        UNWIND();
+        JUMP(ip_map[y]);
+      CASE(I_FRPUSH_FRPUSH_ADD):
+        // the second slot can be the one the first push just wrote
+        PUSH(stack[fp + pc->a]);
+        TOS += (fp + pc->b == sp) ? TOS : stack[fp + pc->b];
+        NEXT;
+      CASE(I_ADD_FRPOP):
+        if (sp < 1) UNDERFLOW();
+        y = TOS;
+        x = stack[sp - 1];
+        sp -= 2;
+        stack[fp + pc->a] = x + y;
+        FILL();
+        NEXT;
+      CASE(I_DEC_JNZ):
+        if (--TOS) {
+          JUMP(pc->a);
+        }
+        NEXT;
+      CASE(I_PUSH_ADD):
+        TOS += pc->a;
+        NEXT;
+      CASE(I_FRPUSH_JZ):
+        PUSH(stack[fp + pc->a]);
+        if (!TOS) {
+          JUMP(pc->b);
+        }
+        NEXT;
+      CASE(I_FRPUSH_JNZ):
+        PUSH(stack[fp + pc->a]);
+        if (TOS) {
+          JUMP(pc->b);
+        }
+        NEXT;
+      CASE(I_VADD):
+        GENERIC(I_VADD);
+      CASE(I_VSUB):
+        GENERIC(I_VSUB);
+      CASE(I_VMUL):
+        GENERIC(I_VMUL);
+      CASE(I_VDIV):
+        GENERIC(I_VDIV);
+      CASE(I_VNEG):
+        GENERIC(I_VNEG);
+      generic_value:
+        if (sp < (x == I_VNEG ? 2 : 5)) UNDERFLOW();
+        SPILL();
+        // the operands' tag, if they have the same one
+        y = (x == I_VNEG || stack[sp] == stack[sp - 3]) ? stack[sp] : -1;
+        message = (x == I_VNEG) ? value_negate(&stack[sp - 2])
+          : value_arithmetic(x, &stack[sp - 5], &stack[sp - 2]);
+        if (message) {
+          FAIL("Failure: %s", message);
+        }
+        if (x != I_VNEG) {
+          sp -= 3;
+        }
+        FILL();
+        if ((uint32_t) y < TAG_COUNT && pc->b < QUICKEN_LIMIT) {
+          REWRITE(quickened[x][y]);
+        }
+        NEXT;
+      CASE(Q_ADD_I32):
+        QUICK_INT32(I_VADD, +);
+      CASE(Q_ADD_I64):
+        QUICK_INT64(I_VADD, +);
+      CASE(Q_ADD_F64):
+        QUICK_DOUBLE(I_VADD, +);
+      CASE(Q_SUB_I32):
+        QUICK_INT32(I_VSUB, -);
+      CASE(Q_SUB_I64):
+        QUICK_INT64(I_VSUB, -);
+      CASE(Q_SUB_F64):
+        QUICK_DOUBLE(I_VSUB, -);
+      CASE(Q_MUL_I32):
+        QUICK_INT32(I_VMUL, *);
+      CASE(Q_MUL_I64):
+        QUICK_INT64(I_VMUL, *);
+      CASE(Q_MUL_F64):
+        QUICK_DOUBLE(I_VMUL, *);
+      CASE(Q_DIV_I32):
+        GUARD_BINARY(TAG_INT32, I_VDIV);
+        // the generic form fails on 0, and wraps INT32_MIN / -1
+        if (stack[sp - 2] == 0 || stack[sp - 2] == -1) {
+          GENERIC(I_VDIV);
+        }
+        sp -= 3;
+        stack[sp - 2] /= stack[sp + 1];
+        TOS = TAG_INT32;
+        NEXT;
+      CASE(Q_DIV_I64):
+        GUARD_BINARY(TAG_INT64, I_VDIV);
+        if (value_int64(&stack[sp - 2]) == 0 || value_int64(&stack[sp - 2]) == -1) {
+          GENERIC(I_VDIV);
+        }
+        sp -= 3;
+        value_set_int64(&stack[sp - 2], value_int64(&stack[sp - 2]) / value_int64(&stack[sp + 1]));
+        TOS = TAG_INT64;
+        NEXT;
+      CASE(Q_DIV_F64):
+        QUICK_DOUBLE(I_VDIV, /);
+      CASE(Q_NEG_I32):
+        GUARD_UNARY(TAG_INT32);
+        stack[sp - 2] = (int32_t) (0u - (uint32_t) stack[sp - 2]);
+        NEXT;
+      CASE(Q_NEG_I64):
+        GUARD_UNARY(TAG_INT64);
+        value_set_bits(&stack[sp - 2], 0 - value_bits(&stack[sp - 2]));
+        NEXT;
+      CASE(Q_NEG_F64):
+        GUARD_UNARY(TAG_DOUBLE);
+        value_set_double(&stack[sp - 2], -value_double(&stack[sp - 2]));
+        NEXT;
+      CASE(I_VECADD):
+      CASE(I_VECSUB):
+      CASE(I_VECMUL):
+      CASE(I_VECLT):
+        if (sp < 3) UNDERFLOW();
+        if (!IN_DATA(stack[sp - 3], TOS) || !IN_DATA(stack[sp - 2], TOS) || !IN_DATA(stack[sp - 1], TOS)) {
+          RANGE_FAIL();
+        }
+        bulk_map(pc->opcode, data + stack[sp - 3], data + stack[sp - 2], data + stack[sp - 1], TOS);
+        sp -= 4;
+        FILL();
+        NEXT;
+      CASE(I_VECSUM):
+        if (sp < 1) UNDERFLOW();
+        if (!IN_DATA(stack[sp - 1], TOS)) {
+          RANGE_FAIL();
+        }
+        x = TOS;
+        sp--;
+        TOS = bulk_sum(data + stack[sp], x);
+        NEXT;
+      CASE(I_VECDOT):
+        if (sp < 2) UNDERFLOW();
+        if (!IN_DATA(stack[sp - 2], TOS) || !IN_DATA(stack[sp - 1], TOS)) {
+          RANGE_FAIL();
+        }
+        x = TOS;
+        sp -= 2;
+        TOS = bulk_dot(data + stack[sp], data + stack[sp + 1], x);
+        NEXT;
+      CASE(I_VECFILL):
+        if (sp < 2) UNDERFLOW();
+        if (!IN_DATA(stack[sp - 2], TOS)) {
+          RANGE_FAIL();
+        }
+        bulk_fill(data + stack[sp - 2], stack[sp - 1], TOS);
+        sp -= 3;
+        FILL();
+        NEXT;
+      CASE(I_VECCOPY):
+        if (sp < 2) UNDERFLOW();
+        if (!IN_DATA(stack[sp - 2], TOS) || !IN_DATA(stack[sp - 1], TOS)) {
+          RANGE_FAIL();
+        }
+        memmove(data + stack[sp - 2], data + stack[sp - 1], TOS * sizeof(int32_t));
+        sp -= 3;
+        FILL();
+        NEXT;
+      CASE(I_NATIVE):
+        if ((uint32_t) pc->a >= (uint32_t) native_count || natives[pc->a].arity != pc->b) {
+          FAIL("Failure: No native %d taking %d arguments", pc->a, pc->b);
+        }
+        if (sp < pc->b - 1) UNDERFLOW();
+        SPILL();
+        // the arguments, which the result replaces
+        x = sp - pc->b + 1;
+        message = natives[pc->a].function(vm, &stack[x], &y);
+        if (message) {
+          FAIL("Failure: %s", message);
+        }
+        sp = x;
+        TOS = y;
+        NEXT;
+      CASE(X_END):
+        SAVE_REGS(code_size);
         return;
+      CASE(X_BADJUMP):
+        FAIL("Failure: Invalid jump target %d", pc->a);
+      CASE(X_INVALID):
+        if ((uint32_t) pc->a < OPCODE_COUNT) {
+          FAIL("Failure: Truncated %s instruction", instructions[pc->a]);
+        }
+        FAIL("Failure: Invalid opcode %d", pc->a);
+#ifndef VM_THREADED_DISPATCH
     }
   }
+#endif
 }
 
-void trace_it(int32_t ip) {
-  int opcode = _code[ip];
-  state_dump();
-  printf("    REGS: ip=%d, sp=%d, fp=%d\n", ip, sp, fp);
-  printf("%04x %10s ", ip, instructions[opcode]);
-  int arg_count = args[opcode];
-  if (arg_count >= 1) {
-    printf("%4d", _code[ip+1]);
-  } else {
-    printf("    ");
+bool run_guarded(VM *vm, void (*run)(VM *vm)) {
+  sigjmp_buf jump;
+  Guard guard;
+  guard.regions[0] = &vm->stack_region;
+  guard.regions[1] = &vm->control_region;
+  guard.jump = &jump;
+  guard_up(&guard);
+  if (sigsetjmp(jump, 0)) {
+    // the handler has taken the guard down
+    output_flush(&vm->output);
+    if (guard.region == 1) {
+      if (guard.fault == FAULT_BELOW) {
+        printf("Failure: RETURN or TAILCALL outside a function");
+      } else {
+        printf("Stack overflow at csp=%ld",
+            (long) ((guard.address - (uint8_t*) vm->control) / sizeof(Frame)));
+      }
+    } else if (guard.fault == FAULT_BELOW) {
+      printf("Stack underflow");
+    } else {
+      printf("Stack overflow at sp=%ld",
+          (long) ((guard.address - (uint8_t*) vm->stack) / sizeof(int32_t)));
+    }
+    vm->ip = -1;
+    vm->sp = -1;
+    vm->fp = 0;
+    vm->csp = 0;
+    return false;
   }
-  if (arg_count >= 2) {
-    printf(", %4d", _code[ip+2]);
+  run(vm);
+  guard_down(&guard);
+  output_flush(&vm->output);
+  return true;
+}
+
+// the profiler times whole runs, so it needs to know where they end
+void execute(VM *vm) {
+  if (vm->profile) {
+    profile_start(vm->profile, vm->program->code, vm->program->code_size);
+    run_guarded(vm, interpret);
+    profile_stop(vm->profile);
   } else {
-    printf("      ");
+    run_guarded(vm, interpret);
   }
-  puts("\n");
 }
 
-void state_dump() {
+void state_dump(VM *vm) {
   int t;
   printf("   STACK: [ ");
-  for (t = 0; t <= sp; t++) {
-    printf("%d ", _stack[t]);
+  for (t = 0; t <= vm->sp; t++) {
+    printf("%d ", vm->stack[t]);
   }
   puts("]");
   return;
   printf("    DATA: [ ");
   for (t = 0; t <= 20; t++) {
-    printf("%d ", _data[t]);
+    printf("%d ", vm->data[t]);
   }
   puts("]");
 }
-  
@@ -6,10 +6,121 @@
 #include <stdint.h>
 #include <stdbool.h>
 
-extern void init(int32_t*code, int code_size, int32_t*data, int data_size);
-extern void execute(bool);
-extern void trace_it(int32_t);
-extern void state_dump();
+#include "verify.h"
+#include "trace.h"
+#include "profile.h"
+#include "guard.h"
+#include "native.h"
 
-#endif
+/*
+ * The stack slots and control frames a VM's stacks start out with room
+ * for, and can grow to unless set_stack_limits() says otherwise.
+ */
+#define STACK_SIZE 8192
+#define CONTROL_SIZE 8192
+#define STACK_LIMIT (1 << 24)
+#define CONTROL_LIMIT (1 << 22)
+/*
+ * How deep calls nest in JIT and AOT compiled code, which makes them on
+ * the C stack; deeper ones are left to the interpreter.
+ */
+#define NATIVE_DEPTH 8192
+
+/*
+ * A program ready to run: the bytecode plus the decoded form execute()
+ * actually runs. Nothing changes it once load_program() returns but the
+ * typed value instructions, which rewrite their own decoded form to suit
+ * the types they see. Every form checks the types for itself, so it makes
+ * no odds which one a VM finds, and any number of VMs, on any number of
+ * threads, can run the same program.
+ */
+typedef struct _Program {
+  int32_t *code;   // must not change while the program is loaded
+  int code_size;
+  struct _Insn *decoded[3]; // one threading per set of hooks, see execute()
+  int32_t *ip_map;          // bytecode address -> decoded index, or -1
+  int decoded_size;
+  bool verified;            // passed verify()
+  int data_size;            // ...so runs if the data is at least this big
+} Program;
+
+/*
+ * What a CALL saves to come back to, on the control stack: the data stack
+ * only ever holds values. A CALL leaves its arguments where they are, the
+ * callee's fp is just above them, so they're FRPUSH -1 (the last) down to
+ * FRPUSH -n (the first), and RETURN puts sp back to below them.
+ */
+typedef struct _Frame {
+  int32_t ip;  // return address
+  int32_t fp;  // the caller's
+  int32_t sp;  // the caller's, less the arguments
+} Frame;
+
+/*
+ * One machine: registers, stacks, and the data segment it works on. Each VM
+ * must only be used by one thread at a time.
+ *
+ * The stacks are guarded regions (guard.h) mapped by the first init(), and
+ * grow as they're used. Running off the end of either, or off the start of
+ * the control stack with a RETURN or TAILCALL outside a function, is
+ * caught as a fault rather than checked for by every instruction.
+ */
+typedef struct _VM {
+  int32_t ip;  // instruction pointer
+  int32_t sp;  // stack pointer
+  int32_t fp;  // frame pointer
+  int32_t csp; // control stack pointer: how many frames are in use
+  int32_t *stack;  // the stack region's second word, see execute()
+  Frame *control;  // the control stack region's first frame
+  int32_t *data;
+  int data_size;
+  Program *program;
+  uint64_t *ip_counts; // per-ip execution counts, see profile_ips()
+  Trace *trace;        // where to record each step, or NULL
+  Profile *profile;    // what to count and time each run into, or NULL
+  bool jit;            // may use the JIT, which is for one thread only
+  Region stack_region;
+  Region control_region;
+  Output output;       // what the natives have written, see native.h
+} VM;
 
+extern Program *load_program(int32_t *code, int code_size);
+/*
+ * Load a program only if verify() passes it, and NULL with the reason in
+ * *result if not. Verified programs need no more checks as they run than
+ * any other, but they can only be run from the start.
+ */
+extern Program *load_verified(int32_t *code, int code_size, Verification *result);
+extern void free_program(Program *program);
+
+/*
+ * A VM must be all zeroes before its first init(), as a static one is, or
+ * one from calloc(). init() maps its stacks the first time, or when the
+ * limits have changed, and keeps them for the next; free_stacks() unmaps
+ * them. A VM whose stacks can't be mapped can't run, and that's the end of
+ * the process.
+ */
+extern void init(VM *vm, Program *program, int32_t *data, int data_size);
+extern void free_stacks(VM *vm);
+/*
+ * How many stack slots and control frames the stacks of VMs init()ed from
+ * now on can grow to; 0 leaves either as it is.
+ */
+extern void set_stack_limits(int32_t slots, int32_t frames);
+extern void execute(VM *vm);
+/*
+ * Call run(vm) with vm's stacks guarded, as execute() runs the
+ * interpreter, for the tiers that compile the program and work on the
+ * stacks themselves. A fault on a stack fails the run with a message, the
+ * machine's registers lost and reset to an empty stack and ip -1, and
+ * returns false. Either way the output the natives buffered is flushed.
+ */
+extern bool run_guarded(VM *vm, void (*run)(VM *vm));
+extern void state_dump(VM *vm);
+/*
+ * Count how many times each bytecode address is executed into counts,
+ * which must have room for the whole code segment. NULL turns it off.
+ */
+extern void profile_ips(VM *vm, uint64_t *counts);
+
+#endif
@@ -0,0 +1,173 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "opcodes.h"
+#include "vm.h"
+#include "image.h"
+#include "snapshot.h"
+
+/*
+ * Run or list a program image written by "demo -o" or "interp -o".
+ *
+ *   vmimage [-v] IMAGE   run it from its entry point, verified first with -v,
+ *                        then show the stack and every variable
+ *   vmimage -l IMAGE     list the header, the symbols and the code
+ *   vmimage -w SNAPSHOT IMAGE
+ *                        run it to its first STOP, then snapshot the VM
+ *                        there, into SNAPSHOT
+ *   vmimage -r SNAPSHOT  carry on from a snapshot, in a clone of the VM,
+ *                        then show the stack
+ *
+ * -s SLOTS and -d FRAMES set how far the stack and the control stack can
+ * grow, in words and calls deep, before the run fails with an overflow.
+ */
+
+static void list(Image *image) {
+  ImageHeader *header = image->header;
+  int32_t at;
+  int i;
+  printf("version %u, entry %d\n", header->version, header->entry);
+  printf("code: %d words at %u\n", header->code_size, header->code_offset);
+  printf("data: %d words at %u\n", header->data_size, header->data_offset);
+  printf("symbols: %d at %u\n", header->symbol_count, header->symbols_offset);
+  for (i = 0; i < header->symbol_count; i++) {
+    printf("  %-16s @%d\n", image_symbol_name(image, i), image->symbols[i].data_offset);
+  }
+  for (at = 0; at < header->code_size; ) {
+    int32_t opcode = image->code[at];
+    int arg_count;
+    if ((uint32_t) opcode >= OPCODE_COUNT) {
+      printf("%04x %10d\n", at, opcode);
+      at++;
+      continue;
+    }
+    arg_count = args[opcode];
+    printf("%04x %10s", at, instructions[opcode]);
+    for (i = 1; i <= arg_count && at + i < header->code_size; i++) {
+      printf(i == 1 ? " %4d" : ", %4d", image->code[at + i]);
+    }
+    printf("\n");
+    at += 1 + arg_count;
+  }
+}
+
+static int resume(char *path) {
+  static VM vm;
+  char error[96];
+  Snapshot *snapshot = snapshot_open(path, error, sizeof(error));
+  if (!snapshot) {
+    fprintf(stderr, "%s: %s\n", path, error);
+    return 1;
+  }
+  if (!snapshot_clone(snapshot, &vm)) {
+    fprintf(stderr, "%s: can't clone the snapshot\n", path);
+    snapshot_close(snapshot);
+    return 1;
+  }
+  execute(&vm);
+  state_dump(&vm);
+  snapshot_release(snapshot, &vm);
+  snapshot_close(snapshot);
+  return 0;
+}
+
+static bool save(VM *vm, char *path) {
+  Snapshot *snapshot;
+  bool ok;
+  if (vm->ip < 0) {
+    fprintf(stderr, "%s: the run failed, so there's nothing to snapshot\n", path);
+    return false;
+  }
+  snapshot = snapshot_take(vm);
+  if (!snapshot) {
+    fprintf(stderr, "%s: can't take a snapshot\n", path);
+    return false;
+  }
+  ok = snapshot_write(snapshot, path);
+  if (!ok) {
+    perror(path);
+  }
+  snapshot_close(snapshot);
+  return ok;
+}
+
+int main(int argc, char **argv) {
+  static VM vm;
+  char error[96];
+  Verification result;
+  Program *program;
+  Image *image;
+  bool listing = false;
+  bool verified = false;
+  char *path = NULL;
+  char *snapshot_path = NULL;
+  bool resuming = false;
+  int status = 0;
+  int i;
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-l") == 0) {
+      listing = true;
+    } else if (strcmp(argv[i], "-v") == 0) {
+      verified = true;
+    } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      set_stack_limits(atoi(argv[++i]), 0);
+    } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+      set_stack_limits(0, atoi(argv[++i]));
+    } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+      snapshot_path = argv[++i];
+    } else if (strcmp(argv[i], "-r") == 0) {
+      resuming = true;
+    } else {
+      path = argv[i];
+    }
+  }
+  if (!path) {
+    fprintf(stderr, "usage: %s [-l | -v] [-s SLOTS] [-d FRAMES] [-w SNAPSHOT] IMAGE\n"
+        "       %s [-s SLOTS] [-d FRAMES] -r SNAPSHOT\n", argv[0], argv[0]);
+    return 2;
+  }
+  if (resuming) {
+    return resume(path);
+  }
+  image = image_open(path, error, sizeof(error));
+  if (!image) {
+    fprintf(stderr, "%s: %s\n", path, error);
+    return 1;
+  }
+  if (listing) {
+    list(image);
+    image_close(image);
+    return 0;
+  }
+
+  // the code is run where it's mapped, and the data changed in place
+  if (verified) {
+    program = load_verified(image->code, image->header->code_size, &result);
+    if (!program) {
+      printf("Rejected: %s at ip=%d\n", result.error, result.ip);
+      image_close(image);
+      return 1;
+    }
+  } else {
+    program = load_program(image->code, image->header->code_size);
+  }
+  init(&vm, program, image->data, image->header->data_size);
+  vm.ip = image->header->entry;
+  execute(&vm);
+  if (snapshot_path && !save(&vm, snapshot_path)) {
+    status = 1;
+  }
+  state_dump(&vm);
+  for (i = 0; i < image->header->symbol_count; i++) {
+    int32_t offset = image->symbols[i].data_offset;
+    if (offset >= 0 && offset < image->header->data_size) {
+      printf("%s = %d\n", image_symbol_name(image, i), image->data[offset]);
+    }
+  }
+  free_program(program);
+  image_close(image);
+  return status;
+}